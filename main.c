@@ -24,6 +24,7 @@
 #define _WITH_GETLINE
 #include "config.h"
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -37,14 +38,42 @@
 #include <panel.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include <regex.h>
+#include <fnmatch.h>
+#include <math.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
 #ifdef HAVE_SYS_EVENT_H
 #include <sys/event.h>
 #elif defined(HAVE_EPOLL_CREATE)
 #include <sys/epoll.h>
 #endif /* !HAVE_SYS_EVENT_H */
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+#ifdef HAVE_SYS_FANOTIFY_H
+#include <sys/fanotify.h>
+#endif
+#ifdef HAVE_SYS_VFS_H
+#include <sys/vfs.h>
+#endif
+#ifdef HAVE_SPAWN_H
+#include <spawn.h>
+#endif
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+#include <sys/syscall.h>
+#endif
+#ifdef HAVE_DLFCN_H
+#include <dlfcn.h>
+#endif
+#include "treetop_plugin.h"
 
 
 /* Output routines */
@@ -70,6 +99,20 @@
 /* If the file has the 'UPDATED' state */
 #define UPDATED_CHAR "*"
 
+/* If the file is pinned in a pane */
+#define PINNED_CHAR "#"
+
+/* If the line rate of the file is far above, or below, its usual one */
+#define RATE_UP_CHAR   "^"
+#define RATE_DOWN_CHAR "v"
+
+/* If the file wrote a line of a kind it never wrote before, lately */
+#define NOVEL_CHAR "!"
+
+
+/* Bytes read from the end of files which are not shown in details */
+#define ROW_BYTES 1024
+
 
 /* Default delay (seconds) */
 #define DEFAULT_TIMEOUT_SECS 10
@@ -77,14 +120,309 @@
 
 /* Max */
 #define MAX(_a, _b) (((_a)>(_b)) ? (_a) : (_b))
+#define MIN(_a, _b) (((_a)<(_b)) ? (_a) : (_b))
 
 
 /* Window dimensions */
 #define INNER_WIN_LINES (LINES-3)
 #define INNER_WIN_COLS (COLS-2)
 
-#define SHOW_DETAILS 0x1
-#define HIDE_DETAILS 0x2
+#define SHOW_DETAILS   0x1
+#define HIDE_DETAILS   0x2
+#define PIN_PANE       0x3  /* Pin (or unpin) the selected file       */
+#define UNPIN_PANE     0x4  /* Unpin the file of the focused pane     */
+#define SHOW_PANES     0x5
+#define HIDE_PANES     0x6
+#define PANE_FOCUS     0x7  /* Focus the next pane                    */
+#define PANE_UP        0x8  /* Scroll the focused pane                */
+#define PANE_DOWN      0x9
+#define PANE_PAGE_UP   0xa
+#define PANE_PAGE_DOWN 0xb
+#define PANE_FOLLOW    0xc  /* Back to following the end of the file */
+#define TOGGLE_PAUSE   0xd  /* Freeze (or unfreeze) the display      */
+#define RESIZE_SCREEN  0xe  /* The terminal was resized               */
+#define DETAILS_UP     0xf  /* Page through a long line in details    */
+#define DETAILS_DOWN   0x10
+#define SHOW_MEMORY    0x11 /* Where the memory goes                  */
+#define MEMORY_SORT    0x12 /* Sort the files on the next column      */
+#define PROMPT_TIME    0x13 /* A key was typed at the time prompt     */
+#define SEEK_TIME      0x14 /* Show details from the time typed in    */
+#define DETAILS_FOLLOW 0x15 /* Back to the end of the file in details */
+#define LOW_POWER      0x16 /* The terminal lost the focus            */
+#define FULL_POWER     0x17 /* A key was pressed, or focus came back  */
+#define SORT_ANOMALY   0x18 /* Unusual line rates first, or not       */
+#define SHOW_TEMPLATES 0x19 /* Messages logged the most right now     */
+#define SHOW_UNREAD    0x1a /* Details from where they were last seen */
+#define SHOW_PLUGINS   0x1b /* Time spent in the plugins             */
+#define SHOW_STEPS     0x1c /* Counters of the steps of the shards   */
+#define SHOW_HEATMAP   0x1d /* Line rates of the files over time      */
+#define HEAT_GROUP     0x1e /* Heatmap rows by file or by directory   */
+
+/* Default and max number of files pinned in the split view */
+#define DEFAULT_PANES 4
+#define MAX_PANES 16
+
+/* Bytes of each pinned file kept to scroll back through */
+#define PANE_RETAIN (128 * 1024)
+
+/* Bytes read at once when accounting for appended data */
+#define CONSUME_CHUNK (64 * 1024)
+
+/* How long a message stays on screen (ms) */
+#define MESSAGE_MS 15000
+
+/* Longest line handed to line consumers (hooks), the rest is cut */
+#define MAX_LINE_LEN 4096
+
+/* Timestamp layouts looked for in the lines, for the ingestion lag */
+#define TS_NONE   0
+#define TS_ISO    1  /* 2024-05-01 12:34:56, 2024-05-01T12:34:56.789+02:00 */
+#define TS_SYSLOG 2  /* May  1 12:34:56 */
+#define TS_CLF    3  /* 01/May/2024:12:34:56 +0200 (web server logs) */
+
+/* Bytes at the start of a line a timestamp is looked for in, and lines
+ * looked at before giving up on a file
+ */
+#define TS_SCAN   64
+#define TS_PROBES 16
+
+/* Width of the lag column of the rows, and of the unread lines one */
+#define LAG_WIDTH 9
+#define UNREAD_WIDTH 8
+
+/* Line rates: the lines of each file are counted every RATE_TICK_MS, the
+ * baseline (mean and variance of the counts) moves by RATE_ALPHA of each
+ * new one.  A file is flagged once its baseline has RATE_WARMUP samples and
+ * a count deviates from it by RATE_SCORE standard deviations (the variance
+ * never under the mean, as for counts of random events).  Deviations weigh
+ * no more than that in the baseline, so it takes a while to get used to a
+ * new rate.
+ */
+#define RATE_TICK_MS 10000
+#define RATE_ALPHA   0.1
+#define RATE_WARMUP  12
+#define RATE_SCORE   4
+
+/* Recurring messages: the lines with their numbers, hex ids and UUIDs
+ * masked (TOPK_MASK) are counted by each shard in a count-min sketch of
+ * TOPK_DEPTH rows of TOPK_WIDTH counters, the TOPK_KEEP templates counted
+ * the most being kept on a heap (up to TOPK_TEXT bytes of them).  Counts
+ * cover the last TOPK_WINDOW_MS, in two halves: the older one is dropped
+ * whenever a new one starts.
+ */
+#define TOPK_WIDTH     1024
+#define TOPK_DEPTH     4
+#define TOPK_KEEP      32
+#define TOPK_TEXT      160
+#define TOPK_WINDOW_MS 60000
+#define TOPK_MASK      "<*>"
+
+/* Fields of the lines picked by rules: at most MAX_FIELDS rules of each
+ * kind, their sketches estimated every FIELD_TICK_MS
+ */
+#define MAX_FIELDS    32
+#define FIELD_TICK_MS 1000
+
+/* Distinct values of a field: a HyperLogLog sketch of HLL_REGS registers
+ * for each half of the last HLL_WINDOW_MS (the older one dropped whenever a
+ * new one starts), shown in a column DISTINCT_WIDTH wide
+ */
+#define HLL_BITS       11
+#define HLL_REGS       (1 << HLL_BITS)
+#define HLL_WINDOW_MS  60000
+#define DISTINCT_WIDTH 8
+
+/* Quantiles of a numeric field: a DDSketch for each half of the last
+ * DDS_WINDOW_MS, the values counted in DDS_BINS bins each DDS_GAMMA times
+ * as wide as the one before (DDS_ALPHA off at most), from DDS_MIN (what is
+ * less counts as that) up to about 1e12 times as much.  The median, 95th and
+ * 99th percentiles are shown in a column QUANTILES_WIDTH wide.
+ */
+#define DDS_ALPHA       0.02
+#define DDS_GAMMA       ((1 + DDS_ALPHA) / (1 - DDS_ALPHA))
+#define DDS_BINS        1024
+#define DDS_MIN         1e-6
+#define DDS_WINDOW_MS   60000
+#define QUANTILES_WIDTH 18
+
+/* Activity heatmap: each file counts its lines in a ring of HEAT_BUCKETS
+ * buckets of HEAT_BUCKET_MS, shown as one column each with HEAT_SHADES
+ * (twice as many lines from one shade to the next), after the file name cut
+ * to HEAT_NAME_WIDTH
+ */
+#define HEAT_BUCKETS    120
+#define HEAT_BUCKET_MS  5000
+#define HEAT_SHADES     " .:-=+*#%@"
+#define HEAT_LEVELS     10
+#define HEAT_NAME_WIDTH 24
+
+/* Lines of a new kind: the templates of the lines of each file go through
+ * a scalable Bloom filter, a first slice for NOVEL_FIRST templates with
+ * NOVEL_HASHES hashes, each next one holding twice as many with one more
+ * hash (about 1.5% false positives in all).  A file writing more kinds of
+ * lines than NOVEL_SLICES slices hold is no longer looked at.  Lines are
+ * only new once the file was learnt for NOVEL_WARMUP_MS, and the file is
+ * flagged for NOVEL_MS.
+ */
+#define NOVEL_FIRST     1024
+#define NOVEL_HASHES    7
+#define NOVEL_SLICES    6
+#define NOVEL_WARMUP_MS 60000
+#define NOVEL_MS        60000
+
+/* Sparse index of a file, to show its details from a point in time: one
+ * checkpoint every INDEX_STEP bytes, at most INDEX_BUDGET bytes indexed
+ * per shard round, INDEX_FP bytes hashed to tell a cached index still
+ * describes the file
+ */
+#define INDEX_STEP   (1024 * 1024)
+#define INDEX_BUDGET (32 * 1024 * 1024)
+#define INDEX_FP     4096
+#define INDEX_MAGIC  "ttidx01"
+
+/* What the memory we allocate is used for */
+#define MEM_TAIL    0  /* Tails of the files, for the rows and details */
+#define MEM_HISTORY 1  /* Pinned files kept to scroll back through */
+#define MEM_LINES   2  /* Partial lines, timestamps, message counts */
+#define MEM_INDEX   3  /* Files, directories, hash tables and queues */
+#define MEM_CURSES  4  /* Menu items */
+#define MEM_BUFFERS 5  /* Read buffers of the shards, hook batches */
+#define MEM_KINDS   6
+
+/* Bookkeeping of the allocator for each block (glibc: size header and
+ * alignment, on average)
+ */
+#define MEM_BLOCK_OVERHEAD (2 * sizeof(size_t))
+
+/* Command hooks: max number of rules, of commands running at once, of
+ * bytes of matched lines batched per rule, the default debounce window and
+ * how often finished commands are reaped
+ */
+#define MAX_HOOKS 32
+#define MAX_HOOK_CHILDREN 64
+#define HOOK_BATCH (256 * 1024)
+#define DEFAULT_DEBOUNCE_SECS 5
+#define HOOK_REAP_MS 200
+
+/* Line processor plugins: max number of them, and of lines handed over to
+ * them at once
+ */
+#define MAX_PLUGINS 8
+#define PLUGIN_BATCH 256
+
+/* Groups of files declared in the config: max number of them, and length
+ * of the text of their rows
+ */
+#define MAX_GROUPS 64
+#define GROUP_ROW_LEN 512
+
+/* A config entry ending with this names a directory tree to watch */
+#define TREE_SUFFIX "/**"
+
+/* Adaptive polling bounds (ms) for directories (and their files) we could
+ * not afford an inotify watch for
+ */
+#define POLL_MIN_MS 250
+#define POLL_MAX_MS 8000
+
+/* Inotify watches left for the other programs of the user by default */
+#define WATCH_RESERVE 1024
+
+/* Max number of mounts watched whole with fanotify (-F) */
+#define FAN_MOUNTS 16
+
+/* Max number of threads crawling a tree at startup */
+#define MAX_CRAWLERS 16
+
+/* Number of buckets of the path -> file hash table (power of two) */
+#define PATH_HASH_SIZE (1 << 16)
+
+/* Max number of network mounts given a shard of their own, so a hung server
+ * only holds up its own files
+ */
+#define MOUNT_SHARDS 8
+
+/* A shard making no progress for that long (ms) is stuck in I/O: its files
+ * are shown as unresponsive until it comes back
+ */
+#define IO_TIMEOUT_MS 3000
+#define UNRESPONSIVE " unresponsive"
+
+/* Max number of shards, and max number picked from the number of cores */
+#define MAX_SHARDS 64
+#define AUTO_SHARDS 16
+
+/* Updates a shard may publish before the display thread catches up */
+#define SHARD_QUEUE 4096
+
+/* Backpressure: a file with more than PIPE_BACKLOG bytes appended in one
+ * round of its shard has only one line in 2, 4... PIPE_SAMPLE_MAX looked at
+ * closely (templates, new kinds, fields, timestamps) while it keeps coming
+ * in that fast, every line is still counted and goes to hooks and plugins
+ */
+#define PIPE_BACKLOG    (4 * 1024 * 1024)
+#define PIPE_SAMPLE_MAX 64
+
+/* Steps a shard takes on a changed file, each with counters of its own */
+#define STEP_DETECT   0      /* Noticed as changed (files) */
+#define STEP_READ     1      /* Appended data read (bytes) */
+#define STEP_ANALYZE  2      /* Lines split and looked at */
+#define STEP_RENDER   3      /* Tail read and handed over to the display */
+#define STEPS         4
+
+/* How often shards look at the files which send no events (ms), while
+ * they change.  Plain files are then looked at less and less often, up to
+ * every PLAIN_POLL_MAX_MS, while they do not (every POLL_MAX_MS when
+ * inotify tells of their changes, only to follow them if rotated).
+ */
+#define SHARD_TICK_MS 25
+#define PLAIN_POLL_MAX_MS 1000
+
+/* Minimum time between two frames (ms), and time between two frames when
+ * nothing happens
+ */
+#define FRAME_MS 40
+#define IDLE_MS 1000
+
+/* Unfocused, or no key pressed for -i secs (DEFAULT_IDLE_SECS): the screen
+ * is drawn, and the tails of the files read, only once every LOW_POWER_MS
+ */
+#define LOW_POWER_MS 5000
+#define DEFAULT_IDLE_SECS 300
+
+/* CPU budget (--cpu-budget): the CPU time used is looked at every
+ * GOVERN_TICK_MS.  Over budget, one more step is taken: frames at most every
+ * GOVERN_FRAME_MS, then the tails read at most every GOVERN_TAILS_MS, then
+ * polled files looked at GOVERN_POLL times less often.  Under half the
+ * budget, one step is undone.  Lines are still all counted, hooks all run.
+ */
+#define GOVERN_TICK_MS  1000
+#define GOVERN_FRAME_MS 250
+#define GOVERN_TAILS_MS 1000
+#define GOVERN_POLL     4
+#define GOVERN_STEPS    3
+
+/* Memory pressure (Linux PSI): caches are shed one more step every
+ * PSI_TICK_MS while tasks stall on memory PSI_HIGH percent of the time or
+ * more, one step comes back under PSI_LOW percent.  The kernel tells as soon
+ * as PSI_TRIGGER is reached (150 ms of stalls within 2 s).
+ */
+#define PSI_PATH    "/proc/pressure/memory"
+#define PSI_TRIGGER "some 150000 2000000"
+#define PSI_TICK_MS 1000
+#define PSI_HIGH    10.0
+#define PSI_LOW     1.0
+#define PSI_STEPS   3
+
+/* Nice value and I/O priority (best effort class, lowest level) of the
+ * shards with --nice
+ */
+#define SHARD_NICE   10
+#define SHARD_IOPRIO ((2 << 13) | 7)
+
+/* Focus reports of the terminal (xterm, tmux with focus-events) */
+#define KEY_FOCUS_IN  (KEY_MAX + 1)
+#define KEY_FOCUS_OUT (KEY_MAX + 2)
 
 #define TITLE "}-= TreeTop =-{"
 
@@ -104,454 +442,6946 @@ static pthread_mutex_t mtx_post_menu;
 /* Mutex to protect doupdate calls */
 static pthread_mutex_t mtx_update_panels;
 
-/* Pipe to send "commands" from the getch loop to the reading thread */
+/* Pipe to send "commands" from the getch loop to the display thread */
 static int fildes[2];
 
 /* I always forget these */
 #define PIPE_READ  0
 #define PIPE_WRITE 1
 
+struct _dir_t;
+struct _pane_t;
+struct _shard_t;
+
+/* Checkpoint of an index: a line start, its number and its timestamp (the
+ * one before if it has none)
+ */
+typedef struct _checkpoint_t
+{
+    off_t offset;
+    unsigned long line;
+    time_t t;
+} checkpoint_t;
+
+typedef struct _index_t
+{
+    checkpoint_t *cps;
+    size_t n, size;
+    off_t done;              /* Bytes indexed */
+    off_t saved;             /* Bytes covered by the cache on disk */
+    off_t next;              /* Where the next checkpoint goes */
+    unsigned long lines;     /* Lines in the bytes indexed */
+    int fmt, off;            /* Timestamp layout of the file */
+    dev_t dev;               /* File indexed */
+    ino_t ino;
+    int loaded;              /* The cache was looked at */
+    FILE *fp;                /* Open while it is being built */
+} index_t;
+
+/* Header of an index in the cache, followed by its checkpoints */
+typedef struct _index_file_t
+{
+    char magic[8];
+    unsigned long long dev, ino, done, lines, head, tail, n;
+    int fmt, off;
+} index_file_t;
+
+/* Timestamp layout of a file and the last timestamp parsed, most lines are
+ * written within the same second as the one before
+ */
+typedef struct _stamp_t
+{
+    int fmt;                 /* TS_ISO, ..., TS_NONE until one is found */
+    int off;                 /* Where it starts in the lines */
+    int probes;              /* Lines looked at without finding one */
+    size_t len;              /* Bytes up to the seconds */
+    char prefix[24];         /* Last timestamp parsed, up to the seconds */
+    time_t t;                /* What it stands for */
+} stamp_t;
+
+/* Template of a message and how many lines it matched over the window */
+typedef struct _template_t
+{
+    unsigned long long hash;
+    unsigned long count;
+    char text[TOPK_TEXT];
+} template_t;
+
+/* Messages counted by a shard: sketch of both halves of the window, and a
+ * min-heap of the templates counted the most
+ */
+typedef struct _topk_t
+{
+    unsigned cms[2][TOPK_DEPTH][TOPK_WIDTH];
+    unsigned long lines[2];  /* Lines counted in each half */
+    int cur;                 /* Half being counted */
+    long long turn;          /* When the next half starts (ms) */
+    template_t heap[TOPK_KEEP];
+    int n;
+    pthread_mutex_t mtx;     /* The display thread reads them */
+} topk_t;
+
+/* Field of the lines picked by a rule, in the files it applies to */
+typedef struct _field_t
+{
+    int field;               /* Whitespace separated, from 1; 0: the regex */
+    regex_t re;              /* Its first group, or what it matches */
+    char *in;                /* Glob on the file name, NULL for every file */
+} field_t;
+
+/* Distinct values of the field of a file: a sketch for each half of the
+ * window, the shard writes them and the display thread estimates them
+ */
+typedef struct _hll_t
+{
+    unsigned char regs[2][HLL_REGS];
+    int cur;                 /* Half being counted */
+    long long turn;          /* When the next half starts (ms) */
+    const field_t *rule;
+} hll_t;
+
+/* Values of the numeric field of a file: a sketch for each half of the
+ * window, the shard writes them and the display thread estimates them
+ */
+typedef struct _dds_t
+{
+    unsigned bins[2][DDS_BINS];
+    int cur;                 /* Half being counted */
+    long long turn;          /* When the next half starts (ms) */
+    const field_t *rule;
+} dds_t;
+
+/* Lines of a file in the last HEAT_BUCKETS buckets, written by the shard */
+typedef struct _heat_t
+{
+    unsigned counts[HEAT_BUCKETS];
+    long long bucket;        /* Being counted: time / HEAT_BUCKET_MS */
+} heat_t;
+
+/* Templates of the lines a file wrote, and the last one never seen before */
+typedef struct _bloom_t
+{
+    unsigned char *bits[NOVEL_SLICES];
+    unsigned long long mask[NOVEL_SLICES]; /* Bits of the slice, less one */
+    int slices;
+    int full;                /* Gave up: no room for more */
+    unsigned long n;         /* Templates in the last slice */
+    size_t bytes;
+    long long since;         /* First line (ms) */
+    unsigned long novel;     /* Lines of a new kind */
+    long long novel_at;      /* When the last one came, 0 if none */
+    char text[TOPK_TEXT];    /* Its template, under the buffer mutex */
+} bloom_t;
+
+/* Group of files declared by a '[NAME]' line of the config, shown as a
+ * row of its own.  Its totals are kept up as its files change, never by
+ * going through them.
+ */
+typedef struct _group_t
+{
+    char *name;              /* '[NAME]', shown as the name of its row */
+    ITEM *item;
+    char row[GROUP_ROW_LEN]; /* Description of its row, under the buffer
+                              * mutex */
+    int open;                /* Its files are listed under it */
+    int n_files;             /* Display side: files in the menu */
+    int placed;              /* Display side: where its next file goes */
+    unsigned long lines;     /* Lines appended to its files, by the shards */
+    unsigned long alerts;    /* Lines matching a hook or of a new kind */
+    struct _data_t *fresh;   /* File which got lines last, if any */
+    unsigned long rate_lines; /* Display side: 'lines' at the last sample */
+    float rate;              /* Lines per second over the last sample */
+    int severe[TREETOP_ALERT + 1]; /* Display side: files flagged at each
+                                    * severity */
+} group_t;
+
 /* File information */
 typedef struct _data_t
 {
     int fd;
-    FILE *fp;
+    FILE *fp;   /* NULL between reads for files found in a watched tree */
     const char *full_path;
     const char *base_name;
     char *line; /* pointer to the last line in buff */
     char *buff; /* file content */
+    int buff_size;
     struct _data_t *next;
+    struct _data_t *prev;
     state_e state;
+    int dirty;   /* Content changed and must be accounted for */
+    int stale;   /* Displayed content must be read again */
+    int shed;    /* Tail dropped for lack of memory, display side */
+    off_t offset;         /* Bytes accounted for, -1 to start at the end */
+    off_t line_start;     /* Where the line being written starts */
+    off_t last_start;     /* Where the last complete line starts, -1 if
+                           * unknown (long lines are never kept whole) */
+    unsigned long lines;  /* Lines appended since we started */
+    unsigned long pause_lines; /* 'lines' when the display was frozen */
+    off_t read_offset;    /* 'offset' when its details were last shown */
+    unsigned long read_lines;  /* 'lines' then */
+    char *carry;          /* Partial line left from the previous read */
+    size_t carry_len;
+    off_t carry_at;       /* Where it starts */
+    unsigned long hooks;  /* Hooks matching this file (bit mask) */
+    int hooks_known;
+    unsigned long plugins; /* Plugins looking at this file (bit mask) */
+    int plugins_known;
+    treetop_note_t *notes; /* What each plugin tells of it, then copies of
+                            * that under the buffer mutex, for display */
+    int highlight;        /* Display side: the most any plugin asked for */
+    stamp_t *stamp;       /* Timestamps of the lines, shard side */
+    index_t *index;       /* Built when looking for a point in time */
+    long lag;             /* Seconds the last line was read after it was
+                           * written, -1 if the lines carry no timestamp */
+    unsigned long rate_lines; /* Display side: 'lines' at the last sample */
+    float rate_mean, rate_var;  /* Baseline of the lines per sample */
+    float score;          /* Deviation of the last sample from the
+                           * baseline, in standard deviations */
+    int rate_n;           /* Samples in the baseline */
+    hll_t *hll;           /* Distinct values of a field, if a rule applies */
+    dds_t *dds;           /* Quantiles of a field, if a rule applies */
+    int fields_known;
+    int sample;           /* Under backpressure: one line in 'sample' is
+                           * looked at closely, 0 or 1 for every line */
+    long long sampled_at; /* Last read under backpressure (ms) */
+    long distinct;        /* Display side: estimate of the distinct values */
+    float pct[3];         /* Display side: median, 95th and 99th percentiles,
+                           * negative if no values */
+    heat_t *heat;         /* Lines over time, for the heatmap */
+    bloom_t *bloom;       /* Kinds of lines written */
+    unsigned long novel_seen; /* Display side: 'novel' told of */
+    group_t *group;       /* Group it was listed in, if any */
+    int severity;         /* Display side: how it counts in its group */
     ITEM *item;  /* Curses menu item for this file */
-    time_t last_mod;
+    struct timespec last_mod;
+    ino_t ino;   /* Inode being read, plain files follow another one once
+                  * rotated */
+    dev_t dev;
+    struct _pane_t *pane; /* Pane following this file, if pinned */
+    struct _shard_t *shard; /* Shard watching and reading this file */
+    struct _data_t *fnext;  /* Next plain (not tree) file of the shard */
+    struct _data_t *wnext;  /* Work list of the shard: dirty or stale */
+    struct _data_t *wprev;
+    int work;               /* In the work list */
+    int queued;             /* Published, not taken in by the display yet */
+    off_t last_size;
+    long poll_ival;         /* Adaptive polling interval (ms) */
+    long long next_poll;    /* When to stat this file again (ms) */
+
+    /* Plain (not tree) files only */
+    int wd;                  /* inotify watch, -1 if only polled */
+
+    /* Tree entries only */
+    struct _dir_t *dir;      /* Directory this file was found in */
+    struct _data_t *dnext;   /* Next file of the same directory */
+    struct _data_t *hnext;   /* Next file in the same path hash bucket */
+    struct _data_t *inext;   /* Next file in the same inode hash bucket */
 } data_t;
 
-/* Screen (ncurses state and content) */
-typedef struct _screen_t
+/* Directory of a watched tree */
+typedef struct _dir_t
+{
+    char *path;
+    int wd;                  /* inotify watch, -1 if this dir is polled */
+    size_t rootlen;          /* Length of the root path of the tree */
+    struct timespec last_mod; /* Polled dirs: mtime at the last scan */
+    long poll_ival;
+    long long next_poll;
+    int root;                /* Root of its tree */
+    data_t *files;
+    struct _shard_t *shard;  /* Owner of the directory and of its files */
+    struct _dir_t *next;     /* Next directory of the same shard */
+    struct _dir_t *prev;
+    struct _dir_t *hnext;    /* Next directory in the same hash bucket */
+} dir_t;
+
+/* Watch budget and registry of the directories of every watched tree */
+static struct
+{
+    long budget;             /* Max number of inotify watches we may use */
+    long used;
+    int n_polled;            /* Directories polled for lack of a watch */
+    int n_dirs;
+    int n_files;
+    dir_t *by_path[PATH_HASH_SIZE];
+    pthread_mutex_t mtx;     /* Crawlers register directories in parallel */
+} watches = { -1, 0, 0, 0, 0, { NULL }, PTHREAD_MUTEX_INITIALIZER };
+
+/* Whole mounts watched with fanotify instead of watching directories: the
+ * shards are told of every file modified there and pick theirs by inode,
+ * directories are only polled for files coming and going.
+ */
+static struct
+{
+    int on;                  /* Asked for with -F */
+    int n_devs;
+    dev_t devs[FAN_MOUNTS];  /* Devices of the mounts marked */
+} fan;
+
+/* Accounting totals */
+typedef struct _totals_t
+{
+    unsigned long lines, bytes, added, removed;
+    long long since;
+} totals_t;
+
+/* Counters of a step of a shard, written by the shard only */
+typedef struct _step_t
+{
+    unsigned long items;     /* Gone through it */
+    unsigned long stalls;    /* Times it could not keep up */
+    long long ns;            /* Time spent in it */
+} step_t;
+
+/* Request sent to a shard by path, so it never outlives a removed file */
+typedef struct _shard_msg_t
+{
+    int what;                /* SHARD_REFRESH, SHARD_GROW or SHARD_DROP */
+    size_t rootlen;
+    struct _shard_msg_t *next;
+    char path[];
+} shard_msg_t;
+
+/* Lines of a file being batched for its plugins */
+typedef struct _plugin_batch_t
+{
+    size_t n;
+    const char *lines[PLUGIN_BATCH];
+    size_t lens[PLUGIN_BATCH];
+    off_t offsets[PLUGIN_BATCH];
+} plugin_batch_t;
+
+#define SHARD_REFRESH 1      /* Read the tail of a file again */
+#define SHARD_GROW    2      /* Crawl a new directory of a tree */
+#define SHARD_DROP    3      /* Drop a directory of a tree */
+#define SHARD_SEEK    4      /* Find 'details_seek' in a file */
+#define SHARD_SHED    5      /* Drop the indexes, memory is short */
+
+/* A share of the files with the thread watching and reading them.  Tree
+ * directories belong to the shard of the top level directory they are in,
+ * so a shard only ever changes its own part of the trees.
+ */
+typedef struct _shard_t
+{
+    int id;
+    pthread_t thread;
+    int evfd;                /* epoll (or kqueue) instance */
+    int wake[2];             /* Wakes the shard up for requests */
+    int ino;                 /* inotify instance, -1 if not available */
+    int fan;                 /* fanotify instance, -1 if not used */
+    data_t **by_ino;         /* Tree file lookup by inode, with fanotify */
+    dir_t *dirs;
+    dir_t **by_wd;
+    int by_wd_size;
+    data_t **by_fwd;         /* Plain files by inotify watch */
+    int by_fwd_size;
+    data_t **hash;           /* Tree file lookup by full path */
+    unsigned hash_mask;
+    data_t **datas;          /* List of every file, shown in the menu */
+    data_t *files;           /* Plain files, linked through 'fnext' */
+    data_t *work;            /* Files to account for or to read again */
+    int n_dirty;
+    char *scratch;           /* Read buffer */
+    size_t scratch_size;
+    totals_t totals;
+    pthread_mutex_t mtx;     /* Protects the inbox */
+    shard_msg_t *inbox;
+    data_t **queue;          /* Files updated, for the display thread */
+    unsigned head, tail;
+    int overflow;            /* The queue was full, look at every file */
+    data_t *seek;            /* File being indexed for the details view */
+    long long next_tails;    /* Low power: when to read the tails again */
+    const char *mount;       /* Network mount this shard has to itself */
+    dev_t dev;
+    long long io_since;      /* Last sign of progress, 0 while sleeping */
+    int stalled;             /* No progress for IO_TIMEOUT_MS, display side */
+    topk_t *topk;            /* Messages logged the most lately */
+    plugin_batch_t *batch;   /* Allocated once a file has plugins */
+    step_t steps[STEPS];
+    long backlog;            /* Bytes left to read of the file being read */
+    int n_sampled;           /* Files under backpressure */
+    long long next_calm;     /* When to look for files which calmed down */
+} shard_t;
+
+static shard_t *shards;
+static int n_shards;
+static int n_local;          /* Shards files are spread over by path, the
+                              * ones after them each own a network mount */
+static int n_unresponsive;   /* Files of stalled shards, display side */
+
+/* Wakes the display thread up when shards publish something */
+static int ui_wake[2];
+static int ui_woken;
+
+/* Protects file and pane buffers, written by shards and drawn by the
+ * display thread
+ */
+static pthread_mutex_t mtx_buffers = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bytes shown in the details window */
+static int details_bytes = ROW_BYTES;
+static int details_rows = 1;
+static long details_page; /* Page of a long line shown in details */
+
+/* Details shown from a point in time: where (-1 for the end of the file),
+ * from which line, what was asked for and how far indexing went (-1 when
+ * not indexing)
+ */
+static off_t details_at = -1;
+static unsigned long details_line;
+static int details_unread;  /* From the read marker: lines are numbered
+                             * from there */
+static time_t details_seek;
+static int index_progress = -1;
+static char seek_text[32];
+
+/* Set by shards when files come and go */
+static int menu_dirty;
+
+/* Removed files, freed once the menu no longer references them */
+static data_t *graveyard;
+
+/* A file pinned in the split view */
+typedef struct _pane_t
+{
+    data_t *data;
+    WINDOW *win;
+    PANEL *panel;
+    char *buff;     /* Retained tail of the file, independent of data->buff */
+    size_t len;
+    off_t offset;   /* File offset right after the retained bytes */
+    int scroll;     /* Lines scrolled back, 0 follows the end of the file */
+    int dirty;      /* Must be redrawn */
+} pane_t;
+
+/* Display frozen: only accounting goes on */
+static int paused;
+
+/* Nobody is looking (focus lost or no key pressed for a while): accounting
+ * goes on, drawing and reading the tails of the files slow down
+ */
+static int low_power;
+static long long last_input;  /* When a key was last pressed (ms) */
+static long idle_ms = DEFAULT_IDLE_SECS * 1000L;
+static int focus_reports;     /* Asked the terminal for them */
+
+/* Share of a core we may use (0 for no limit), steps taken to stay under
+ * it and what was used over the last GOVERN_TICK_MS
+ */
+static struct
+{
+    double budget;
+    int step;
+    double used;
+    int nice;                 /* Shards run with a lower priority */
+    long long next, wall;     /* ms */
+    long long cpu;            /* us */
+} govern;
+
+/* Memory pressure of the host, and caches shed because of it */
+static struct
+{
+    int fd;
+    double some;              /* % of the time tasks stalled (avg10) */
+    int step;
+    long long next;
+} pressure = { -1, 0, 0, 0 };
+
+/* Accounting totals when the display was frozen */
+static totals_t pause_totals;
+
+/* Bytes and blocks allocated, counted where they are allocated and freed */
+static struct
+{
+    long bytes[MEM_KINDS];
+    long blocks;
+} mem;
+static int show_memory;
+static int mem_sort = MEM_KINDS; /* Column the files are sorted on */
+static int mem_report_wanted;    /* SIGUSR1 came */
+
+/* Messages logged the most, across every file, shown instead of details */
+static int show_templates;
+
+/* Fields whose distinct values, or quantiles, are counted */
+static field_t distincts[MAX_FIELDS];
+static int n_distincts;
+static field_t quantiles[MAX_FIELDS];
+static int n_quantiles;
+static long long fields_next; /* When to estimate them again */
+
+/* Line rates, as of the last sample */
+static long long rate_next;  /* When to sample the line counts again */
+static int n_anomalies;      /* Files flagged */
+static int n_novel;          /* Files which wrote a line of a new kind */
+static int sort_anomaly;     /* Flagged files first, the most unusual on top */
+
+/* File whose writer is the furthest behind, as of the last frame */
+static struct
+{
+    long lag;
+    char name[64];
+} lag_worst;
+
+/* Line of text under the title */
+static char message[256];
+static long long message_until;
+
+/* Command run on lines matching a pattern */
+typedef struct _hook_t
+{
+    regex_t re;
+    char *in;            /* Glob on the file name, NULL for every file */
+    char *command;
+    long debounce_ms;
+    int max_running;     /* Max number of commands running at once */
+    int running;
+    char *batch;         /* Matched lines waiting for the window to end */
+    size_t batch_len;
+    unsigned long batch_lines, dropped;
+    long long due;       /* When the pending batch fires, 0 if none */
+    char file[PATH_MAX]; /* First file matched in this window */
+    unsigned long matched, fired, failed;
+} hook_t;
+
+/* Hooks, their batches and running commands are shared between the shards
+ * and the hook thread
+ */
+static hook_t hooks[MAX_HOOKS];
+static int n_hooks;
+static struct
+{
+    pid_t pid;
+    hook_t *hook;
+} children[MAX_HOOK_CHILDREN];
+static int n_children;
+static pthread_mutex_t mtx_hooks = PTHREAD_MUTEX_INITIALIZER;
+
+/* Batch taken out of a hook to run its command, so that matching lines
+ * goes on while it is written out and the command is started
+ */
+typedef struct _hook_job_t
+{
+    hook_t *hook;
+    char *batch;
+    size_t batch_len;
+    unsigned long batch_lines, dropped;
+    char file[PATH_MAX];
+} hook_job_t;
+static pthread_cond_t cond_hooks;
+extern char **environ;
+
+/* Line processor plugin, loaded from the config */
+typedef struct _plugin_t
+{
+    char *path;
+    const char *name;        /* File name of the shared object */
+    char *in;                /* Glob on the file name, NULL for every file */
+    void *so, *state;
+    treetop_plugin_lines_t *lines;
+    treetop_plugin_fini_t *fini;
+    long long ns;            /* Time spent in it, by every shard */
+    unsigned long batches, n_lines;
+} plugin_t;
+
+static plugin_t plugins[MAX_PLUGINS];
+static int n_plugins;
+
+/* Groups of files, and the trees listed in them */
+static group_t groups[MAX_GROUPS];
+static int n_groups;
+static struct
+{
+    char *root;
+    size_t len;
+    group_t *group;
+} *group_trees;
+static int n_group_trees;
+static int show_plugins;
+static int show_steps;
+static int show_heatmap;
+
+/* Heatmap rows and what was drawn of them, display side */
+typedef struct _heat_row_t
+{
+    char name[PATH_MAX];
+    data_t **members;        /* A file, or the files of a directory */
+    int n;
+    unsigned long total;     /* Lines over the columns, to sort them */
+} heat_row_t;
+
+static struct
+{
+    heat_row_t *rows;
+    int n;
+    int group;               /* Rows by directory */
+    int full;                /* Lay out the rows and draw them all */
+    long long last;          /* Newest bucket drawn */
+    chtype shades[HEAT_LEVELS];
+} heat;
+
+/* Split view state, only changed by the display thread (the shards fill the
+ * pane buffers under the buffer mutex)
+ */
+static pane_t panes[MAX_PANES];
+static int n_panes, max_panes = DEFAULT_PANES, focused_pane;
+static int show_panes;
+
+/* Step of a simulated scenario */
+typedef struct _sim_event_t
+{
+    long long at;            /* Virtual time (ms) */
+    int what;                /* SIM_APPEND, SIM_ROTATE, ... */
+    char name[1024];         /* File, relative to the scratch directory */
+    int lines;               /* Lines written */
+    int rows, cols;          /* New terminal size */
+    char marker[32];         /* Last line written, looked for on screen */
+    unsigned long expect;    /* Lines counted for the file once detected */
+    const void *gone;        /* Tree file replaced by a rotation */
+    long long detected, rendered; /* -1 until it happens */
+} sim_event_t;
+
+/* File (or tree) of a scenario, and the lines it should have counted */
+typedef struct _sim_file_t
+{
+    char name[1024];
+    int dir;                 /* Watched as a tree */
+    int tree;                /* Inside a tree */
+    unsigned long lines;
+} sim_file_t;
+
+#define SIM_APPEND   1
+#define SIM_ROTATE   2       /* Rename to NAME.1 and write NAME again */
+#define SIM_TRUNCATE 3       /* Truncate in place, then write */
+#define SIM_RESIZE   4
+
+/* Simulation state: virtual clock and terminal, scenario */
+static struct
+{
+    long long now;
+    int rows, cols;
+    char dir[64];            /* Scratch directory of the scenario files */
+    long detect_ms, render_ms; /* Latency bounds, -1 if none */
+    sim_event_t *events;
+    int n_events;
+    sim_file_t *files;
+    int n_files;
+} sim = { 0, 24, 80, "", -1, -1, NULL, 0, NULL, 0 };
+
+/* Screen (ncurses state and content) */
+typedef struct _screen_t
+{
+    WINDOW *master;  /* Nothing here it just needs a border to look pretty */
+    WINDOW *content; /* Menu goes here                                     */
+    WINDOW *details; /* Display details about selected item                */
+    PANEL  *master_panel;
+    PANEL  *content_panel;
+    PANEL  *details_panel;
+    MENU *menu;
+    ITEM **items;
+    data_t *datas;
+} screen_t;
+
+/* Param to a thread */
+typedef struct _thread_param_t
+{
+    int opened_files;
+    screen_t *master_screen;
+} thread_param_t;
+
+static void get_last_line(data_t *d);
+static void data_new_item(data_t *d);
+static void pane_unpin(int idx);
+const data_t *show_details;
+
+static void usage(const char *execname, const char *msg)
+{
+    if (msg)
+      PR("%s", msg);
+    printf("Usage: %s <config> [-d secs] [-w watches] [-F] [-i secs] "
+       "[-p panes] [-t shards]\n"
+       "       [--cpu-budget pct] [--nice] [-h]\n"
+       "       %s -S scenario [-t shards]\n"
+       "    -h:         Display this help screen\n"
+       "    -d secs:    Auto-update display every 'secs' seconds\n"
+       "    -w watches: Max inotify watches used for directory trees\n"
+       "                (default: max_user_watches - %d)\n"
+       "    -F:         Watch whole mounts of the trees with fanotify\n"
+       "                (needs CAP_SYS_ADMIN), directories are polled\n"
+       "    -i secs:    Slow down after 'secs' without a key pressed\n"
+       "                (default: %d, 0 to wait for the focus to go)\n"
+       "    -p panes:   Max files pinned in the split view (default: %d)\n"
+       "    -t shards:  Threads watching and reading the files\n"
+       "                (default: 0, one per core up to %d)\n"
+       "    --cpu-budget pct: Slow down to use at most 'pct' %% of a core\n"
+       "    --nice:     Lower the CPU and I/O priority of the threads\n"
+       "                reading the files\n"
+       "    -S scenario: Replay a scenario on a virtual clock and terminal,\n"
+       "                report how late each event was seen and drawn\n",
+       execname, execname, WATCH_RESERVE, DEFAULT_IDLE_SECS, DEFAULT_PANES,
+       AUTO_SHARDS);
+    exit(0);
+}
+
+/* Returns the starting x-coordinate such that when displaying a value of
+ * 'length' characters long, it will be centered in the given window.
+ */
+static int find_center_start(const WINDOW *win, size_t length)
+{
+    int max_x = getmaxx(win);
+    int half = length / 2;
+    return max_x / 2 - half;
+}
+
+
+/* Writes the program title into the window */
+static void write_title_window(WINDOW *master)
+{
+    int x;
+    box(master, 0, 0);
+    x = find_center_start(master, strlen(TITLE));
+    mvwprintw(master, 0, x, TITLE);
+}
+
+/* Milliseconds elapsed since some arbitrary point */
+static long long clock_real(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long clock_virtual(void)
+{
+    return sim.now;
+}
+
+/* Clock behind every timing decision, virtual in simulations */
+static long long (*now_ms)(void) = clock_real;
+
+/* Modification time of a file, to the nanosecond where the system tells
+ * it: a change made in the same second as the last look is not missed
+ */
+static struct timespec stat_mtime(const struct stat *st)
+{
+    struct timespec ts;
+
+#ifdef HAVE_STRUCT_STAT_ST_MTIM
+    ts = st->st_mtim;
+#else
+    ts.tv_sec = st->st_mtime;
+    ts.tv_nsec = 0;
+#endif
+    return ts;
+}
+
+static int same_time(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/* Keep a descriptor from the commands run by the hooks.  Files are opened
+ * with 'e' (close on exec) for the same reason, which is ignored where it
+ * is not known.
+ */
+static void fd_cloexec(int fd)
+{
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
+static unsigned path_hash_fn(const char *path)
+{
+    unsigned h = 2166136261u;
+    while (*path)
+      h = (h ^ (unsigned char)*path++) * 16777619u;
+    return h;
+}
+
+/* Shard of a plain file, or of a top level directory of a tree */
+static shard_t *shard_pick(const char *path)
+{
+    return &shards[path_hash_fn(path) % n_local];
+}
+
+/* Find a tree file of a shard from its full path */
+static data_t *data_lookup(shard_t *s, const char *path)
+{
+    data_t *d;
+    for (d = s->hash[path_hash_fn(path) & s->hash_mask]; d; d = d->hnext)
+      if (strcmp(d->full_path, path) == 0)
+        return d;
+    return NULL;
+}
+
+/* Bucket of a tree file in the inode hash table of its shard */
+static data_t **ino_bucket(shard_t *s, dev_t dev, ino_t ino)
+{
+    return &s->by_ino[((unsigned)ino ^ (unsigned)dev * 2654435761u) &
+                      s->hash_mask];
+}
+
+static void ino_link(data_t *d)
+{
+    data_t **bucket = ino_bucket(d->shard, d->dev, d->ino);
+
+    d->inext = *bucket;
+    *bucket = d;
+}
+
+static void ino_unlink(data_t *d)
+{
+    data_t **pp;
+
+    for (pp = ino_bucket(d->shard, d->dev, d->ino); *pp; pp = &(*pp)->inext)
+      if (*pp == d)
+      {
+          *pp = d->inext;
+          break;
+      }
+}
+
+/* Add a file at the head of the list (and to its directory and shard) */
+static void data_link(data_t **head, data_t *d)
+{
+    data_t **bucket;
+
+    d->prev = NULL;
+    d->next = *head;
+    if (*head)
+      (*head)->prev = d;
+    *head = d;
+
+    if (d->dir)
+    {
+        bucket = &d->shard->hash[path_hash_fn(d->full_path) &
+                                 d->shard->hash_mask];
+        d->hnext = *bucket;
+        *bucket = d;
+        d->dnext = d->dir->files;
+        d->dir->files = d;
+        if (d->shard->by_ino)
+          ino_link(d);
+        ++watches.n_files;
+    }
+    else
+    {
+        d->fnext = d->shard->files;
+        d->shard->files = d;
+    }
+}
+
+/* Remove a tree file from the list, from its directory and its shard */
+static void data_unlink(data_t **head, data_t *d)
+{
+    data_t **pp;
+
+    if (d->prev)
+      d->prev->next = d->next;
+    else
+      *head = d->next;
+    if (d->next)
+      d->next->prev = d->prev;
+
+    if (d->dir)
+    {
+        for (pp = &d->shard->hash[path_hash_fn(d->full_path) &
+                                  d->shard->hash_mask];
+             *pp; pp = &(*pp)->hnext)
+          if (*pp == d)
+          {
+              *pp = d->hnext;
+              break;
+          }
+        for (pp=&d->dir->files; *pp; pp=&(*pp)->dnext)
+          if (*pp == d)
+          {
+              *pp = d->dnext;
+              break;
+          }
+        if (d->shard->by_ino)
+          ino_unlink(d);
+        d->dir = NULL;
+        --watches.n_files;
+    }
+}
+
+static void mem_add(int kind, long bytes, long blocks)
+{
+    __atomic_add_fetch(&mem.bytes[kind], bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&mem.blocks, blocks, __ATOMIC_RELAXED);
+}
+
+/* Memory of a file, by kind.  Returns the total and the number of blocks
+ * in 'blocks' (if not NULL).
+ */
+static long data_mem(const data_t *d, long bytes[MEM_KINDS], long *blocks)
+{
+    long n = 3, total = 0;
+    int i;
+
+    memset(bytes, 0, MEM_KINDS * sizeof(long));
+    bytes[MEM_INDEX] = sizeof(data_t) + strlen(d->full_path) + 1 +
+                       strlen(d->base_name) + 1;
+    if (d->buff)
+    {
+        bytes[MEM_TAIL] = d->buff_size + 1;
+        ++n;
+    }
+    if (d->pane && d->pane->buff)
+      bytes[MEM_HISTORY] = PANE_RETAIN;
+    if (d->carry)
+    {
+        bytes[MEM_LINES] += MAX_LINE_LEN + 1;
+        ++n;
+    }
+    if (d->stamp)
+    {
+        bytes[MEM_LINES] += sizeof(stamp_t);
+        ++n;
+    }
+    if (d->hll)
+    {
+        bytes[MEM_LINES] += sizeof(hll_t);
+        ++n;
+    }
+    if (d->dds)
+    {
+        bytes[MEM_LINES] += sizeof(dds_t);
+        ++n;
+    }
+    if (d->notes)
+    {
+        bytes[MEM_LINES] += 2 * n_plugins * sizeof(treetop_note_t);
+        ++n;
+    }
+    if (d->heat)
+    {
+        bytes[MEM_LINES] += sizeof(heat_t);
+        ++n;
+    }
+    if (d->bloom)
+    {
+        bytes[MEM_LINES] += d->bloom->bytes;
+        n += 1 + d->bloom->slices * !d->bloom->full;
+    }
+    if (d->item)
+      bytes[MEM_CURSES] = sizeof(ITEM);
+    if (d->index)
+    {
+        bytes[MEM_INDEX] += sizeof(index_t) +
+                            d->index->size * sizeof(checkpoint_t);
+        n += 1 + (d->index->cps != NULL);
+    }
+    for (i=0; i<MEM_KINDS; ++i)
+      total += bytes[i];
+    if (blocks)
+      *blocks = n;
+    return total;
+}
+
+static void data_free(data_t *d)
+{
+    long bytes[MEM_KINDS], blocks;
+    int i;
+
+    /* Its menu item and pane are let go of before */
+    data_mem(d, bytes, &blocks);
+    for (i=0; i<MEM_KINDS; ++i)
+      if (i != MEM_CURSES && i != MEM_HISTORY)
+        mem_add(i, -bytes[i], 0);
+    mem_add(MEM_INDEX, 0, -blocks);
+
+    if (d->fp)
+      fclose(d->fp);
+    free(d->buff);
+    free(d->carry);
+    free(d->stamp);
+    free(d->hll);
+    free(d->dds);
+    free(d->notes);
+    free(d->heat);
+    if (d->bloom)
+    {
+        for (i=0; i<d->bloom->slices && !d->bloom->full; ++i)
+          free(d->bloom->bits[i]);
+        free(d->bloom);
+    }
+    if (d->index)
+    {
+        if (d->index->fp)
+          fclose(d->index->fp);
+        free(d->index->cps);
+        free(d->index);
+    }
+    free((char *)d->full_path);
+    free((char *)d->base_name);
+    free(d);
+}
+
+/* A shard is getting on with its I/O, not stuck in it */
+static void shard_alive(shard_t *s)
+{
+    __atomic_store_n(&s->io_since, now_ms(), __ATOMIC_RELAXED);
+}
+
+/* Nanoseconds elapsed since some arbitrary point, for step timings */
+static long long clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Account for what went through a step, the display thread sums them */
+static void step_add(step_t *st, unsigned long items, long long ns)
+{
+    __atomic_store_n(&st->items, st->items + items, __ATOMIC_RELAXED);
+    __atomic_store_n(&st->ns, st->ns + ns, __ATOMIC_RELAXED);
+}
+
+static void step_stall(step_t *st)
+{
+    __atomic_store_n(&st->stalls, st->stalls + 1, __ATOMIC_RELAXED);
+}
+
+/* Queue a file for the next round of its shard */
+static void work_add(shard_t *s, data_t *d)
+{
+    if (d->work)
+      return;
+    d->work = 1;
+    d->wprev = NULL;
+    d->wnext = s->work;
+    if (s->work)
+      s->work->wprev = d;
+    s->work = d;
+}
+
+static void work_remove(shard_t *s, data_t *d)
+{
+    if (!d->work)
+      return;
+    if (d->wprev)
+      d->wprev->wnext = d->wnext;
+    else
+      s->work = d->wnext;
+    if (d->wnext)
+      d->wnext->wprev = d->wprev;
+    d->work = 0;
+}
+
+/* Content was appended (or changed): account for it in the next round */
+static void data_touch(data_t *d)
+{
+    if (!d->dirty)
+    {
+        d->dirty = 1;
+        ++d->shard->n_dirty;
+        step_add(&d->shard->steps[STEP_DETECT], 1, 0);
+    }
+    work_add(d->shard, d);
+}
+
+/* Let the display thread know something was published */
+static void ui_notify(void)
+{
+    char c = 0;
+    if (!__atomic_exchange_n(&ui_woken, 1, __ATOMIC_ACQ_REL))
+      write(ui_wake[PIPE_WRITE], &c, sizeof(c));
+}
+
+/* Send a request to a shard and wake it up */
+static void shard_post(shard_t *s, int what, const char *path, size_t rootlen)
+{
+    char c = 0;
+    shard_msg_t *m, **pp;
+
+    if (!(m = malloc(sizeof(shard_msg_t) + strlen(path) + 1)))
+      ER("Can't allocate memory for shard request");
+    m->what = what;
+    m->rootlen = rootlen;
+    m->next = NULL;
+    strcpy(m->path, path);
+
+    pthread_mutex_lock(&s->mtx);
+    for (pp = &s->inbox; *pp; pp = &(*pp)->next)
+      ;
+    *pp = m;
+    pthread_mutex_unlock(&s->mtx);
+    write(s->wake[PIPE_WRITE], &c, sizeof(c));
+}
+
+/* Hand a file whose tail was read over to the display thread.  When the
+ * queue is full, the 'queued' flag of the file is left for the display
+ * thread to find.
+ */
+static void shard_publish(shard_t *s, data_t *d)
+{
+    unsigned head = s->head;
+
+    if (__atomic_exchange_n(&d->queued, 1, __ATOMIC_ACQ_REL))
+      return; /* Not taken in yet */
+    if (head - __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE) == SHARD_QUEUE)
+    {
+        __atomic_store_n(&s->overflow, 1, __ATOMIC_RELEASE);
+        step_stall(&s->steps[STEP_RENDER]);
+    }
+    else
+    {
+        s->queue[head % SHARD_QUEUE] = d;
+        __atomic_store_n(&s->head, head + 1, __ATOMIC_RELEASE);
+    }
+    ui_notify();
+}
+
+/* Group a tree was listed in, by its root, if any */
+static group_t *group_of_tree(const char *path, size_t rootlen)
+{
+    int i;
+
+    for (i=0; i<n_group_trees; ++i)
+      if (group_trees[i].len == rootlen &&
+          strncmp(group_trees[i].root, path, rootlen) == 0)
+        return group_trees[i].group;
+    return NULL;
+}
+
+/* Create the information of a file found in a tree, its name is displayed
+ * relative to the tree root.  The file is only opened when it is read.
+ */
+static data_t *data_new_tree(const char *path, size_t rootlen,
+                             dir_t *dir, const struct stat *st)
+{
+    data_t *d;
+
+    if (!(d = calloc(1, sizeof(data_t))))
+      ER("Can't allocate memory for file information");
+    d->fd = -1;
+    d->full_path = strdup(path);
+    d->base_name = strdup(path + rootlen + (path[rootlen] == '/'));
+    d->state = UPDATED; /* Force first update to process this */
+    d->dir = dir;
+    d->shard = dir->shard;
+    d->group = group_of_tree(path, rootlen);
+    d->last_mod = stat_mtime(st);
+    d->last_size = st->st_size;
+    d->ino = st->st_ino;
+    d->dev = st->st_dev;
+    d->poll_ival = POLL_MIN_MS;
+    d->lag = -1;
+    d->last_start = -1;
+    mem_add(MEM_INDEX, sizeof(data_t) + strlen(d->full_path) + 1 +
+                       strlen(d->base_name) + 1, 3);
+    return d;
+}
+
+/* Pick the inotify budget, 'budget' < 0 means use (nearly) all of what the
+ * user is allowed to.  Each shard gets its own inotify instance.
+ */
+static void watches_init(long budget)
+{
+    FILE *fp;
+    long max = 0;
+    int i;
+    static int done;
+
+    if (done)
+      return;
+    done = 1;
+
+#ifdef HAVE_SYS_FANOTIFY_H
+    /* Whole mounts instead of directories, if we are allowed to */
+    for (i=0; fan.on && i<n_shards; ++i)
+      if (!shards[i].mount &&
+          (shards[i].fan = fanotify_init(FAN_CLASS_NOTIF | FAN_NONBLOCK |
+                                         FAN_CLOEXEC,
+                                         O_RDONLY | O_CLOEXEC)) == -1)
+      {
+          WR("Can't initialize fanotify, directories will be watched: %s",
+             strerror(errno));
+          while (i-- > 0)
+            if (shards[i].fan >= 0)
+            {
+                close(shards[i].fan);
+                shards[i].fan = -1;
+            }
+          fan.on = 0;
+      }
+    for (i=0; fan.on && i<n_shards; ++i)
+    {
+        if (shards[i].fan < 0)
+          continue;
+        if (!(shards[i].by_ino = calloc(shards[i].hash_mask + 1,
+                                        sizeof(data_t *))))
+          ER("Can't allocate memory for shards");
+        mem_add(MEM_INDEX, (shards[i].hash_mask + 1) * sizeof(data_t *), 1);
+    }
+    if (fan.on)
+    {
+        watches.budget = 0;
+        return;
+    }
+#else
+    if (fan.on)
+      WR("fanotify is not supported on this system");
+    fan.on = 0;
+#endif
+
+#ifdef HAVE_SYS_INOTIFY_H
+    for (i=0; i<n_shards; ++i)
+      if (!shards[i].mount &&
+          (shards[i].ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+      {
+          WR("Can't initialize inotify, trees will be polled: %s",
+             strerror(errno));
+          break;
+      }
+#else
+    (void)i;
+#endif
+
+    if ((fp = fopen("/proc/sys/fs/inotify/max_user_watches", "re")))
+    {
+        if (fscanf(fp, "%ld", &max) != 1)
+          max = 0;
+        fclose(fp);
+    }
+
+    if (budget < 0)
+      budget = (max > 2 * WATCH_RESERVE) ? max - WATCH_RESERVE : max / 2;
+    else if (max > 0 && budget > max)
+      budget = max;
+    watches.budget = budget;
+}
+
+/* Watch the whole mount 'path' is on with fanotify, if not done yet */
+static void fan_mark(const char *path)
+{
+#ifdef HAVE_SYS_FANOTIFY_H
+    struct stat st;
+    int i;
+
+    if (!fan.on || stat(path, &st) == -1)
+      return;
+    for (i=0; i<fan.n_devs; ++i)
+      if (fan.devs[i] == st.st_dev)
+        return;
+    if (fan.n_devs == FAN_MOUNTS)
+    {
+        WR("Too many mounts to watch with fanotify, '%s' will be polled",
+           path);
+        return;
+    }
+    for (i=0; i<n_shards; ++i)
+      if (shards[i].fan >= 0 &&
+          fanotify_mark(shards[i].fan, FAN_MARK_ADD | FAN_MARK_MOUNT,
+                        FAN_MODIFY, AT_FDCWD, path) == -1)
+      {
+          WR("Can't watch the mount of '%s' with fanotify, it will be "
+             "polled: %s", path, strerror(errno));
+          return;
+      }
+    fan.devs[fan.n_devs++] = st.st_dev;
+#else
+    (void)path;
+#endif
+}
+
+/* The modifications of a tree file are reported by fanotify */
+static int fan_covers(const data_t *d)
+{
+    int i;
+
+    if (!d->shard->by_ino)
+      return 0;
+    for (i=0; i<fan.n_devs; ++i)
+      if (fan.devs[i] == d->dev)
+        return 1;
+    return 0;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+#define TREE_EVENTS (IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                     IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define PLAIN_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+#endif
+
+/* Must be called with the watches mutex held */
+static dir_t *dir_find(const char *path)
+{
+    dir_t *dir;
+    for (dir = watches.by_path[path_hash_fn(path) & (PATH_HASH_SIZE - 1)];
+         dir; dir = dir->hnext)
+      if (strcmp(dir->path, path) == 0)
+        return dir;
+    return NULL;
+}
+
+static dir_t *dir_lookup(const char *path)
+{
+    dir_t *dir;
+
+    pthread_mutex_lock(&watches.mtx);
+    dir = dir_find(path);
+    pthread_mutex_unlock(&watches.mtx);
+    return dir;
+}
+
+/* Register a directory of a tree with shard 's', watched if the budget allows
+ * it, polled otherwise.  Returns NULL if the directory is gone or already
+ * registered.
+ */
+static dir_t *dir_add(shard_t *s, const char *path, size_t rootlen, int root)
+{
+    int wd = -1, reserved = 0, err = 0, size, isdir;
+    unsigned h;
+    dir_t *dir, **tmp;
+    struct stat st;
+
+    pthread_mutex_lock(&watches.mtx);
+    if (s->ino >= 0 && watches.used < watches.budget)
+    {
+        ++watches.used;
+        reserved = 1;
+    }
+    pthread_mutex_unlock(&watches.mtx);
+
+#ifdef HAVE_SYS_INOTIFY_H
+    if (reserved &&
+        (wd = inotify_add_watch(s->ino, path, TREE_EVENTS)) == -1)
+    {
+        err = errno;
+        if (err != ENOSPC && err != ENOENT)
+          WR("Can't watch directory '%s': %s", path, strerror(err));
+    }
+#endif
+
+    if (!(isdir = stat(path, &st) == 0 && S_ISDIR(st.st_mode)))
+    {
+#ifdef HAVE_SYS_INOTIFY_H
+        if (wd >= 0)
+          inotify_rm_watch(s->ino, wd);
+#endif
+        wd = -1;
+    }
+
+    pthread_mutex_lock(&watches.mtx);
+    if (reserved && wd == -1)
+    {
+        --watches.used;
+        /* Someone else took the remaining watches */
+        if (err == ENOSPC)
+          watches.budget = watches.used;
+    }
+
+    if (!isdir || dir_find(path) ||
+        (wd >= 0 && wd < s->by_wd_size && s->by_wd[wd]))
+    {
+        /* Vanished or already registered (overlapping trees).  The same
+         * directory in this shard got its own watch back, one registered
+         * in another shard got a new one here, which nothing would map.
+         */
+        if (wd >= 0)
+        {
+#ifdef HAVE_SYS_INOTIFY_H
+            if (wd >= s->by_wd_size || !s->by_wd[wd])
+              inotify_rm_watch(s->ino, wd);
+#endif
+            --watches.used;
+        }
+        pthread_mutex_unlock(&watches.mtx);
+        return NULL;
+    }
+
+    if (!(dir = calloc(1, sizeof(dir_t))))
+      ER("Can't allocate memory for directory information");
+    dir->path = strdup(path);
+    mem_add(MEM_INDEX, sizeof(dir_t) + strlen(path) + 1, 2);
+    dir->wd = wd;
+    dir->rootlen = rootlen;
+    dir->root = root;
+    dir->shard = s;
+    if (wd >= 0)
+    {
+        if (wd >= s->by_wd_size)
+        {
+            size = MAX(wd + 1, s->by_wd_size * 2);
+            if (!(tmp = realloc(s->by_wd, size * sizeof(dir_t *))))
+              ER("Can't allocate memory for watch descriptors");
+            memset(tmp + s->by_wd_size, 0,
+                   (size - s->by_wd_size) * sizeof(dir_t *));
+            mem_add(MEM_INDEX, (size - s->by_wd_size) * sizeof(dir_t *),
+                    s->by_wd ? 0 : 1);
+            s->by_wd = tmp;
+            s->by_wd_size = size;
+        }
+        s->by_wd[wd] = dir;
+    }
+    else
+    {
+        ++watches.n_polled;
+        dir->last_mod = stat_mtime(&st);
+        dir->poll_ival = POLL_MIN_MS;
+        dir->next_poll = now_ms() + POLL_MIN_MS;
+    }
+
+    dir->next = s->dirs;
+    if (s->dirs)
+      s->dirs->prev = dir;
+    s->dirs = dir;
+    h = path_hash_fn(path) & (PATH_HASH_SIZE - 1);
+    dir->hnext = watches.by_path[h];
+    watches.by_path[h] = dir;
+    ++watches.n_dirs;
+    pthread_mutex_unlock(&watches.mtx);
+
+    return dir;
+}
+
+/* Directory waiting to be crawled */
+typedef struct _crawl_dir_t
+{
+    char *path;
+    shard_t *shard;
+    int root;
+} crawl_dir_t;
+
+/* Shared state of the threads crawling a tree */
+typedef struct _crawl_t
+{
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    crawl_dir_t *queue; /* Directories left to scan */
+    int n_queued;
+    int queue_size;
+    int busy;         /* Crawlers currently scanning a directory */
+    size_t rootlen;
+    data_t *found;    /* Files found so far (linked through 'next') */
+} crawl_t;
+
+/* Must be called with the crawl mutex held */
+static void crawl_push(crawl_t *c, char *path, shard_t *s, int root)
+{
+    crawl_dir_t *tmp;
+
+    if (c->n_queued == c->queue_size)
+    {
+        c->queue_size = MAX(64, c->queue_size * 2);
+        if (!(tmp = realloc(c->queue, c->queue_size * sizeof(crawl_dir_t))))
+          ER("Can't allocate memory for the crawl queue");
+        c->queue = tmp;
+    }
+    c->queue[c->n_queued].path = path;
+    c->queue[c->n_queued].shard = s;
+    c->queue[c->n_queued++].root = root;
+    pthread_cond_signal(&c->cond);
+}
+
+/* Crawler: registers directories and collects regular files until the
+ * queue is empty and no other crawler may refill it.  The top level
+ * directories of a tree are spread over the shards, below them directories
+ * stay with the shard of their parent.
+ */
+static void *thread_crawl(void *arg)
+{
+    crawl_t *c = arg;
+    crawl_dir_t todo;
+    char child[PATH_MAX];
+    dir_t *dir;
+    data_t *files, *last, *d;
+    DIR *dp;
+    struct dirent *ent;
+    struct stat st;
+
+    pthread_mutex_lock(&c->mtx);
+    for (;;)
+    {
+        while (c->n_queued == 0 && c->busy > 0)
+          pthread_cond_wait(&c->cond, &c->mtx);
+        if (c->n_queued == 0)
+          break;
+        todo = c->queue[--c->n_queued];
+        ++c->busy;
+        pthread_mutex_unlock(&c->mtx);
+
+        /* Watch before listing so nothing created meanwhile is missed */
+        files = last = NULL;
+        if ((dir = dir_add(todo.shard, todo.path, c->rootlen, todo.root)) &&
+            (dp = opendir(todo.path)))
+        {
+            while ((ent = readdir(dp)))
+            {
+                if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+                  continue;
+                snprintf(child, sizeof(child), "%s/%s", todo.path,
+                         ent->d_name);
+                if (lstat(child, &st) == -1)
+                  continue;
+                if (S_ISDIR(st.st_mode))
+                {
+                    pthread_mutex_lock(&c->mtx);
+                    crawl_push(c, strdup(child),
+                               (dir->root && !dir->shard->mount) ?
+                               shard_pick(child) : dir->shard, 0);
+                    pthread_mutex_unlock(&c->mtx);
+                    continue;
+                }
+
+                /* Follow links to files, never to directories (loops) */
+                if (S_ISLNK(st.st_mode) && stat(child, &st) == -1)
+                  continue;
+                if (!S_ISREG(st.st_mode))
+                  continue;
+                d = data_new_tree(child, c->rootlen, dir, &st);
+                d->next = files;
+                files = d;
+                if (!last)
+                  last = d;
+            }
+            closedir(dp);
+        }
+        free(todo.path);
+
+        pthread_mutex_lock(&c->mtx);
+        if (files)
+        {
+            last->next = c->found;
+            c->found = files;
+        }
+        --c->busy;
+        pthread_cond_broadcast(&c->cond);
+    }
+    pthread_mutex_unlock(&c->mtx);
+
+    return NULL;
+}
+
+/* Register the directories under 'path' using up to 'n_threads' crawlers
+ * and return the files found (not linked to any list yet).  'path' goes to
+ * shard 's', it is the root of its tree if 'root' is set.
+ */
+static data_t *tree_crawl(const char *path, size_t rootlen, int n_threads,
+                          shard_t *s, int root)
+{
+    int i;
+    crawl_t c;
+    pthread_t threads[MAX_CRAWLERS];
+
+    memset(&c, 0, sizeof(c));
+    pthread_mutex_init(&c.mtx, NULL);
+    pthread_cond_init(&c.cond, NULL);
+    c.rootlen = rootlen;
+    crawl_push(&c, strdup(path), s, root);
+
+    if (n_threads > MAX_CRAWLERS)
+      n_threads = MAX_CRAWLERS;
+    for (i=1; i<n_threads; ++i)
+      if (pthread_create(&threads[i], NULL, thread_crawl, &c) != 0)
+        break;
+    n_threads = i;
+    thread_crawl(&c);
+    for (i=1; i<n_threads; ++i)
+      pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&c.cond);
+    pthread_mutex_destroy(&c.mtx);
+    free(c.queue);
+    return c.found;
+}
+
+/* Add files found at runtime by shard 's', the menu is rebuilt by the
+ * display thread
+ */
+static void tree_add_files(shard_t *s, data_t *found)
+{
+    data_t *d, *next;
+
+    pthread_mutex_lock(&mtx_post_menu);
+    for (d = found; d; d = next)
+    {
+        next = d->next;
+        if (data_lookup(s, d->full_path))
+        {
+            data_free(d);
+            continue;
+        }
+        data_link(s->datas, d);
+        data_touch(d);
+        ++s->totals.added;
+        menu_dirty = 1;
+    }
+    pthread_mutex_unlock(&mtx_post_menu);
+    ui_notify();
+}
+
+/* Forget about a file, it is freed once the menu has been rebuilt */
+static void data_remove(shard_t *s, data_t *d)
+{
+    if (s->seek == d)
+    {
+        s->seek = NULL;
+        __atomic_store_n(&index_progress, -1, __ATOMIC_RELAXED);
+    }
+    if (d->dirty)
+      --s->n_dirty;
+    if (d->sample > 1)
+      --s->n_sampled;
+    d->dirty = d->stale = 0;
+    work_remove(s, d);
+
+    pthread_mutex_lock(&mtx_post_menu);
+    data_unlink(s->datas, d);
+    d->next = graveyard;
+    graveyard = d;
+    ++s->totals.removed;
+    menu_dirty = 1;
+    pthread_mutex_unlock(&mtx_post_menu);
+    ui_notify();
+}
+
+static void dir_remove(shard_t *s, dir_t *dir)
+{
+    dir_t **pp;
+
+    while (dir->files)
+      data_remove(s, dir->files);
+
+    pthread_mutex_lock(&watches.mtx);
+    if (dir->wd >= 0)
+    {
+        s->by_wd[dir->wd] = NULL;
+        --watches.used;
+    }
+    else
+      --watches.n_polled;
+    if (dir->prev)
+      dir->prev->next = dir->next;
+    else
+      s->dirs = dir->next;
+    if (dir->next)
+      dir->next->prev = dir->prev;
+    for (pp = &watches.by_path[path_hash_fn(dir->path) & (PATH_HASH_SIZE - 1)];
+         *pp; pp = &(*pp)->hnext)
+      if (*pp == dir)
+      {
+          *pp = dir->hnext;
+          break;
+      }
+    --watches.n_dirs;
+    pthread_mutex_unlock(&watches.mtx);
+
+    mem_add(MEM_INDEX, -(long)(sizeof(dir_t) + strlen(dir->path) + 1), -2);
+    free(dir->path);
+    free(dir);
+}
+
+/* A directory went away (deleted or moved out): drop it and its subtree, as
+ * far as shard 's' owns it
+ */
+static void tree_drop(shard_t *s, const char *path)
+{
+    dir_t *dir, *next;
+    size_t len = strlen(path);
+
+    for (dir = s->dirs; dir; dir = next)
+    {
+        next = dir->next;
+        if (strncmp(dir->path, path, len) == 0 &&
+            (dir->path[len] == '\0' || dir->path[len] == '/'))
+        {
+#ifdef HAVE_SYS_INOTIFY_H
+            if (dir->wd >= 0)
+              inotify_rm_watch(s->ino, dir->wd);
+#endif
+            dir_remove(s, dir);
+            next = s->dirs; /* 'next' might have been a subdirectory */
+        }
+    }
+}
+
+/* Shard owning a subdirectory of 'parent' */
+static shard_t *dir_owner(const dir_t *parent, const char *path)
+{
+    return (parent->root && !parent->shard->mount) ? shard_pick(path)
+                                                   : parent->shard;
+}
+
+/* A new entry showed up in a tree directory */
+static void tree_grow(shard_t *s, dir_t *parent, const char *path)
+{
+    struct stat st;
+    shard_t *owner;
+
+    if (lstat(path, &st) == -1)
+      return;
+    if (S_ISDIR(st.st_mode))
+    {
+        if ((owner = dir_owner(parent, path)) != s)
+          shard_post(owner, SHARD_GROW, path, parent->rootlen);
+        else if (!dir_lookup(path))
+          tree_add_files(s, tree_crawl(path, parent->rootlen, 1, s, 0));
+        return;
+    }
+    if (S_ISLNK(st.st_mode) && stat(path, &st) == -1)
+      return;
+    if (S_ISREG(st.st_mode) && !data_lookup(s, path))
+      tree_add_files(s, data_new_tree(path, parent->rootlen, parent, &st));
+}
+
+/* Look for entries created in a directory since we last looked.  Only new
+ * entries are picked up here: files removed are noticed when they are
+ * polled (or, watched with fanotify, when their directory changed) and
+ * subdirectories removed when they are.
+ */
+static void dir_rescan(shard_t *s, dir_t *dir)
+{
+    DIR *dp;
+    struct dirent *ent;
+    char child[PATH_MAX];
+
+    if (!(dp = opendir(dir->path)))
+      return;
+    while ((ent = readdir(dp)))
+    {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+          continue;
+        snprintf(child, sizeof(child), "%s/%s", dir->path, ent->d_name);
+        tree_grow(s, dir, child);
+    }
+    closedir(dp);
+}
+
+/* Adaptive polling of what we could not afford to watch: the interval is
+ * reset on change and doubled (up to POLL_MAX_MS) while nothing happens.
+ * Returns when something is due next, -1 if nothing is polled.
+ */
+static long long tree_poll(shard_t *s, long long now)
+{
+    dir_t *dir;
+    data_t *d, *dnext;
+    struct stat st;
+    struct timespec mtime;
+    long long next = -1;
+    int changed;
+
+    /* Low priority for the CPU budget: looked at less often */
+    int slow = (__atomic_load_n(&govern.step, __ATOMIC_RELAXED) >= 3) ?
+               GOVERN_POLL : 1;
+
+    for (dir = s->dirs; dir; dir = dir->next)
+    {
+        if (dir->wd >= 0)
+          continue;
+
+        changed = 0;
+        if (now >= dir->next_poll)
+        {
+            shard_alive(s);
+            if (stat(dir->path, &st) == -1)
+            {
+                /* The list changed under us, go on at the next round */
+                tree_drop(s, dir->path);
+                return now;
+            }
+            mtime = stat_mtime(&st);
+            if (!same_time(&mtime, &dir->last_mod))
+            {
+                dir->last_mod = mtime;
+                dir->poll_ival = POLL_MIN_MS;
+                dir_rescan(s, dir);
+                changed = 1;
+            }
+            else if ((dir->poll_ival *= 2) > POLL_MAX_MS)
+              dir->poll_ival = POLL_MAX_MS;
+            dir->next_poll = now + dir->poll_ival * slow;
+        }
+        if (next < 0 || dir->next_poll < next)
+          next = dir->next_poll;
+
+        for (d = dir->files; d; d = dnext)
+        {
+            dnext = d->dnext;
+
+            /* Told when written to: only look for files gone or replaced
+             * when their directory changed
+             */
+            if (fan_covers(d))
+            {
+                if (!changed)
+                  continue;
+                shard_alive(s);
+                if (stat(d->full_path, &st) == -1)
+                  data_remove(s, d);
+                else if (st.st_ino != d->ino || st.st_dev != d->dev)
+                {
+                    ino_unlink(d);
+                    d->ino = st.st_ino;
+                    d->dev = st.st_dev;
+                    ino_link(d);
+                    data_touch(d);
+                }
+                continue;
+            }
+            if (now >= d->next_poll)
+            {
+                shard_alive(s);
+                if (stat(d->full_path, &st) == -1)
+                {
+                    data_remove(s, d);
+                    continue;
+                }
+                mtime = stat_mtime(&st);
+                if (!same_time(&mtime, &d->last_mod) ||
+                    st.st_size != d->last_size)
+                {
+                    d->last_mod = mtime;
+                    d->last_size = st.st_size;
+                    data_touch(d);
+                    d->poll_ival = POLL_MIN_MS;
+                }
+                else if ((d->poll_ival *= 2) > POLL_MAX_MS)
+                  d->poll_ival = POLL_MAX_MS;
+                d->next_poll = now + d->poll_ival * slow;
+            }
+            if (d->next_poll < next)
+              next = d->next_poll;
+        }
+    }
+    return next;
+}
+
+#ifdef HAVE_SYS_FANOTIFY_H
+/* Drain the fanotify queue of a shard, picking its own files by inode out of
+ * everything written on the mounts
+ */
+static void fan_handle_events(shard_t *s)
+{
+    char buf[16 * 1024]
+        __attribute__ ((aligned(__alignof__(struct fanotify_event_metadata))));
+    ssize_t len;
+    const struct fanotify_event_metadata *e;
+    struct stat st;
+    dir_t *dir;
+    data_t *d;
+
+    while ((len = read(s->fan, buf, sizeof(buf))) > 0)
+    {
+        for (e = (const struct fanotify_event_metadata *)buf;
+             FAN_EVENT_OK(e, len); e = FAN_EVENT_NEXT(e, len))
+        {
+            /* Events were lost: look at everything again */
+            if (e->mask & FAN_Q_OVERFLOW)
+            {
+                for (dir = s->dirs; dir; dir = dir->next)
+                  for (d = dir->files; d; d = d->dnext)
+                    data_touch(d);
+            }
+            if (e->fd < 0)
+              continue;
+            if (fstat(e->fd, &st) == 0)
+              for (d = *ino_bucket(s, st.st_dev, st.st_ino); d; d = d->inext)
+                if (d->ino == st.st_ino && d->dev == st.st_dev)
+                  data_touch(d);
+            close(e->fd);
+        }
+    }
+}
+#endif /* HAVE_SYS_FANOTIFY_H */
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* Watch a plain file with inotify, if the budget allows it */
+static void plain_watch(shard_t *s, data_t *d)
+{
+    int wd, err, size;
+    data_t **tmp;
+
+    if (s->ino < 0 || d->wd >= 0)
+      return;
+    pthread_mutex_lock(&watches.mtx);
+    if (watches.used >= watches.budget)
+    {
+        pthread_mutex_unlock(&watches.mtx);
+        return;
+    }
+    ++watches.used;
+    pthread_mutex_unlock(&watches.mtx);
+
+    /* The same file listed twice gets the same watch: it is polled */
+    wd = inotify_add_watch(s->ino, d->full_path, PLAIN_EVENTS);
+    err = errno;
+    if (wd == -1 || (wd < s->by_fwd_size && s->by_fwd[wd]))
+    {
+        pthread_mutex_lock(&watches.mtx);
+        --watches.used;
+        if (wd == -1 && err == ENOSPC)
+          watches.budget = watches.used;
+        pthread_mutex_unlock(&watches.mtx);
+        return;
+    }
+
+    if (wd >= s->by_fwd_size)
+    {
+        size = MAX(wd + 1, s->by_fwd_size * 2);
+        if (!(tmp = realloc(s->by_fwd, size * sizeof(data_t *))))
+          ER("Can't allocate memory for watch descriptors");
+        memset(tmp + s->by_fwd_size, 0,
+               (size - s->by_fwd_size) * sizeof(data_t *));
+        mem_add(MEM_INDEX, (size - s->by_fwd_size) * sizeof(data_t *),
+                s->by_fwd ? 0 : 1);
+        s->by_fwd = tmp;
+        s->by_fwd_size = size;
+    }
+    s->by_fwd[wd] = d;
+    d->wd = wd;
+}
+
+/* Stop watching a plain file: rotated, or its watch is gone */
+static void plain_unwatch(shard_t *s, data_t *d)
+{
+    if (d->wd < 0)
+      return;
+    inotify_rm_watch(s->ino, d->wd);
+    s->by_fwd[d->wd] = NULL;
+    d->wd = -1;
+    pthread_mutex_lock(&watches.mtx);
+    --watches.used;
+    pthread_mutex_unlock(&watches.mtx);
+}
+
+/* Drain the inotify queue of a shard */
+static void tree_handle_events(shard_t *s)
+{
+    char buf[64 * 1024]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX];
+    ssize_t len;
+    const char *p;
+    const struct inotify_event *e;
+    dir_t *dir;
+    data_t *d;
+    shard_t *owner;
+
+    while ((len = read(s->ino, buf, sizeof(buf))) > 0)
+    {
+        for (p = buf; p < buf + len; p += sizeof(*e) + e->len)
+        {
+            e = (const struct inotify_event *)p;
+
+            /* Events were lost: look at everything again */
+            if (e->mask & IN_Q_OVERFLOW)
+            {
+                step_stall(&s->steps[STEP_DETECT]);
+                for (dir = s->dirs; dir; dir = dir->next)
+                  for (d = dir->files; d; d = d->dnext)
+                    data_touch(d);
+                for (dir = s->dirs; dir; dir = dir->next)
+                  if (dir->wd >= 0)
+                    dir_rescan(s, dir);
+                continue;
+            }
+
+            /* A plain file: read it, or look at once whether it was
+             * rotated (moved, or unlinked while we hold it open)
+             */
+            if (e->wd >= 0 && e->wd < s->by_fwd_size &&
+                (d = s->by_fwd[e->wd]))
+            {
+                if (e->mask & IN_IGNORED)
+                  plain_unwatch(s, d);
+                else if (e->mask & IN_MODIFY)
+                  data_touch(d);
+                if (e->mask & (IN_IGNORED | IN_ATTRIB | IN_MOVE_SELF |
+                               IN_DELETE_SELF))
+                  d->next_poll = 0;
+                continue;
+            }
+
+            if (e->wd < 0 || e->wd >= s->by_wd_size ||
+                !(dir = s->by_wd[e->wd]))
+              continue;
+            if (e->mask & IN_IGNORED)
+            {
+                dir_remove(s, dir);
+                continue;
+            }
+            if (e->len == 0)
+              continue;
+
+            snprintf(path, sizeof(path), "%s/%s", dir->path, e->name);
+            if (e->mask & (IN_CREATE | IN_MOVED_TO))
+              tree_grow(s, dir, path);
+            else if ((e->mask & (IN_DELETE | IN_MOVED_FROM)) &&
+                     (e->mask & IN_ISDIR))
+            {
+                if ((owner = dir_owner(dir, path)) != s)
+                  shard_post(owner, SHARD_DROP, path, 0);
+                else
+                  tree_drop(s, path);
+            }
+            else if ((d = data_lookup(s, path)))
+            {
+                if (e->mask & (IN_DELETE | IN_MOVED_FROM))
+                  data_remove(s, d);
+                else
+                  data_touch(d);
+            }
+        }
+    }
+}
+#endif /* HAVE_SYS_INOTIFY_H */
+
+static void format_duration(char *buf, size_t size, long long ms)
+{
+    long secs = ms / 1000;
+    if (secs >= 3600)
+      snprintf(buf, size, "%ldh%02ldm", secs / 3600, secs / 60 % 60);
+    else if (secs >= 60)
+      snprintf(buf, size, "%ldm%02lds", secs / 60, secs % 60);
+    else
+      snprintf(buf, size, "%lds", secs);
+}
+
+static void format_size(char *buf, size_t size, unsigned long long bytes)
+{
+    if (bytes >= 1024ULL * 1024 * 1024)
+      snprintf(buf, size, "%.1fG", bytes / (1024.0 * 1024 * 1024));
+    else if (bytes >= 1024 * 1024)
+      snprintf(buf, size, "%.1fM", bytes / (1024.0 * 1024));
+    else if (bytes >= 1024)
+      snprintf(buf, size, "%.1fK", bytes / 1024.0);
+    else
+      snprintf(buf, size, "%lluB", bytes);
+}
+
+/* A value of a field in 5 characters or so: 0.123, 12.3, 1234, 12.3k */
+static void format_value(char *buf, size_t size, double v)
+{
+    if (v >= 1e9)
+      snprintf(buf, size, "%.0fG", v / 1e9);
+    else if (v >= 1e6)
+      snprintf(buf, size, "%.*fM", v < 1e7, v / 1e6);
+    else if (v >= 1e4)
+      snprintf(buf, size, "%.*fk", v < 1e5, v / 1e3);
+    else
+      snprintf(buf, size, "%.*f", v < 1 ? 3 : v < 10 ? 2 : v < 100, v);
+}
+
+/* Reports what goes on behind the scenes in the bottom border */
+static void write_status_window(WINDOW *master)
+{
+    static char shown[256];
+    static int shown_cols;
+    char status[256], lag[16];
+    unsigned long fired = 0, failed = 0;
+    int i, sampled;
+
+    status[0] = '\0';
+    if (fan.n_devs)
+      snprintf(status, sizeof(status),
+               "[%d tree files, %d mounts, %d polled dirs]",
+               watches.n_files, fan.n_devs, watches.n_polled);
+    else if (watches.n_dirs || watches.used)
+      snprintf(status, sizeof(status),
+               "[%d tree files, %ld/%ld watches, %d polled dirs]",
+               watches.n_files, watches.used, watches.budget,
+               watches.n_polled);
+    if (n_hooks)
+    {
+        for (i=0; i<n_hooks; ++i)
+        {
+            fired += hooks[i].fired;
+            failed += hooks[i].failed;
+        }
+        snprintf(status + strlen(status), sizeof(status) - strlen(status),
+                 "[%lu hook runs, %lu failed]", fired, failed);
+    }
+    if (n_unresponsive)
+      snprintf(status + strlen(status), sizeof(status) - strlen(status),
+               "[%d unresponsive]", n_unresponsive);
+    for (i=0, sampled=0; i<n_shards; ++i)
+      sampled += __atomic_load_n(&shards[i].n_sampled, __ATOMIC_RELAXED);
+    if (sampled)
+      snprintf(status + strlen(status), sizeof(status) - strlen(status),
+               "[%d sampled]", sampled);
+    if (n_anomalies)
+      snprintf(status + strlen(status), sizeof(status) - strlen(status),
+               "[%d unusual rates]", n_anomalies);
+    if (n_novel)
+      snprintf(status + strlen(status), sizeof(status) - strlen(status),
+               "[%d with new lines]", n_novel);
+    if (low_power)
+      snprintf(status + strlen(status), sizeof(status) - strlen(status),
+               "[idle]");
+    if (pressure.step)
+      snprintf(status + strlen(status), sizeof(status) - strlen(status),
+               "[memory pressure %.1f%%, shed %d/%d]", pressure.some,
+               pressure.step, PSI_STEPS);
+    if (govern.step)
+      snprintf(status + strlen(status), sizeof(status) - strlen(status),
+               "[cpu %.1f%%, slowed down %d/%d]", govern.used, govern.step,
+               GOVERN_STEPS);
+    if (lag_worst.lag > 0)
+    {
+        format_duration(lag, sizeof(lag), lag_worst.lag * 1000);
+        snprintf(status + strlen(status), sizeof(status) - strlen(status),
+                 "[%s behind: %s]", lag_worst.name, lag);
+    }
+
+    if (strcmp(shown, status) == 0 && shown_cols == COLS)
+      return;
+    strcpy(shown, status);
+    shown_cols = COLS;
+    mvwhline(master, LINES-1, 1, ACS_HLINE, COLS-2);
+    mvwprintw(master, LINES-1, MAX(1, COLS-2-(int)strlen(status)),
+              "%s", status);
+}
+
+/* Take in the files the shards published, they are marked as updated.
+ * Must be called with the post_menu mutex held.
+ */
+static void shards_take(screen_t *screen)
+{
+    int i, overflow = 0;
+    unsigned tail;
+    shard_t *s;
+    data_t *d;
+
+    for (i=0; i<n_shards; ++i)
+    {
+        s = &shards[i];
+        if (__atomic_exchange_n(&s->overflow, 0, __ATOMIC_ACQ_REL))
+          overflow = 1;
+        for (tail = s->tail;
+             tail != __atomic_load_n(&s->head, __ATOMIC_ACQUIRE); ++tail)
+        {
+            d = s->queue[tail % SHARD_QUEUE];
+            __atomic_store_n(&d->queued, 0, __ATOMIC_RELEASE);
+            d->state = UPDATED;
+        }
+        __atomic_store_n(&s->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    /* Some did not fit in a queue, their flag tells which ones */
+    if (overflow)
+      for (d=screen->datas; d; d=d->next)
+        if (__atomic_exchange_n(&d->queued, 0, __ATOMIC_ACQ_REL))
+          d->state = UPDATED;
+}
+
+/* Magnitude of the deviation of the line rate of a file.  Group rows, and
+ * the files of a group (its row stands out for them), stay where they are
+ * so that an open group is listed in one piece.
+ */
+static float item_score(const ITEM *item)
+{
+    const data_t *d = item_userptr(item);
+    return (d && !d->group) ? fabsf(d->score) : 0;
+}
+
+static int items_cmp_anomaly(const void *a, const void *b)
+{
+    float sa = item_score(*(ITEM * const *)a);
+    float sb = item_score(*(ITEM * const *)b);
+    return (sa < sb) - (sa > sb);
+}
+
+/* Flagged files first, the most unusual on top, the others (groups and
+ * their files among them) in their usual order
+ */
+static void items_sort_anomaly(ITEM **items, int n)
+{
+    ITEM **rest;
+    int i, flagged = 0, others = 0;
+
+    if (!(rest = malloc(n * sizeof(ITEM *))))
+      return;
+    for (i=0; i<n; ++i)
+      if (item_score(items[i]) >= RATE_SCORE)
+        items[flagged++] = items[i];
+      else
+        rest[others++] = items[i];
+    qsort(items, flagged, sizeof(ITEM *), items_cmp_anomaly);
+    memcpy(items + flagged, rest, others * sizeof(ITEM *));
+    free(rest);
+}
+
+/* Create the menu item of a group */
+static void group_new_item(group_t *g)
+{
+    g->item = new_item(g->name, g->row);
+    mem_add(MEM_CURSES, sizeof(ITEM), 1);
+    g->item->description.length = COLS;
+}
+
+/* Group whose row this is, NULL for a file */
+static group_t *item_group(const ITEM *item)
+{
+    int i;
+
+    if (item == NULL || item_userptr(item))
+      return NULL;
+    for (i=0; i<n_groups; ++i)
+      if (groups[i].item == item)
+        return &groups[i];
+    return NULL;
+}
+
+/* Lay the menu rows out in 'items': the files in their order, a group on
+ * the row of its first file, followed by its files while it is open.
+ * Returns the number of rows.
+ */
+static int menu_layout(screen_t *screen, ITEM **items)
+{
+    int i, n = 0;
+    data_t *d;
+    group_t *g;
+
+    for (i=0; i<n_groups; ++i)
+    {
+        groups[i].n_files = 0;
+        groups[i].placed = -1;
+    }
+    for (d=screen->datas; d; d=d->next)
+      if (d->group)
+        ++d->group->n_files;
+
+    for (d=screen->datas; d; d=d->next)
+    {
+        if (!d->item)
+          data_new_item(d);
+        if (!(g = d->group))
+        {
+            items[n++] = d->item;
+            continue;
+        }
+        if (g->placed < 0)
+        {
+            if (!g->item)
+              group_new_item(g);
+            items[n++] = g->item;
+            g->placed = n;
+            if (g->open)
+              n += g->n_files;
+        }
+        if (g->open)
+          items[g->placed++] = d->item;
+    }
+    return n;
+}
+
+/* A file of a group is gone, it no longer counts in it */
+static void group_forget(data_t *d)
+{
+    data_t *fresh = d;
+
+    if (d->severity)
+      --d->group->severe[d->severity];
+    __atomic_compare_exchange_n(&d->group->fresh, &fresh, NULL, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* Rebuild the menu items after files came or went, keeping the selection */
+static void screen_sync_menu(screen_t *screen)
+{
+    int i, n = 0;
+    ITEM **items, **old, *cur;
+    data_t *d;
+
+    pthread_mutex_lock(&mtx_post_menu);
+    cur = current_item(screen->menu);
+    for (d=screen->datas; d; d=d->next)
+      ++n;
+    if (!(items = calloc(n + n_groups + 1, sizeof(ITEM *))))
+      ER("Can't allocate memory for menu items");
+    n = menu_layout(screen, items);
+    mem_add(MEM_CURSES, (long)(n - item_count(screen->menu)) * sizeof(ITEM *),
+            0);
+    if (sort_anomaly)
+      items_sort_anomaly(items, n);
+
+    unpost_menu(screen->menu);
+    set_menu_items(screen->menu, items);
+    old = screen->items;
+    screen->items = items;
+
+    /* A file folded away with its group leaves the cursor on the group */
+    if (cur && (d = item_userptr(cur)) && d->group && !d->group->open)
+      cur = d->group->item;
+    for (i=0; i<n; ++i)
+      if (items[i] == cur)
+      {
+          set_current_item(screen->menu, cur);
+          break;
+      }
+    pthread_mutex_lock(&mtx_buffers);
+    post_menu(screen->menu);
+    pthread_mutex_unlock(&mtx_buffers);
+    free(old);
+
+    /* Nothing references the removed files anymore: their shard let go of
+     * them before they were buried, and what it published is taken in here.
+     */
+    shards_take(screen);
+    while ((d = graveyard))
+    {
+        graveyard = d->next;
+        if (show_details == d)
+          show_details = NULL;
+        if (d->pane)
+          pane_unpin(d->pane - panes);
+        if (d->group)
+          group_forget(d);
+        if (d->item)
+        {
+            free_item(d->item);
+            mem_add(MEM_CURSES, -(long)sizeof(ITEM), -1);
+        }
+        data_free(d);
+        heat.full = 1;
+    }
+    menu_dirty = 0;
+    pthread_mutex_unlock(&mtx_post_menu);
+}
+
+/* Write at most 'width' characters of a line, control characters as spaces */
+static void waddline(WINDOW *win, int y, int x, const char *s, size_t len,
+                     int width)
+{
+    wmove(win, y, x);
+    for (; len > 0 && width > 0; --len, --width, ++s)
+      waddch(win, iscntrl((unsigned char)*s) ? ' ' : (unsigned char)*s);
+}
+
+/* Make room in the read buffer of a shard */
+static void shard_scratch(shard_t *s, size_t size)
+{
+    char *tmp;
+
+    if (s->scratch_size >= size)
+      return;
+    if (!(tmp = realloc(s->scratch, size)))
+      ER("Can't allocate memory for read buffer");
+    mem_add(MEM_BUFFERS, size - s->scratch_size, s->scratch ? 0 : 1);
+    s->scratch = tmp;
+    s->scratch_size = size;
+}
+
+/* Append what was written to a pinned file since it was last read, keeping
+ * the last PANE_RETAIN bytes.  A pane scrolled back keeps showing the same
+ * lines.  The file is read without holding the buffer mutex, the pane may be
+ * gone meanwhile.
+ */
+static void pane_read(shard_t *s, data_t *d, FILE *fp)
+{
+    struct stat st;
+    size_t n, got, drop, i;
+    off_t offset, start;
+    pane_t *p;
+
+    pthread_mutex_lock(&mtx_buffers);
+    offset = (p = d->pane) ? p->offset : -1;
+    if (p && !p->buff && __atomic_load_n(&pressure.step, __ATOMIC_RELAXED))
+      p = NULL;     /* Dropped for lack of memory, it still is */
+    pthread_mutex_unlock(&mtx_buffers);
+    if (p == NULL || fstat(fileno(fp), &st) == -1)
+      return;
+
+    /* Truncated, or too much to keep: start over from the tail */
+    start = offset;
+    if (st.st_size < offset || st.st_size - offset > PANE_RETAIN)
+      start = MAX(0, st.st_size - PANE_RETAIN);
+    if (st.st_size == start)
+      return;
+
+    n = st.st_size - start;
+    shard_scratch(s, n);
+    if (fseeko(fp, start, SEEK_SET) == -1)
+      return;
+    got = fread(s->scratch, 1, n, fp);
+
+    pthread_mutex_lock(&mtx_buffers);
+    if ((p = d->pane) && p->offset == offset && !p->buff)
+    {
+        if ((p->buff = malloc(PANE_RETAIN)) == NULL)
+          ER("Can't allocate memory for pane buffer");
+        mem_add(MEM_HISTORY, PANE_RETAIN, 1);
+    }
+    if ((p = d->pane) && p->offset == offset && p->buff)
+    {
+        if (start != offset)
+        {
+            p->len = 0;
+            p->scroll = 0;
+        }
+        if (p->len + got > PANE_RETAIN)
+        {
+            drop = p->len + got - PANE_RETAIN;
+            memmove(p->buff, p->buff + drop, p->len - drop);
+            p->len -= drop;
+        }
+        memcpy(p->buff + p->len, s->scratch, got);
+        if (p->scroll > 0)
+          for (i=0; i<got; ++i)
+            if (p->buff[p->len + i] == '\n')
+              ++p->scroll;
+        p->len += got;
+        p->offset = start + got;
+        p->dirty = 1;
+    }
+    pthread_mutex_unlock(&mtx_buffers);
+}
+
+/* Draw the lines of a pane from the bottom up, skipping the scrolled ones */
+static void pane_draw(pane_t *p, int focused)
+{
+    int y, h, w, skip;
+    const char *start, *end;
+
+    werase(p->win);
+    getmaxyx(p->win, h, w);
+
+    end = p->buff + p->len;
+    if (end > p->buff && end[-1] == '\n')
+      --end;
+    skip = p->scroll;
+    for (y = h - 2; y >= 1 && end > p->buff; )
+    {
+        for (start = end; start > p->buff && start[-1] != '\n'; --start)
+          ;
+        if (skip > 0)
+          --skip;
+        else
+          waddline(p->win, y--, 1, start, end - start, w - 2);
+        end = (start > p->buff) ? start - 1 : p->buff;
+    }
+
+    /* Scrolled back past the retained lines */
+    if (skip > 0)
+    {
+        p->scroll -= skip;
+        pane_draw(p, focused);
+        return;
+    }
+
+    box(p->win, 0, 0);
+    if (focused)
+      wattron(p->win, A_REVERSE);
+    mvwprintw(p->win, 0, 1, "[%s]", p->data->base_name);
+    wattroff(p->win, A_REVERSE);
+    if (p->scroll > 0)
+      mvwprintw(p->win, h - 1, MAX(1, w - 12), "[-%d]", p->scroll);
+    p->dirty = 0;
+}
+
+/* Tile the panes over the content window, side by side first */
+static void panes_layout(void)
+{
+    int i, rows, cols, r, c, in_row, y, x, h, w;
+    pane_t *p;
+
+    for (cols = 1; cols * cols < n_panes; ++cols)
+      ;
+    rows = (n_panes + cols - 1) / cols;
+
+    for (i=0; i<n_panes; ++i)
+    {
+        p = &panes[i];
+        r = i / cols;
+        c = i % cols;
+        /* The last row may have fewer (wider) panes */
+        in_row = MIN(cols, n_panes - r * cols);
+        y = 2 + r * INNER_WIN_LINES / rows;
+        h = 2 + (r + 1) * INNER_WIN_LINES / rows - y;
+        x = 1 + c * INNER_WIN_COLS / in_row;
+        w = 1 + (c + 1) * INNER_WIN_COLS / in_row - x;
+
+        if (p->panel)
+          del_panel(p->panel);
+        if (p->win)
+          delwin(p->win);
+        p->win = newwin(h, w, y, x);
+        p->panel = new_panel(p->win);
+        if (!show_panes)
+          hide_panel(p->panel);
+        p->dirty = 1;
+    }
+}
+
+static void pane_unpin(int idx)
+{
+    pane_t *p = &panes[idx];
+
+    pthread_mutex_lock(&mtx_buffers);
+    p->data->pane = NULL;
+    del_panel(p->panel);
+    delwin(p->win);
+    if (p->buff)
+      mem_add(MEM_HISTORY, -PANE_RETAIN, -1);
+    free(p->buff);
+    memmove(&panes[idx], &panes[idx + 1], (n_panes - idx - 1) * sizeof(*p));
+    memset(&panes[--n_panes], 0, sizeof(*p));
+    for (idx=0; idx<n_panes; ++idx)
+      panes[idx].data->pane = &panes[idx];
+    pthread_mutex_unlock(&mtx_buffers);
+
+    if (focused_pane >= n_panes)
+      focused_pane = MAX(0, n_panes - 1);
+    if (n_panes == 0)
+      show_panes = 0;
+    panes_layout();
+}
+
+/* Pin a file in a new pane, or unpin it if it already is */
+static void pane_toggle(data_t *d)
+{
+    pane_t *p;
+
+    if (d == NULL)
+      return;
+    if (d->pane)
+    {
+        pane_unpin(d->pane - panes);
+        return;
+    }
+    if (n_panes == max_panes)
+      return;
+
+    pthread_mutex_lock(&mtx_buffers);
+    p = &panes[n_panes++];
+    memset(p, 0, sizeof(*p));
+    if ((p->buff = malloc(PANE_RETAIN)) == NULL)
+      ER("Can't allocate memory for pane buffer");
+    mem_add(MEM_HISTORY, PANE_RETAIN, 1);
+    p->data = d;
+    d->pane = p;
+    pthread_mutex_unlock(&mtx_buffers);
+    panes_layout();
+
+    /* Fill the pane */
+    shard_post(d->shard, SHARD_REFRESH, d->full_path, 0);
+}
+
+/* Handle the split view commands */
+static void panes_command(screen_t *screen, char cmd)
+{
+    int i, page;
+    pane_t *p = n_panes ? &panes[focused_pane] : NULL;
+
+    switch (cmd)
+    {
+        case PIN_PANE:
+            pthread_mutex_lock(&mtx_post_menu);
+            pane_toggle(item_userptr(current_item(screen->menu)));
+            pthread_mutex_unlock(&mtx_post_menu);
+            return;
+        case SHOW_PANES:
+        case HIDE_PANES:
+            show_panes = (cmd == SHOW_PANES && n_panes > 0);
+            for (i=0; i<n_panes; ++i)
+            {
+                if (show_panes)
+                  show_panel(panes[i].panel);
+                else
+                  hide_panel(panes[i].panel);
+                panes[i].dirty = 1;
+            }
+            return;
+    }
+
+    if (p == NULL)
+      return;
+    page = MAX(1, getmaxy(p->win) - 3);
+    if (cmd == UNPIN_PANE)
+    {
+        pane_unpin(focused_pane);
+        return;
+    }
+
+    pthread_mutex_lock(&mtx_buffers);
+    switch (cmd)
+    {
+        case PANE_FOCUS:
+            p->dirty = 1;
+            focused_pane = (focused_pane + 1) % n_panes;
+            p = &panes[focused_pane];
+            break;
+        case PANE_UP:        p->scroll += 1;                   break;
+        case PANE_DOWN:      p->scroll = MAX(0, p->scroll - 1);    break;
+        case PANE_PAGE_UP:   p->scroll += page;                break;
+        case PANE_PAGE_DOWN: p->scroll = MAX(0, p->scroll - page); break;
+        case PANE_FOLLOW:    p->scroll = 0;                    break;
+    }
+    p->dirty = 1;
+    pthread_mutex_unlock(&mtx_buffers);
+}
+
+/* Redraw the panes whose file (or scroll state) changed */
+static void panes_update(void)
+{
+    int i;
+
+    pthread_mutex_lock(&mtx_buffers);
+    for (i=0; i<n_panes; ++i)
+      if (panes[i].dirty)
+        pane_draw(&panes[i], i == focused_pane);
+    pthread_mutex_unlock(&mtx_buffers);
+}
+
+/* Description of an item whose last line is not known (yet) */
+static char *item_updating(void)
+{
+    static char *line = NULL;
+    const char *def = "Updating...";
+
+    /* Allocate a long line for the description (make it all spaces) */
+    if (line == NULL)
+    {
+        if ((line = malloc(COLS + 1)) == NULL)
+          ER("Can't allocate memory for item description");
+        memset(line, ' ', COLS);
+        line[COLS] = '\0';
+        memcpy(line, def, MIN(strlen(def), (size_t)COLS));
+    }
+    return line;
+}
+
+/* Draw a marker in front of a menu row if it is visible */
+static void mark_item(screen_t *screen, const data_t *d, int x,
+                      const char *mark)
+{
+    int row = item_index(d->item) - top_row(screen->menu);
+    if (row >= 0 && row < getmaxy(screen->content))
+      mvwprintw(screen->content, row, x, "%s", mark);
+}
+
+/* Show a menu row in another attribute if it is visible */
+static void highlight_item(screen_t *screen, const ITEM *item, attr_t attr)
+{
+    int row = item_index(item) - top_row(screen->menu);
+    if (row >= 0 && row < getmaxy(screen->content))
+      mvwchgat(screen->content, row, 0, -1, attr, 0, NULL);
+}
+
+/* Show what the plugins of a file tell instead of its last line: the row of
+ * the first one with something to say.  Must be called with the buffer
+ * mutex held.
+ */
+static void plugin_row(data_t *d)
+{
+    const treetop_note_t *note;
+    int i;
+
+    d->highlight = TREETOP_PLAIN;
+    for (i=n_plugins-1; i>=0; --i)
+    {
+        if (!(d->plugins & (1UL << i)))
+          continue;
+        note = &d->notes[n_plugins + i];
+        if (note->row[0])
+          d->item->description.str = note->row;
+        d->highlight = MAX(d->highlight, note->highlight);
+    }
+}
+
+/* Row of the menu showing a file, relative to the top of the window: its
+ * own, or that of its group when it has the freshest line of it and is
+ * folded away.  Negative if it has none.
+ */
+static int data_row(screen_t *screen, const data_t *d)
+{
+    int row = d->item ? item_index(d->item) : ERR;
+
+    if (row == ERR && d->group && d->group->item &&
+        d == __atomic_load_n(&d->group->fresh, __ATOMIC_RELAXED))
+      row = item_index(d->group->item);
+    return row == ERR ? -1 : row - top_row(screen->menu);
+}
+
+/* Lines appended to a file of a group: it has the freshest line of them */
+static void group_lines(data_t *d, unsigned long lines)
+{
+    if (lines == 0)
+      return;
+    __atomic_add_fetch(&d->group->lines, lines, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->group->fresh, d, __ATOMIC_RELAXED);
+}
+
+/* A line of a file matched a hook, or was of a new kind */
+static void group_alert(data_t *d)
+{
+    if (d->group)
+      __atomic_add_fetch(&d->group->alerts, 1, __ATOMIC_RELAXED);
+}
+
+/* Count a file in its group as flagged as it now is: what its plugins ask
+ * for, bold for a line of a new kind, alert for an unusual rate
+ */
+static void group_severity(data_t *d, long long now)
+{
+    int severity = d->highlight;
+
+    if (d->bloom && d->bloom->novel_at && now - d->bloom->novel_at < NOVEL_MS)
+      severity = MAX(severity, TREETOP_BOLD);
+    if (fabsf(d->score) >= RATE_SCORE)
+      severity = TREETOP_ALERT;
+    if (severity == d->severity)
+      return;
+    if (d->severity)
+      --d->group->severe[d->severity];
+    if (severity)
+      ++d->group->severe[severity];
+    d->severity = severity;
+}
+
+/* Show the totals of a group and the freshest line of its files.  Must be
+ * called with the buffer mutex held.
+ */
+static void group_row(group_t *g)
+{
+    const data_t *f = __atomic_load_n(&g->fresh, __ATOMIC_RELAXED);
+    const char *line = (f && f->line) ? f->line : "";
+    unsigned long alerts = __atomic_load_n(&g->alerts, __ATOMIC_RELAXED);
+
+    snprintf(g->row, sizeof(g->row), "%s %d file%s, %.1f/s, %lu alert%s  "
+             "%s%s%.*s", g->open ? "-" : "+", g->n_files,
+             g->n_files == 1 ? "" : "s", g->rate, alerts,
+             alerts == 1 ? "" : "s", f ? f->base_name : "", f ? ": " : "",
+             (int)strcspn(line, "\n"), line);
+}
+
+#ifdef HAVE_SPAWN_H
+/* Parse an 'on /REGEX/ [in NAME] [debounce SECS] [max N] run COMMAND' rule.
+ * Returns 0 on success.
+ */
+static int hook_parse(char *c)
+{
+    char *end, *tok, *save = NULL;
+    hook_t *h;
+
+    if (n_hooks == MAX_HOOKS)
+      return -1;
+
+    /* The regex runs up to the next unescaped slash */
+    c += strlen("on");
+    while (isspace((unsigned char)*c))
+      ++c;
+    if (*c++ != '/')
+      return -1;
+    for (end = c; *end && (*end != '/' || end[-1] == '\\'); ++end)
+      ;
+    if (*end != '/')
+      return -1;
+    *end++ = '\0';
+
+    h = &hooks[n_hooks];
+    memset(h, 0, sizeof(*h));
+    if (regcomp(&h->re, c, REG_EXTENDED | REG_NOSUB) != 0)
+      return -1;
+    h->debounce_ms = DEFAULT_DEBOUNCE_SECS * 1000;
+    h->max_running = 1;
+
+    while ((tok = strtok_r(save ? NULL : end, " \t", &save)))
+    {
+        if (strcmp(tok, "in") == 0 && (tok = strtok_r(NULL, " \t", &save)))
+          h->in = strdup(tok);
+        else if (strcmp(tok, "debounce") == 0 &&
+                 (tok = strtok_r(NULL, " \t", &save)))
+          h->debounce_ms = atof(tok) * 1000;
+        else if (strcmp(tok, "max") == 0 &&
+                 (tok = strtok_r(NULL, " \t", &save)))
+          h->max_running = MAX(1, atoi(tok));
+        else if (strcmp(tok, "run") == 0)
+        {
+            /* The command is the rest of the line */
+            while (*save && isspace((unsigned char)*save))
+              ++save;
+            if (*save)
+              h->command = strdup(save);
+            break;
+        }
+        else
+          break;
+    }
+
+    if (h->command == NULL || h->debounce_ms < 0)
+    {
+        regfree(&h->re);
+        free(h->in);
+        return -1;
+    }
+    ++n_hooks;
+    return 0;
+}
+
+/* Hooks applying to a file, decided once per file */
+static unsigned long hook_mask(data_t *d)
+{
+    int i;
+
+    if (!d->hooks_known)
+    {
+        d->hooks = 0;
+        for (i=0; i<n_hooks; ++i)
+          if (hooks[i].in == NULL ||
+              fnmatch(hooks[i].in, d->base_name, 0) == 0 ||
+              fnmatch(hooks[i].in, d->full_path, 0) == 0)
+            d->hooks |= 1UL << i;
+        d->hooks_known = 1;
+    }
+    return d->hooks;
+}
+
+/* Match a new (NUL terminated) line against the hooks of its file and batch
+ * it for the hook thread.  Rules not restricted to some files get the file
+ * name in front of each line.
+ */
+static void hook_line(data_t *d, const char *line, size_t len)
+{
+    int i;
+    size_t need;
+    hook_t *h;
+    unsigned long mask = d->hooks;
+
+    for (i=0; mask; ++i, mask >>= 1)
+    {
+        h = &hooks[i];
+        if (!(mask & 1) || regexec(&h->re, line, 0, NULL, 0) != 0)
+          continue;
+
+        group_alert(d);
+        pthread_mutex_lock(&mtx_hooks);
+        ++h->matched;
+        need = len + 1 + (h->in ? 0 : strlen(d->base_name) + 2);
+        if (h->batch_len + need > HOOK_BATCH)
+          ++h->dropped;
+        else
+        {
+            if (!h->batch)
+            {
+                if (!(h->batch = malloc(HOOK_BATCH)))
+                  ER("Can't allocate memory for hook batch");
+                mem_add(MEM_BUFFERS, HOOK_BATCH, 1);
+            }
+            if (!h->in)
+              h->batch_len += sprintf(h->batch + h->batch_len, "%s: ",
+                                      d->base_name);
+            memcpy(h->batch + h->batch_len, line, len);
+            h->batch_len += len;
+            h->batch[h->batch_len++] = '\n';
+            ++h->batch_lines;
+        }
+        if (h->due == 0)
+        {
+            /* First match of a window: it fires once the window is over */
+            h->due = now_ms() + h->debounce_ms;
+            snprintf(h->file, sizeof(h->file), "%s", d->full_path);
+            pthread_cond_signal(&cond_hooks);
+        }
+        pthread_mutex_unlock(&mtx_hooks);
+    }
+}
+
+/* Run the command of a hook with its batch on stdin.  The batch is handed
+ * over through an unlinked file, so a command not reading its input never
+ * blocks us.  Called without the hooks mutex: returns the pid of the
+ * command, -1 if it could not be run.
+ */
+static pid_t hook_spawn(const hook_job_t *job)
+{
+    FILE *in;
+    pid_t pid;
+    char *argv[] = { "sh", "-c", job->hook->command, NULL };
+    char env_file[PATH_MAX + 16], env_lines[64], env_dropped[64], **envp;
+    posix_spawn_file_actions_t fa;
+    int n, err;
+
+    if (!(in = tmpfile()))
+      return -1;
+    fd_cloexec(fileno(in));
+    fwrite(job->batch, 1, job->batch_len, in);
+    fflush(in);
+    rewind(in);
+
+    /* Our environment plus what the command may want to know */
+    for (n=0; environ[n]; ++n)
+      ;
+    if (!(envp = malloc((n + 4) * sizeof(char *))))
+      ER("Can't allocate memory for hook environment");
+    memcpy(envp, environ, n * sizeof(char *));
+    snprintf(env_file, sizeof(env_file), "TREETOP_FILE=%s", job->file);
+    snprintf(env_lines, sizeof(env_lines), "TREETOP_LINES=%lu",
+             job->batch_lines);
+    snprintf(env_dropped, sizeof(env_dropped), "TREETOP_DROPPED=%lu",
+             job->dropped);
+    envp[n++] = env_file;
+    envp[n++] = env_lines;
+    envp[n++] = env_dropped;
+    envp[n] = NULL;
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_adddup2(&fa, fileno(in), STDIN_FILENO);
+    posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null",
+                                     O_WRONLY, 0);
+    err = posix_spawn(&pid, "/bin/sh", &fa, NULL, argv, envp);
+    posix_spawn_file_actions_destroy(&fa);
+    fclose(in);
+    free(envp);
+    return err ? -1 : pid;
+}
+
+/* Fire the batch of a hook: it is taken out under the hooks mutex, which
+ * is let go of while the command is started.  Must be called with the
+ * hooks mutex held.
+ */
+static void hook_fire(hook_t *h)
+{
+    hook_job_t job;
+    pid_t pid;
+    int i;
+
+    job.hook = h;
+    job.batch = h->batch;
+    job.batch_len = h->batch_len;
+    job.batch_lines = h->batch_lines;
+    job.dropped = h->dropped;
+    memcpy(job.file, h->file, sizeof(job.file));
+    h->batch = NULL;
+    h->batch_len = h->batch_lines = h->dropped = 0;
+    h->due = 0;
+
+    /* Room taken for it until it is known to run */
+    ++h->running;
+    ++n_children;
+    pthread_mutex_unlock(&mtx_hooks);
+    pid = hook_spawn(&job);
+    if (job.batch)
+    {
+        free(job.batch);
+        mem_add(MEM_BUFFERS, -HOOK_BATCH, -1);
+    }
+    pthread_mutex_lock(&mtx_hooks);
+
+    if (pid < 0)
+    {
+        --h->running;
+        --n_children;
+        ++h->failed;
+        return;
+    }
+    for (i=0; i<MAX_HOOK_CHILDREN; ++i)
+      if (children[i].pid == 0)
+      {
+          children[i].pid = pid;
+          children[i].hook = h;
+          break;
+      }
+    ++h->fired;
+}
+
+/* Hook thread: fires the batches whose debounce window is over, as long as
+ * their rule has room for one more running command, and reaps commands.
+ */
+static void *thread_hooks(void *args)
+{
+    int i, status;
+    long long now, next;
+    struct timespec ts;
+    hook_t *h;
+
+    (void)args;
+    pthread_mutex_lock(&mtx_hooks);
+    for (;;)
+    {
+        for (i=0; i<MAX_HOOK_CHILDREN; ++i)
+          if (children[i].pid &&
+              waitpid(children[i].pid, &status, WNOHANG) != 0)
+          {
+              --children[i].hook->running;
+              --n_children;
+              children[i].pid = 0;
+          }
+
+        now = now_ms();
+        next = now + HOOK_REAP_MS;
+        for (i=0; i<n_hooks; ++i)
+        {
+            h = &hooks[i];
+            if (h->due == 0)
+              continue;
+            if (now >= h->due && h->running < h->max_running &&
+                n_children < MAX_HOOK_CHILDREN)
+              hook_fire(h);
+            else if (h->due < next && now < h->due)
+              next = h->due;
+        }
+
+        ts.tv_sec = next / 1000;
+        ts.tv_nsec = (next % 1000) * 1000000;
+        pthread_cond_timedwait(&cond_hooks, &mtx_hooks, &ts);
+    }
+    pthread_mutex_unlock(&mtx_hooks);
+
+    return NULL;
+}
+#endif /* HAVE_SPAWN_H */
+
+static int ts_digits(const char *p, int n)
+{
+    int v = 0;
+    while (n--)
+    {
+        if (!isdigit((unsigned char)*p))
+          return -1;
+        v = v * 10 + *p++ - '0';
+    }
+    return v;
+}
+
+static int ts_month(const char *p)
+{
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    int i;
+    for (i=0; i<12; ++i)
+      if (strncmp(months + i*3, p, 3) == 0)
+        return i;
+    return -1;
+}
+
+/* Parse a timestamp of layout 'fmt' at 'p' ('n' bytes).  Returns how many
+ * bytes it takes up to the seconds, 0 if there is none.
+ */
+static size_t ts_parse(int fmt, const char *p, size_t n, time_t *t)
+{
+    struct tm tm, now_tm;
+    const char *z;
+    size_t len;
+    int utc = 0, h, m;
+    long tz = 0;
+    time_t now;
+
+    memset(&tm, 0, sizeof(tm));
+    switch (fmt)
+    {
+        case TS_ISO:
+            if (n < 19 || p[4] != '-' || p[7] != '-' ||
+                (p[10] != ' ' && p[10] != 'T') || p[13] != ':' || p[16] != ':')
+              return 0;
+            tm.tm_year = ts_digits(p, 4) - 1900;
+            tm.tm_mon = ts_digits(p + 5, 2) - 1;
+            tm.tm_mday = ts_digits(p + 8, 2);
+            tm.tm_hour = ts_digits(p + 11, 2);
+            tm.tm_min = ts_digits(p + 14, 2);
+            tm.tm_sec = ts_digits(p + 17, 2);
+            len = 19;
+
+            /* Fraction of a second, then a time zone maybe */
+            z = p + len;
+            if (z < p + n && (*z == '.' || *z == ','))
+              for (++z; z < p + n && isdigit((unsigned char)*z); ++z)
+                ;
+            if (z < p + n && *z == 'Z')
+              utc = 1;
+            else if (z + 5 <= p + n && (*z == '+' || *z == '-'))
+            {
+                h = ts_digits(z + 1, 2);
+                m = ts_digits(z + (z[3] == ':' ? 4 : 3), 2);
+                if (h >= 0 && m >= 0)
+                {
+                    utc = 1;
+                    tz = (h * 3600L + m * 60) * (*z == '-' ? -1 : 1);
+                }
+            }
+            break;
+        case TS_SYSLOG:
+            if (n < 15 || p[3] != ' ' || p[6] != ' ' || p[9] != ':' ||
+                p[12] != ':')
+              return 0;
+            tm.tm_mon = ts_month(p);
+            tm.tm_mday = (p[4] == ' ') ? ts_digits(p + 5, 1)
+                                       : ts_digits(p + 4, 2);
+            tm.tm_hour = ts_digits(p + 7, 2);
+            tm.tm_min = ts_digits(p + 10, 2);
+            tm.tm_sec = ts_digits(p + 13, 2);
+            len = 15;
+
+            /* No year: this one, unless that is in the future */
+            now = time(NULL);
+            localtime_r(&now, &now_tm);
+            tm.tm_year = now_tm.tm_year;
+            if (tm.tm_mon > now_tm.tm_mon + 1)
+              --tm.tm_year;
+            break;
+        case TS_CLF:
+            if (n < 20 || p[2] != '/' || p[6] != '/' || p[11] != ':' ||
+                p[14] != ':' || p[17] != ':')
+              return 0;
+            tm.tm_mday = ts_digits(p, 2);
+            tm.tm_mon = ts_month(p + 3);
+            tm.tm_year = ts_digits(p + 7, 4) - 1900;
+            tm.tm_hour = ts_digits(p + 12, 2);
+            tm.tm_min = ts_digits(p + 15, 2);
+            tm.tm_sec = ts_digits(p + 18, 2);
+            len = 20;
+            if (n >= 26 && p[20] == ' ' && (p[21] == '+' || p[21] == '-') &&
+                (h = ts_digits(p + 22, 2)) >= 0 &&
+                (m = ts_digits(p + 24, 2)) >= 0)
+            {
+                utc = 1;
+                tz = (h * 3600L + m * 60) * (p[21] == '-' ? -1 : 1);
+            }
+            break;
+        default:
+            return 0;
+    }
+
+    if (tm.tm_year < 0 || tm.tm_mon < 0 || tm.tm_mon > 11 ||
+        tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_hour < 0 ||
+        tm.tm_hour > 23 || tm.tm_min < 0 || tm.tm_min > 59 ||
+        tm.tm_sec < 0 || tm.tm_sec > 60)
+      return 0;
+    tm.tm_isdst = -1;
+    *t = utc ? timegm(&tm) - tz : mktime(&tm);
+    return len;
+}
+
+/* Files whose lines are still looked at for timestamps */
+static int stamp_wanted(const data_t *d)
+{
+    return !d->stamp || d->stamp->fmt != TS_NONE ||
+           d->stamp->probes < TS_PROBES;
+}
+
+/* Look for a timestamp of any layout near the start of a line */
+static size_t ts_find(const char *line, size_t len, int *fmt, int *off,
+                      time_t *t)
+{
+    size_t n;
+
+    for (*off = 0; *off < TS_SCAN && (size_t)*off < len; ++*off)
+      for (*fmt = TS_ISO; *fmt <= TS_CLF; ++*fmt)
+        if ((n = ts_parse(*fmt, line + *off, len - *off, t)))
+          return n;
+    return 0;
+}
+
+/* Note how long ago the line says it was written */
+static void stamp_line(data_t *d, const char *line, size_t len)
+{
+    stamp_t *st;
+    size_t n = 0;
+    int fmt, off;
+    time_t t;
+
+    if (!d->stamp)
+    {
+        if (!(d->stamp = calloc(1, sizeof(stamp_t))))
+          return;
+        mem_add(MEM_LINES, sizeof(stamp_t), 1);
+    }
+    st = d->stamp;
+
+    /* Same second as the last line, most of the time */
+    if (st->fmt != TS_NONE && st->off + st->len <= len &&
+        memcmp(line + st->off, st->prefix, st->len) == 0)
+      t = st->t;
+    else
+    {
+        /* Where it was in the last line, or anywhere near the start */
+        if (st->fmt == TS_NONE || (size_t)st->off >= len ||
+            !(n = ts_parse(st->fmt, line + st->off, len - st->off, &t)))
+        {
+            if (!(n = ts_find(line, len, &fmt, &off, &t)))
+            {
+                if (st->fmt == TS_NONE)
+                  ++st->probes;
+                return;
+            }
+            st->fmt = fmt;
+            st->off = off;
+        }
+        st->len = MIN(n, sizeof(st->prefix));
+        memcpy(st->prefix, line + st->off, st->len);
+        st->t = t;
+    }
+
+    __atomic_store_n(&d->lag, (long)MAX(0, time(NULL) - t), __ATOMIC_RELAXED);
+}
+
+/* Counter of a template in row 'r' of a half of the sketch */
+static unsigned *topk_cell(topk_t *t, int half, int r, unsigned long long h)
+{
+    unsigned i = (unsigned)h + r * ((unsigned)(h >> 32) | 1);
+
+    return &t->cms[half][r][i & (TOPK_WIDTH - 1)];
+}
+
+/* Lines of a template over the window, never less than there were */
+static unsigned long topk_estimate(topk_t *t, unsigned long long h)
+{
+    unsigned long n, least = ~0UL;
+    int r;
+
+    for (r=0; r<TOPK_DEPTH; ++r)
+    {
+        n = *topk_cell(t, 0, r, h) + *topk_cell(t, 1, r, h);
+        least = MIN(least, n);
+    }
+    return least;
+}
+
+/* Restore the heap below a template whose count went up, or above one
+ * just added
+ */
+static void topk_down(topk_t *t, int i)
+{
+    template_t tmp;
+    int c;
+
+    while ((c = 2 * i + 1) < t->n)
+    {
+        if (c + 1 < t->n && t->heap[c+1].count < t->heap[c].count)
+          ++c;
+        if (t->heap[i].count <= t->heap[c].count)
+          break;
+        tmp = t->heap[i];
+        t->heap[i] = t->heap[c];
+        t->heap[c] = tmp;
+        i = c;
+    }
+}
+
+static void topk_up(topk_t *t, int i)
+{
+    template_t tmp;
+
+    while (i > 0 && t->heap[(i-1) / 2].count > t->heap[i].count)
+    {
+        tmp = t->heap[i];
+        t->heap[i] = t->heap[(i-1) / 2];
+        t->heap[(i-1) / 2] = tmp;
+        i = (i-1) / 2;
+    }
+}
+
+/* Start a new half of the window once it is time, dropping the oldest
+ * one (both if nothing was counted for that long).  Must be called with
+ * the mutex of the counts held.
+ */
+static void topk_turn(topk_t *t, long long now)
+{
+    int i, n;
+
+    if (now < t->turn)
+      return;
+    if (now - t->turn >= TOPK_WINDOW_MS / 2)
+    {
+        memset(t->cms, 0, sizeof(t->cms));
+        memset(t->lines, 0, sizeof(t->lines));
+    }
+    else
+    {
+        t->cur ^= 1;
+        memset(t->cms[t->cur], 0, sizeof(t->cms[t->cur]));
+        t->lines[t->cur] = 0;
+    }
+    t->turn = now + TOPK_WINDOW_MS / 2;
+
+    /* What is left of the counts of the templates kept */
+    for (i=n=0; i<t->n; ++i)
+      if ((t->heap[i].count = topk_estimate(t, t->heap[i].hash)) > 0)
+        t->heap[n++] = t->heap[i];
+    t->n = n;
+    for (i = n / 2 - 1; i >= 0; --i)
+      topk_down(t, i);
+}
+
+/* Length of the word at 'p' (letters and digits), and whether it is
+ * masked: it has a digit in it, or is a long run of hex digits
+ */
+static size_t topk_word(const char *p, const char *end, int *masked)
+{
+    const char *q;
+    int digit = 0, hex = 1;
+
+    for (q = p; q < end && isalnum((unsigned char)*q); ++q)
+    {
+        digit |= isdigit((unsigned char)*q);
+        hex &= isxdigit((unsigned char)*q) != 0;
+    }
+    *masked = digit || (hex && q - p >= 8);
+    return q - p;
+}
+
+/* Add a character to the template being built, and to its hash */
+static void topk_emit(char *text, size_t *n, unsigned long long *h, char c)
+{
+    *h = (*h ^ (unsigned char)c) * 1099511628211ULL;
+    if (*n < TOPK_TEXT - 1)
+      text[(*n)++] = c;
+}
+
+/* Template of a line: the line with its words masked, spaces squeezed,
+ * hashed as it is built (TOPK_TEXT bytes of it kept in 'text').  A run of
+ * masked words joined by '-', '.' or ':' (UUIDs, addresses, times) is
+ * masked as one.  Returns its length, 0 for a blank line.
+ */
+static size_t line_template(const char *line, size_t len, char *text,
+                            unsigned long long *hash)
+{
+    const char *p = line, *end = line + len, *w;
+    unsigned long long h = 14695981039346656037ULL;
+    size_t n = 0, wlen;
+    int masked, last_masked = 0, space = 0;
+
+    while (p < end)
+    {
+        if (isspace((unsigned char)*p))
+        {
+            space = (n > 0);
+            last_masked = 0;
+            ++p;
+            continue;
+        }
+        if (space)
+          topk_emit(text, &n, &h, ' ');
+        space = 0;
+
+        if (isalnum((unsigned char)*p))
+        {
+            wlen = topk_word(p, end, &masked);
+            if (!masked)
+              for (w = p; w < p + wlen; ++w)
+                topk_emit(text, &n, &h, *w);
+            else
+              for (w = TOPK_MASK; *w; ++w)
+                topk_emit(text, &n, &h, *w);
+            last_masked = masked;
+            p += wlen;
+        }
+        else if (last_masked && (*p == '-' || *p == '.' || *p == ':') &&
+                 (wlen = topk_word(p + 1, end, &masked)) && masked)
+          p += 1 + wlen;
+        else
+        {
+            topk_emit(text, &n, &h, *p);
+            last_masked = 0;
+            ++p;
+        }
+    }
+    text[n] = '\0';
+    *hash = h;
+    return n;
+}
+
+/* Count a new line under its template.  Must be called with the mutex of
+ * the counts held.
+ */
+static void topk_count(topk_t *t, unsigned long long h, const char *text,
+                       size_t n)
+{
+    unsigned long est;
+    int i, r;
+
+    ++t->lines[t->cur];
+    for (r=0; r<TOPK_DEPTH; ++r)
+      ++*topk_cell(t, t->cur, r, h);
+    est = topk_estimate(t, h);
+
+    for (i=0; i<t->n && t->heap[i].hash != h; ++i)
+      ;
+    if (i < t->n)
+    {
+        t->heap[i].count = est;
+        topk_down(t, i);
+        return;
+    }
+    if (t->n == TOPK_KEEP)
+    {
+        if (est <= t->heap[0].count)
+          return;
+        i = 0;
+    }
+    else
+      i = t->n++;
+    t->heap[i].hash = h;
+    t->heap[i].count = est;
+    memcpy(t->heap[i].text, text, n + 1);
+    if (i == 0)
+      topk_down(t, 0);
+    topk_up(t, i);
+}
+
+/* Parse a 'KEYWORD FIELD|/REGEX/ [in NAME]' rule ('distinct' or
+ * 'quantiles') into 'rules'.  Returns 0 on success.
+ */
+static int field_parse(char *c, field_t *rules, int *n)
+{
+    char *end, *tok, *save = NULL;
+    field_t *r;
+
+    if (*n == MAX_FIELDS)
+      return -1;
+    r = &rules[*n];
+    memset(r, 0, sizeof(*r));
+
+    /* A field number, or a regex running up to the next unescaped slash */
+    while (*c && !isspace((unsigned char)*c))
+      ++c;
+    while (isspace((unsigned char)*c))
+      ++c;
+    if (*c == '/')
+    {
+        for (end = ++c; *end && (*end != '/' || end[-1] == '\\'); ++end)
+          ;
+        if (*end != '/')
+          return -1;
+        *end++ = '\0';
+        if (regcomp(&r->re, c, REG_EXTENDED) != 0)
+          return -1;
+    }
+    else if ((r->field = strtol(c, &end, 10)) <= 0)
+      return -1;
+
+    if ((tok = strtok_r(end, " \t", &save)))
+    {
+        if (strcmp(tok, "in") != 0 || !(tok = strtok_r(NULL, " \t", &save)))
+        {
+            if (r->field == 0)
+              regfree(&r->re);
+            return -1;
+        }
+        r->in = strdup(tok);
+    }
+    ++*n;
+    return 0;
+}
+
+/* First of the 'n' rules applying to a file, NULL if none does */
+static const field_t *field_rule(const data_t *d, const field_t *rules, int n)
+{
+    int i;
+
+    for (i=0; i<n; ++i)
+      if (rules[i].in == NULL ||
+          fnmatch(rules[i].in, d->base_name, 0) == 0 ||
+          fnmatch(rules[i].in, d->full_path, 0) == 0)
+        return &rules[i];
+    return NULL;
+}
+
+/* Fields of a file counted, decided once per file */
+static void field_rules(data_t *d)
+{
+    const field_t *r;
+    hll_t *h;
+    dds_t *q;
+
+    if (d->fields_known)
+      return;
+    d->fields_known = 1;
+    if ((r = field_rule(d, distincts, n_distincts)) &&
+        (h = calloc(1, sizeof(hll_t))))
+    {
+        h->rule = r;
+        mem_add(MEM_LINES, sizeof(hll_t), 1);
+        __atomic_store_n(&d->hll, h, __ATOMIC_RELEASE);
+    }
+    if ((r = field_rule(d, quantiles, n_quantiles)) &&
+        (q = calloc(1, sizeof(dds_t))))
+    {
+        q->rule = r;
+        mem_add(MEM_LINES, sizeof(dds_t), 1);
+        __atomic_store_n(&d->dds, q, __ATOMIC_RELEASE);
+    }
+}
+
+/* Find the field a rule picks in a (NUL terminated) line, without copying
+ * it.  Returns its length, -1 if the line has none.
+ */
+static long field_find(const field_t *r, const char *line, size_t len,
+                       const char **start)
+{
+    const char *p = line, *end = line + len, *f;
+    regmatch_t m[2];
+    int i;
+
+    if (r->field)
+      for (i=1; ; ++i)
+      {
+          while (p < end && isspace((unsigned char)*p))
+            ++p;
+          if (p == end)
+            return -1;
+          for (f = p; p < end && !isspace((unsigned char)*p); ++p)
+            ;
+          if (i == r->field)
+            break;
+      }
+    else
+    {
+        if (regexec(&r->re, line, 2, m, 0) != 0)
+          return -1;
+        i = (m[1].rm_so >= 0);
+        f = line + m[i].rm_so;
+        p = line + m[i].rm_eo;
+    }
+    *start = f;
+    return p - f;
+}
+
+/* Start a new half of the window once it is time, dropping the oldest
+ * one (both if nothing was counted for that long)
+ */
+static void hll_turn(hll_t *h, long long now)
+{
+    if (now < h->turn)
+      return;
+    if (now - h->turn >= HLL_WINDOW_MS / 2)
+      memset(h->regs, 0, sizeof(h->regs));
+    else
+    {
+        h->cur ^= 1;
+        memset(h->regs[h->cur], 0, sizeof(h->regs[h->cur]));
+    }
+    h->turn = now + HLL_WINDOW_MS / 2;
+}
+
+/* Count the value of the field of a new line: the register picked by the
+ * first bits of its hash keeps the longest run of zeros seen after them
+ */
+static void hll_line(data_t *d, const char *line, size_t len)
+{
+    hll_t *h = d->hll;
+    const char *f;
+    unsigned long long x = 14695981039346656037ULL;
+    unsigned char rank;
+    long n;
+
+    if ((n = field_find(h->rule, line, len, &f)) < 0)
+      return;
+
+    /* FNV-1a, its bits mixed up (the low ones of short keys are poor) */
+    for (; n > 0; --n, ++f)
+      x = (x ^ (unsigned char)*f) * 1099511628211ULL;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+
+    rank = __builtin_clzll((x << HLL_BITS) | (1ULL << (HLL_BITS - 1))) + 1;
+    if (rank > h->regs[h->cur][x >> (64 - HLL_BITS)])
+      h->regs[h->cur][x >> (64 - HLL_BITS)] = rank;
+}
+
+static void dds_turn(dds_t *q, long long now)
+{
+    if (now < q->turn)
+      return;
+    if (now - q->turn >= DDS_WINDOW_MS / 2)
+      memset(q->bins, 0, sizeof(q->bins));
+    else
+    {
+        q->cur ^= 1;
+        memset(q->bins[q->cur], 0, sizeof(q->bins[q->cur]));
+    }
+    q->turn = now + DDS_WINDOW_MS / 2;
+}
+
+/* Count the value of the numeric field of a new line (units after the
+ * number are left alone) in the bin of its order of magnitude
+ */
+static void dds_line(data_t *d, const char *line, size_t len)
+{
+    dds_t *q = d->dds;
+    const char *f;
+    char *end;
+    double v;
+    long i;
+
+    if (field_find(q->rule, line, len, &f) <= 0)
+      return;
+    v = strtod(f, &end);
+    if (end == f || !(v >= 0))
+      return;
+    i = (v > DDS_MIN) ? (long)ceil(log(v / DDS_MIN) / log(DDS_GAMMA)) : 0;
+    ++q->bins[q->cur][MIN(i, DDS_BINS - 1)];
+}
+
+/* Flag a line whose template the file never wrote before.  The templates
+ * go through a scalable Bloom filter: once its last slice is full a new
+ * one, twice as big, is added.
+ */
+static void novel_line(data_t *d, unsigned long long h, const char *text)
+{
+    bloom_t *b = d->bloom;
+    unsigned long long h2, pos, nbits;
+    unsigned long cap;
+    long long now;
+    int i, j, k;
+
+    if (!b)
+    {
+        if (!(b = calloc(1, sizeof(bloom_t))))
+          return;
+        b->since = now_ms();
+        b->bytes = sizeof(bloom_t);
+        mem_add(MEM_LINES, sizeof(bloom_t), 1);
+        __atomic_store_n(&d->bloom, b, __ATOMIC_RELEASE);
+    }
+    if (b->full)
+      return;
+
+    /* The templates of a file are a lot alike, so are their hashes */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h2 = (h >> 32) | 1;
+
+    for (i=0; i<b->slices; ++i)
+    {
+        for (j=0, k=NOVEL_HASHES + i; j<k; ++j)
+        {
+            pos = (h + j * h2) & b->mask[i];
+            if (!(b->bits[i][pos >> 3] & (1 << (pos & 7))))
+              break;
+        }
+        if (j == k)
+          return;
+    }
+
+    /* Room for it in the last slice, or in a new one */
+    cap = (unsigned long)NOVEL_FIRST << (b->slices - 1);
+    if (b->slices == 0 || b->n == cap)
+    {
+        if (b->slices == NOVEL_SLICES)
+        {
+            /* Too many kinds of lines to tell a new one */
+            for (i=0; i<b->slices; ++i)
+              free(b->bits[i]);
+            mem_add(MEM_LINES, sizeof(bloom_t) - b->bytes, -b->slices);
+            b->bytes = sizeof(bloom_t);
+            b->full = 1;
+            return;
+        }
+        cap = (unsigned long)NOVEL_FIRST << b->slices;
+        k = NOVEL_HASHES + b->slices;
+        for (nbits = 1024; nbits < cap * k * 3 / 2; nbits <<= 1)
+          ;
+        if (!(b->bits[b->slices] = calloc(nbits / 8, 1)))
+          return;
+        b->mask[b->slices++] = nbits - 1;
+        b->bytes += nbits / 8;
+        mem_add(MEM_LINES, nbits / 8, 1);
+        b->n = 0;
+    }
+    i = b->slices - 1;
+    for (j=0, k=NOVEL_HASHES + i; j<k; ++j)
+    {
+        pos = (h + j * h2) & b->mask[i];
+        b->bits[i][pos >> 3] |= 1 << (pos & 7);
+    }
+    ++b->n;
+
+    /* Every line is new to start with */
+    if ((now = now_ms()) - b->since < NOVEL_WARMUP_MS)
+      return;
+    pthread_mutex_lock(&mtx_buffers);
+    snprintf(b->text, sizeof(b->text), "%s", text);
+    pthread_mutex_unlock(&mtx_buffers);
+    __atomic_store_n(&b->novel_at, now, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&b->novel, 1, __ATOMIC_RELEASE);
+    group_alert(d);
+}
+
+#ifdef HAVE_DLFCN_H
+/* Parse a 'plugin PATH [in NAME] [args ARGS]' rule and load the plugin.
+ * Returns 0 on success.
+ */
+static int plugin_parse(char *c)
+{
+    char *tok, *save = NULL, *args = NULL;
+    treetop_plugin_init_t *init;
+    plugin_t *p;
+
+    if (n_plugins == MAX_PLUGINS)
+      return -1;
+    p = &plugins[n_plugins];
+    memset(p, 0, sizeof(*p));
+
+    c += strlen("plugin");
+    if (!(tok = strtok_r(c, " \t", &save)))
+      return -1;
+    p->path = strdup(tok);
+    p->name = strrchr(p->path, '/') ? strrchr(p->path, '/') + 1 : p->path;
+    while ((tok = strtok_r(NULL, " \t", &save)))
+    {
+        if (strcmp(tok, "in") == 0 && (tok = strtok_r(NULL, " \t", &save)))
+          p->in = strdup(tok);
+        else if (strcmp(tok, "args") == 0)
+        {
+            /* The arguments are the rest of the line */
+            while (*save && isspace((unsigned char)*save))
+              ++save;
+            args = save;
+            break;
+        }
+        else
+          goto fail;
+    }
+
+    if (!(p->so = dlopen(p->path, RTLD_NOW | RTLD_LOCAL)))
+    {
+        WR("Can't load plugin: %s", dlerror());
+        goto fail;
+    }
+    init = (treetop_plugin_init_t *)dlsym(p->so, "treetop_plugin_init");
+    p->lines = (treetop_plugin_lines_t *)dlsym(p->so, "treetop_plugin_lines");
+    p->fini = (treetop_plugin_fini_t *)dlsym(p->so, "treetop_plugin_fini");
+    if (!init || !p->lines ||
+        init(TREETOP_PLUGIN_VERSION, args && *args ? args : NULL,
+             &p->state) != 0)
+    {
+        dlclose(p->so);
+        goto fail;
+    }
+    ++n_plugins;
+    return 0;
+
+fail:
+    free(p->path);
+    free(p->in);
+    return -1;
+}
+#endif /* HAVE_DLFCN_H */
+
+/* Plugins looking at a file, decided once per file */
+static unsigned long plugin_mask(data_t *d)
+{
+    int i;
+    shard_t *s = d->shard;
+
+    if (d->plugins_known)
+      return d->plugins;
+    d->plugins_known = 1;
+    for (i=0; i<n_plugins; ++i)
+      if (plugins[i].in == NULL ||
+          fnmatch(plugins[i].in, d->base_name, 0) == 0 ||
+          fnmatch(plugins[i].in, d->full_path, 0) == 0)
+        d->plugins |= 1UL << i;
+    if (!d->plugins)
+      return 0;
+
+    /* Notes of every plugin, only the ones looking at it are used */
+    if (!(d->notes = calloc(2 * n_plugins, sizeof(treetop_note_t))))
+      ER("Can't allocate memory for plugin notes");
+    mem_add(MEM_LINES, 2 * n_plugins * sizeof(treetop_note_t), 1);
+    if (!s->batch)
+    {
+        if (!(s->batch = calloc(1, sizeof(plugin_batch_t))))
+          ER("Can't allocate memory for plugin batch");
+        mem_add(MEM_BUFFERS, sizeof(plugin_batch_t), 1);
+    }
+    return d->plugins;
+}
+
+/* Hand the lines batched for a file over to its plugins.  Each plugin
+ * writes its own note of the file, copied where the display thread reads.
+ */
+static void plugin_flush(data_t *d)
+{
+    plugin_batch_t *b = d->shard->batch;
+    treetop_batch_t batch;
+    struct timespec t0, t1;
+    unsigned long mask = d->plugins;
+    int i, state;
+
+    if (b->n == 0)
+      return;
+    batch.path = d->full_path;
+    batch.n = b->n;
+    batch.lines = b->lines;
+    batch.lens = b->lens;
+    batch.offsets = b->offsets;
+
+    /* Quitting waits for the plugins to return */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    for (i=0; mask; ++i, mask >>= 1)
+    {
+        if (!(mask & 1))
+          continue;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        plugins[i].lines(plugins[i].state, &batch, &d->notes[i]);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        __atomic_add_fetch(&plugins[i].ns,
+                           (t1.tv_sec - t0.tv_sec) * 1000000000LL +
+                           t1.tv_nsec - t0.tv_nsec, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&plugins[i].batches, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&plugins[i].n_lines, b->n, __ATOMIC_RELAXED);
+
+        d->notes[i].row[TREETOP_ROW_LEN - 1] = '\0';
+        pthread_mutex_lock(&mtx_buffers);
+        d->notes[n_plugins + i] = d->notes[i];
+        pthread_mutex_unlock(&mtx_buffers);
+    }
+    pthread_setcancelstate(state, NULL);
+    b->n = 0;
+}
+
+/* Batch a new (NUL terminated) line for the plugins of its file */
+static void plugin_line(data_t *d, const char *line, size_t len, off_t at)
+{
+    plugin_batch_t *b = d->shard->batch;
+
+    b->lines[b->n] = line;
+    b->lens[b->n] = len;
+    b->offsets[b->n] = at;
+    if (++b->n == PLUGIN_BATCH)
+      plugin_flush(d);
+}
+
+/* Let go of the plugins, once the shards are gone */
+static void plugins_destroy(void)
+{
+#ifdef HAVE_DLFCN_H
+    int i;
+
+    /* A shard left behind may still be in one */
+    for (i=0; i<n_shards; ++i)
+      if (shards[i].stalled)
+        return;
+    for (i=0; i<n_plugins; ++i)
+    {
+        if (plugins[i].fini)
+          plugins[i].fini(plugins[i].state);
+        dlclose(plugins[i].so);
+    }
+#endif
+    n_plugins = 0;
+}
+
+/* Hand a new line (NUL terminated) to whatever looks at lines */
+static void data_line(data_t *d, const char *line, size_t len)
+{
+    char text[TOPK_TEXT];
+    unsigned long long h;
+    size_t n;
+
+    /* Under backpressure, the other lines are only counted */
+    if (d->sample > 1 && d->lines % d->sample)
+      goto hooks;
+
+    if (stamp_wanted(d))
+      stamp_line(d, line, len);
+    if ((n = line_template(line, len, text, &h)))
+    {
+        topk_count(d->shard->topk, h, text, n);
+        novel_line(d, h, text);
+    }
+    if (d->hll)
+      hll_line(d, line, len);
+    if (d->dds)
+      dds_line(d, line, len);
+
+hooks:
+#ifdef HAVE_SPAWN_H
+    if (d->hooks)
+      hook_line(d, line, len);
+#endif
+}
+
+/* Cut appended data into lines.  The last partial line is carried over to
+ * the next read, lines are cut at MAX_LINE_LEN.
+ */
+static void data_split(data_t *d, char *chunk, size_t n)
+{
+    char *p = chunk, *nl;
+    size_t len;
+
+    while ((nl = memchr(p, '\n', chunk + n - p)))
+    {
+        ++d->lines;
+        ++d->shard->totals.lines;
+        *nl = '\0';
+        if (d->carry_len)
+        {
+            len = MIN((size_t)(nl - p), MAX_LINE_LEN - d->carry_len);
+            memcpy(d->carry + d->carry_len, p, len);
+            d->carry[d->carry_len + len] = '\0';
+            data_line(d, d->carry, d->carry_len + len);
+            if (d->plugins)
+              plugin_line(d, d->carry, d->carry_len + len, d->carry_at);
+            d->carry_len = 0;
+        }
+        else
+        {
+            len = MIN((size_t)(nl - p), MAX_LINE_LEN);
+            p[len] = '\0';
+            data_line(d, p, len);
+            if (d->plugins)
+              plugin_line(d, p, len, d->offset + (p - chunk));
+        }
+        p = nl + 1;
+    }
+
+    /* Before the partial line gets where the first one was */
+    if (d->plugins)
+      plugin_flush(d);
+
+    if (p < chunk + n)
+    {
+        if (!d->carry)
+        {
+            if (!(d->carry = malloc(MAX_LINE_LEN + 1)))
+              ER("Can't allocate memory for partial line");
+            mem_add(MEM_LINES, MAX_LINE_LEN + 1, 1);
+        }
+        if (d->carry_len == 0)
+          d->carry_at = d->offset + (p - chunk);
+        len = MIN((size_t)(chunk + n - p), MAX_LINE_LEN - d->carry_len);
+        memcpy(d->carry + d->carry_len, p, len);
+        d->carry_len += len;
+    }
+}
+
+/* Remember where the last lines start, without keeping them */
+static void data_track(data_t *d, const char *chunk, size_t n)
+{
+    size_t i = n, j;
+
+    while (i > 0 && chunk[i-1] != '\n')
+      --i;
+    if (i == 0)
+      return;
+
+    for (j = i - 1; j > 0 && chunk[j-1] != '\n'; --j)
+      ;
+    d->last_start = (j > 0) ? d->offset + (off_t)j : d->line_start;
+    d->line_start = d->offset + (off_t)i;
+}
+
+/* Count lines of a file in the bucket of 'now', emptying the buckets it
+ * skipped
+ */
+static void heat_add(data_t *d, unsigned long lines, long long now)
+{
+    heat_t *h = d->heat;
+    long long b = now / HEAT_BUCKET_MS, i;
+
+    if (!h)
+    {
+        if (!(h = d->heat = calloc(1, sizeof(heat_t))))
+          return;
+        mem_add(MEM_LINES, sizeof(heat_t), 1);
+        h->bucket = b;
+    }
+    for (i = MAX(h->bucket + 1, b - HEAT_BUCKETS + 1); i <= b; ++i)
+      __atomic_store_n(&h->counts[i % HEAT_BUCKETS], 0, __ATOMIC_RELAXED);
+    if (b > h->bucket)
+      __atomic_store_n(&h->bucket, b, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->counts[b % HEAT_BUCKETS],
+                     h->counts[b % HEAT_BUCKETS] + lines, __ATOMIC_RELAXED);
+}
+
+/* Backpressure: look at fewer lines of a file while more than PIPE_BACKLOG
+ * bytes come in a round, at all of them again once it slows down
+ */
+static void data_pressure(data_t *d, off_t backlog)
+{
+    step_t *st = &d->shard->steps[STEP_ANALYZE];
+
+    if (backlog > PIPE_BACKLOG)
+    {
+        if (d->sample <= 1)
+        {
+            d->sample = 1;
+            ++d->shard->n_sampled;
+            step_stall(st);
+        }
+        d->sample = MIN(2 * d->sample, PIPE_SAMPLE_MAX);
+        d->sampled_at = now_ms();
+    }
+    else if (backlog < PIPE_BACKLOG / 4 && d->sample > 1 &&
+             (d->sample /= 2) == 1)
+      --d->shard->n_sampled;
+}
+
+/* Files under backpressure which got nothing more for a second are looked
+ * at closely again
+ */
+static void shard_calm(shard_t *s, long long now)
+{
+    data_t *d;
+    unsigned i;
+
+    if (s->n_sampled == 0 || now < s->next_calm)
+      return;
+    s->next_calm = now + 1000;
+    for (d = s->files; d; d = d->fnext)
+      if (d->sample > 1 && now - d->sampled_at >= 1000)
+      {
+          d->sample = 1;
+          --s->n_sampled;
+      }
+    for (i=0; i<=s->hash_mask; ++i)
+      for (d = s->hash[i]; d; d = d->hnext)
+        if (d->sample > 1 && now - d->sampled_at >= 1000)
+        {
+            d->sample = 1;
+            --s->n_sampled;
+        }
+}
+
+/* Account for what was appended to a file since we last looked.  This goes
+ * on while the display is frozen, so it only counts lines (and messages).
+ */
+static void data_consume(data_t *d, FILE *fp)
+{
+    char chunk[CONSUME_CHUNK];
+    size_t n;
+    struct stat st;
+    shard_t *s = d->shard;
+    topk_t *t = s->topk;
+    long long now, t0, t1;
+    unsigned long lines;
+
+    if (fstat(fileno(fp), &st) == -1)
+      return;
+
+    /* Only what is written after we started counts */
+    if (d->offset < 0)
+    {
+        __atomic_store_n(&d->read_offset, st.st_size, __ATOMIC_RELAXED);
+        d->offset = st.st_size;
+        d->line_start = d->last_start = -1;
+    }
+
+    /* Truncated (or rotated in place) */
+    if (st.st_size < d->offset)
+    {
+        __atomic_store_n(&d->read_offset, 0, __ATOMIC_RELAXED);
+        d->offset = 0;
+        d->carry_len = 0;
+        d->line_start = 0;
+        d->last_start = -1;
+    }
+
+    if (st.st_size == d->offset || fseeko(fp, d->offset, SEEK_SET) == -1)
+      return;
+
+#ifdef HAVE_SPAWN_H
+    hook_mask(d);
+#endif
+    field_rules(d);
+    plugin_mask(d);
+    data_pressure(d, st.st_size - d->offset);
+
+    for (;;)
+    {
+        __atomic_store_n(&s->backlog, st.st_size - d->offset,
+                         __ATOMIC_RELAXED);
+        t0 = clock_ns();
+        if (d->offset >= st.st_size ||
+            !(n = fread(chunk, 1, MIN(sizeof(chunk),
+                                      (size_t)(st.st_size - d->offset)), fp)))
+          break;
+        t1 = clock_ns();
+        step_add(&s->steps[STEP_READ], n, t1 - t0);
+        lines = d->lines;
+        data_track(d, chunk, n);
+
+        /* Every line is counted under its template */
+        now = now_ms();
+        if (d->hll)
+          hll_turn(d->hll, now);
+        if (d->dds)
+          dds_turn(d->dds, now);
+        pthread_mutex_lock(&t->mtx);
+        topk_turn(t, now);
+        data_split(d, chunk, n);
+        pthread_mutex_unlock(&t->mtx);
+        d->offset += n;
+        d->shard->totals.bytes += n;
+        step_add(&s->steps[STEP_ANALYZE], d->lines - lines,
+                  clock_ns() - t1);
+        heat_add(d, d->lines - lines, now);
+        if (d->group)
+          group_lines(d, d->lines - lines);
+    }
+    __atomic_store_n(&s->backlog, 0, __ATOMIC_RELAXED);
+}
+
+static unsigned long long fnv_bytes(const char *p, size_t n)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    while (n--)
+      h = (h ^ (unsigned char)*p++) * 1099511628211ULL;
+    return h;
+}
+
+/* Hash of the 'n' bytes of a file at 'at', 0 if they can't be read */
+static unsigned long long index_fingerprint(int fd, off_t at, size_t n)
+{
+    char buf[INDEX_FP];
+
+    n = MIN(n, sizeof(buf));
+    if (pread(fd, buf, n, at) != (ssize_t)n)
+      return 0;
+    return fnv_bytes(buf, n);
+}
+
+/* Timestamp of the line starting at 'at', 0 if it has none */
+static time_t index_time(index_t *ix, int fd, off_t at)
+{
+    char buf[TS_SCAN + 64];
+    ssize_t n;
+    time_t t;
+
+    if ((n = pread(fd, buf, sizeof(buf) - 1, at)) <= 0)
+      return 0;
+    buf[n] = '\0';
+    if (strchr(buf, '\n'))
+      n = strchr(buf, '\n') - buf;
+    if (ix->fmt != TS_NONE && ix->off < n &&
+        ts_parse(ix->fmt, buf + ix->off, n - ix->off, &t))
+      return t;
+    if (ts_find(buf, n, &ix->fmt, &ix->off, &t))
+      return t;
+    return 0;
+}
+
+/* Cache file of the index of a file, NULL if there is no cache directory */
+static const char *index_path(const struct stat *st, char *path, size_t size)
+{
+    const char *base = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    char dir[PATH_MAX];
+
+    if (base && *base)
+      snprintf(dir, sizeof(dir), "%s", base);
+    else if (home && *home)
+      snprintf(dir, sizeof(dir), "%s/.cache", home);
+    else
+      return NULL;
+    mkdir(dir, 0700);
+    if (strlen(dir) + strlen("/treetop") >= sizeof(dir))
+      return NULL;
+    strcat(dir, "/treetop");
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+      return NULL;
+    snprintf(path, size, "%s/%llx-%llx.idx", dir,
+             (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+    return path;
+}
+
+/* Load the index of a file from the cache, if it still describes the
+ * beginning of the file: same head, same bytes where it stopped
+ */
+static int index_load(index_t *ix, int fd, const struct stat *st)
+{
+    char path[PATH_MAX];
+    index_file_t h;
+    FILE *fp;
+
+    if (!index_path(st, path, sizeof(path)) || !(fp = fopen(path, "re")))
+      return -1;
+    if (fread(&h, sizeof(h), 1, fp) != 1 ||
+        memcmp(h.magic, INDEX_MAGIC, sizeof(h.magic)) != 0 ||
+        h.dev != (unsigned long long)st->st_dev ||
+        h.ino != (unsigned long long)st->st_ino ||
+        h.done > (unsigned long long)st->st_size ||
+        h.head != index_fingerprint(fd, 0, MIN(h.done, INDEX_FP)) ||
+        h.tail != index_fingerprint(fd, h.done - MIN(h.done, INDEX_FP),
+                                    MIN(h.done, INDEX_FP)) ||
+        !(ix->cps = malloc(MAX(h.n, 1) * sizeof(checkpoint_t))) ||
+        fread(ix->cps, sizeof(checkpoint_t), h.n, fp) != h.n)
+    {
+        free(ix->cps);
+        ix->cps = NULL;
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    ix->n = ix->size = h.n;
+    ix->done = ix->saved = h.done;
+    ix->lines = h.lines;
+    ix->fmt = h.fmt;
+    ix->off = h.off;
+    ix->next = (ix->n ? ix->cps[ix->n-1].offset : 0) + INDEX_STEP;
+    mem_add(MEM_INDEX, ix->size * sizeof(checkpoint_t), 1);
+    return 0;
+}
+
+static void index_save(const index_t *ix, int fd, const struct stat *st)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    index_file_t h;
+    FILE *fp;
+
+    if (!index_path(st, path, sizeof(path)))
+      return;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+    h.dev = st->st_dev;
+    h.ino = st->st_ino;
+    h.done = ix->done;
+    h.lines = ix->lines;
+    h.head = index_fingerprint(fd, 0, MIN(ix->done, INDEX_FP));
+    h.tail = index_fingerprint(fd, ix->done - MIN(ix->done, INDEX_FP),
+                               MIN(ix->done, INDEX_FP));
+    h.fmt = ix->fmt;
+    h.off = ix->off;
+    h.n = ix->n;
+
+    /* Readers see the old index or the new one */
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (!(fp = fopen(tmp, "we")))
+      return;
+    if (fwrite(&h, sizeof(h), 1, fp) != 1 ||
+        fwrite(ix->cps, sizeof(checkpoint_t), ix->n, fp) != ix->n)
+    {
+        fclose(fp);
+        unlink(tmp);
+        return;
+    }
+    fclose(fp);
+    rename(tmp, path);
+}
+
+/* Index at most 'budget' more bytes of a file.  Returns 1 once it covers
+ * the whole file.
+ */
+static int index_extend(shard_t *s, index_t *ix, FILE *fp, off_t size,
+                        off_t budget)
+{
+    char chunk[CONSUME_CHUNK];
+    checkpoint_t *tmp;
+    size_t n, i;
+    off_t start;
+
+    if (fseeko(fp, ix->done, SEEK_SET) == -1)
+      return 1;
+    while (ix->done < size && budget > 0 &&
+           (n = fread(chunk, 1, MIN((off_t)sizeof(chunk), size - ix->done),
+                      fp)) > 0)
+    {
+        shard_alive(s);
+        for (i=0; i<n; ++i)
+        {
+            if (chunk[i] != '\n')
+              continue;
+            ++ix->lines;
+            if ((start = ix->done + i + 1) < ix->next)
+              continue;
+
+            /* First line starting past the step */
+            if (ix->n == ix->size)
+            {
+                if (!(tmp = realloc(ix->cps, (ix->size * 2 + 64) *
+                                             sizeof(checkpoint_t))))
+                  ER("Can't allocate memory for file index");
+                mem_add(MEM_INDEX, (ix->size + 64) * sizeof(checkpoint_t),
+                        ix->cps ? 0 : 1);
+                ix->cps = tmp;
+                ix->size = ix->size * 2 + 64;
+            }
+            ix->cps[ix->n].offset = start;
+            ix->cps[ix->n].line = ix->lines;
+            ix->cps[ix->n].t = index_time(ix, fileno(fp), start);
+            if (ix->cps[ix->n].t == 0 && ix->n > 0)
+              ix->cps[ix->n].t = ix->cps[ix->n-1].t;
+            ++ix->n;
+            ix->next = start + INDEX_STEP;
+        }
+        ix->done += n;
+        budget -= n;
+    }
+    return ix->done >= size;
+}
+
+/* Start of the first line written at 'when' or later, and its number */
+static off_t index_find(index_t *ix, FILE *fp, time_t when,
+                        unsigned long *line)
+{
+    char chunk[CONSUME_CHUNK];
+    size_t lo = 0, hi = ix->n, mid, n, i;
+    off_t at, end, start;
+    time_t t;
+
+    /* Checkpoints are in time order, as far as the writer's clock goes */
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (ix->cps[mid].t < when)
+          lo = mid + 1;
+        else
+          hi = mid;
+    }
+    at = lo ? ix->cps[lo-1].offset : 0;
+    *line = lo ? ix->cps[lo-1].line : 0;
+    end = (lo < ix->n) ? ix->cps[lo].offset : ix->done;
+
+    /* Then line by line, from the checkpoint before */
+    if ((t = index_time(ix, fileno(fp), at)) && t >= when)
+      return at;
+    while (at < end && fseeko(fp, at, SEEK_SET) == 0 &&
+           (n = fread(chunk, 1, MIN((off_t)sizeof(chunk), end - at), fp)) > 0)
+    {
+        for (i=0; i<n; ++i)
+        {
+            if (chunk[i] != '\n')
+              continue;
+            start = at + i + 1;
+            ++*line;
+            if (start < end && (t = index_time(ix, fileno(fp), start)) &&
+                t >= when)
+              return start;
+        }
+        at += n;
+    }
+    return end;
+}
+
+/* Where to show the details of a file from, to see what was written at
+ * 'when': built (a bit of it each round) or loaded from the cache, and
+ * extended to what was appended since.  Returns 1 once done.
+ */
+static int index_seek(data_t *d, time_t when)
+{
+    index_t *ix;
+    struct stat st;
+    FILE *fp;
+    off_t at;
+    unsigned long line;
+    int done;
+
+    if (!(ix = d->index))
+    {
+        if (!(ix = d->index = calloc(1, sizeof(index_t))))
+          ER("Can't allocate memory for file index");
+        mem_add(MEM_INDEX, sizeof(index_t), 1);
+    }
+    if (!ix->fp && !(ix->fp = fopen(d->full_path, "re")))
+      return 1;
+    fp = ix->fp;
+    if (fstat(fileno(fp), &st) == -1)
+      return 1;
+
+    /* Another file, or the same one truncated */
+    if (st.st_size < ix->done || (ix->dev && (ix->dev != st.st_dev ||
+                                              ix->ino != st.st_ino)))
+    {
+        mem_add(MEM_INDEX, -(long)(ix->size * sizeof(checkpoint_t)),
+                ix->cps ? -1 : 0);
+        free(ix->cps);
+        ix->cps = NULL;
+        ix->n = ix->size = 0;
+        ix->done = ix->saved = 0;
+        ix->lines = 0;
+        ix->next = 0;
+        ix->loaded = 0;
+    }
+    if (!ix->loaded)
+    {
+        ix->loaded = 1;
+        ix->dev = st.st_dev;
+        ix->ino = st.st_ino;
+        if (ix->done == 0)
+          index_load(ix, fileno(fp), &st);
+    }
+
+    if (!(done = index_extend(d->shard, ix, fp, st.st_size,
+                               INDEX_BUDGET)))
+    {
+        __atomic_store_n(&index_progress, (int)(100 * ix->done /
+                                                MAX(1, st.st_size)),
+                         __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    /* Only rewrite the cache when something was indexed since */
+    if (ix->done != ix->saved)
+    {
+        index_save(ix, fileno(fp), &st);
+        ix->saved = ix->done;
+    }
+    at = index_find(ix, fp, when, &line);
+    if (d == show_details)
+    {
+        __atomic_store_n(&details_line, line, __ATOMIC_RELAXED);
+        __atomic_store_n(&details_page, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&details_at, at, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&index_progress, -1, __ATOMIC_RELAXED);
+    fclose(ix->fp);
+    ix->fp = NULL;
+    return 1;
+}
+
+/* Find where the line ending at 'end' starts, reading back from there */
+static off_t data_find_start(FILE *fp, off_t end)
+{
+    char chunk[4096];
+    size_t n, i;
+
+    while (end > 0)
+    {
+        n = MIN((off_t)sizeof(chunk), end);
+        end -= n;
+        if (fseeko(fp, end, SEEK_SET) == -1 || fread(chunk, 1, n, fp) != n)
+          return -1;
+        for (i = n; i > 0; --i)
+          if (chunk[i-1] == '\n')
+            return end + i;
+    }
+    return 0;
+}
+
+/* The last line of the file (up to 'end', 'size' bytes in all) starts
+ * before the 'n' bytes read from its end.  Put its beginning and its length
+ * in the scratch buffer instead, or the page of it asked for in details.
+ * Returns what was put there.
+ */
+static size_t data_read_long(shard_t *s, data_t *d, FILE *fp, off_t end,
+                             off_t size, int n)
+{
+    char head[96], len_s[16];
+    off_t start, *known = NULL, at;
+    size_t h, got = 0;
+    long page = 0, pages, step = MAX(1, n - (int)sizeof(head));
+
+    /* Line being written, or the last complete one: known if everything
+     * up to there was accounted for
+     */
+    if (d->offset == size)
+      known = (end < size) ? &d->last_start : &d->line_start;
+    if (known && *known >= 0)
+      start = *known;
+    else if ((start = data_find_start(fp, end)) < 0)
+      start = 0;
+    else if (known)
+      *known = start;
+
+    format_size(len_s, sizeof(len_s), end - start);
+    snprintf(head, sizeof(head), "[%s line] ", len_s);
+    if (d == show_details)
+    {
+        pages = MAX(1, (end - start + step - 1) / step);
+        page = MIN(__atomic_load_n(&details_page, __ATOMIC_RELAXED), pages-1);
+        __atomic_store_n(&details_page, page, __ATOMIC_RELAXED);
+        snprintf(head, sizeof(head), "[%s line, page %ld/%ld] ",
+                 len_s, page + 1, pages);
+    }
+    h = MIN(strlen(head), (size_t)n);
+    memcpy(s->scratch, head, h);
+
+    at = start + (off_t)page * step;
+    if (fseeko(fp, at, SEEK_SET) == 0)
+      got = fread(s->scratch + h, 1, MIN((off_t)(n - h), end - at), fp);
+    s->scratch[h + got] = '\0';
+    return h + got;
+}
+
+/* Put the page of the file asked for in details in the scratch buffer: from
+ * the line 'details_at' points to, 'details_page' screens of lines forward
+ * or back.  Returns what was put there.
+ */
+static size_t data_read_at(shard_t *s, FILE *fp, int n)
+{
+    char head[48], chunk[4096];
+    off_t size, base, at, cur;
+    size_t h, got = 0, i, k;
+    long page, rows = MAX(1, details_rows), want, c = 0;
+    unsigned long line;
+
+    base = at = __atomic_load_n(&details_at, __ATOMIC_RELAXED);
+    page = __atomic_load_n(&details_page, __ATOMIC_RELAXED);
+    line = __atomic_load_n(&details_line, __ATOMIC_RELAXED);
+    if (fseeko(fp, 0, SEEK_END) == -1 || (size = ftello(fp)) < 0)
+      size = base;
+
+    if (page > 0)
+    {
+        /* Forward, to the last screen which still shows something */
+        want = page * rows;
+        page = 0;
+        for (cur = base; c < want && fseeko(fp, cur, SEEK_SET) == 0 &&
+             (got = fread(chunk, 1, sizeof(chunk), fp)) > 0; cur += got)
+          for (i=0; i<got && c<want; ++i)
+            if (chunk[i] == '\n' && ++c % rows == 0 &&
+                cur + (off_t)i + 1 < size)
+            {
+                at = cur + (off_t)i + 1;
+                page = c / rows;
+            }
+        line += page * rows;
+    }
+    else if (page < 0 && base > 0)
+    {
+        /* Back, reading backwards from the end of the line before */
+        want = -page * rows;
+        for (cur = base - 1, at = 0; cur > 0 && c < want; )
+        {
+            k = MIN((off_t)sizeof(chunk), cur);
+            cur -= k;
+            if (fseeko(fp, cur, SEEK_SET) == -1 || fread(chunk, 1, k, fp) != k)
+              break;
+            for (i = k; i > 0 && c < want; --i)
+              if (chunk[i-1] == '\n' && ++c == want)
+                at = cur + i;
+        }
+        if (c < want)
+          ++c;
+        page = -((c + rows - 1) / rows);
+        line -= MIN(line, (unsigned long)c);
+    }
+    else
+      page = 0;
+    __atomic_store_n(&details_page, page, __ATOMIC_RELAXED);
+
+    snprintf(head, sizeof(head), details_unread ? "[unread line %lu] " :
+             "[line %lu] ", line + 1);
+    h = MIN(strlen(head), (size_t)n);
+    memcpy(s->scratch, head, h);
+    got = 0;
+    if (fseeko(fp, at, SEEK_SET) == 0)
+      got = fread(s->scratch + h, 1, n - h, fp);
+    s->scratch[h + got] = '\0';
+    return h + got;
+}
+
+/* Read the last bytes of a file and find its last line */
+static void data_read_tail(shard_t *s, data_t *d, FILE *fp)
+{
+    int n;
+    size_t got, i, last = 0;
+    off_t pos;
+    char *tmp;
+
+    /* Only the file shown in details needs a full window */
+    n = (d == show_details) ? details_bytes : MIN(details_bytes, ROW_BYTES);
+
+    shard_scratch(s, n + 1);
+    if (d == show_details &&
+        __atomic_load_n(&details_at, __ATOMIC_RELAXED) >= 0)
+    {
+        got = data_read_at(s, fp, n);
+        goto publish;
+    }
+    if (fseek(fp, -n, SEEK_END) == -1)
+      fseek(fp, 0, SEEK_SET);
+    pos = ftello(fp);
+    got = fread(s->scratch, 1, n, fp);
+    s->scratch[got] = '\0';
+    for (i=1; i<got; ++i)
+      if (s->scratch[i-1] == '\n')
+        last = i;
+
+    /* No line starts in there: never read it all, however long it is */
+    if (last == 0 && pos > 0 && got > 0)
+      got = data_read_long(s, d, fp,
+                           pos + got - (s->scratch[got-1] == '\n'),
+                           pos + got, n);
+
+publish:
+    pthread_mutex_lock(&mtx_buffers);
+    if (d->buff == NULL || d->buff_size != n)
+    {
+        if ((tmp = realloc(d->buff, n + 1)) == NULL)
+          ER("Can't allocate memory for file buffer");
+        mem_add(MEM_TAIL, d->buff ? n - d->buff_size : n + 1,
+                d->buff ? 0 : 1);
+        d->buff = tmp;
+        d->buff_size = n;
+    }
+    memcpy(d->buff, s->scratch, got + 1);
+    d->line = d->buff + last;
+    pthread_mutex_unlock(&mtx_buffers);
+}
+
+/* Account for the files of a shard which changed, and read again the ones
+ * to be displayed.  While frozen (or in low power, between two rounds),
+ * only accounting goes on.
+ */
+static void read_files(shard_t *s, long long now)
+{
+    data_t *d, *next;
+    FILE *fp;
+    int frozen = paused;
+    long long t0;
+
+    /* Low power, or over the CPU budget: the tails are read once every
+     * LOW_POWER_MS (GOVERN_TAILS_MS) at most
+     */
+    if (!frozen && (__atomic_load_n(&low_power, __ATOMIC_RELAXED) ||
+                    __atomic_load_n(&govern.step, __ATOMIC_RELAXED) >= 2))
+    {
+        if (now < s->next_tails)
+          frozen = 1;
+        else
+          s->next_tails = now + (low_power ? LOW_POWER_MS : GOVERN_TAILS_MS);
+    }
+
+    if (frozen && s->n_dirty == 0)
+      return;
+
+    for (d = s->work; d; d = next)
+    {
+        next = d->wnext;
+        if (frozen && !d->dirty)
+          continue;
+        shard_alive(s);
+
+        /* Tree files are not kept open */
+        if ((fp = d->fp) == NULL && (fp = fopen(d->full_path, "re")) == NULL)
+        {
+            step_stall(&s->steps[STEP_READ]);
+            if (d->dirty)
+              --s->n_dirty;
+            d->dirty = d->stale = 0;
+            work_remove(s, d);
+            continue;
+        }
+
+        if (d->dirty)
+        {
+            d->dirty = 0;
+            --s->n_dirty;
+            data_consume(d, fp);
+            d->stale = 1;
+        }
+        if (!frozen)
+        {
+            t0 = clock_ns();
+            data_read_tail(s, d, fp);
+            if (d->pane)
+              pane_read(s, d, fp);
+            d->stale = 0;
+            work_remove(s, d);
+            shard_publish(s, d);
+            step_add(&s->steps[STEP_RENDER], 1, clock_ns() - t0);
+        }
+
+        if (fp != d->fp)
+          fclose(fp);
+    }
+}
+
+/* Drop the index of a file, it is loaded from the cache (or built) again
+ * next time
+ */
+static void index_free(data_t *d)
+{
+    index_t *ix = d->index;
+
+    /* The memory report looks at it */
+    pthread_mutex_lock(&mtx_buffers);
+    d->index = NULL;
+    pthread_mutex_unlock(&mtx_buffers);
+
+    if (ix->fp)
+      fclose(ix->fp);
+    mem_add(MEM_INDEX, -(long)(sizeof(index_t) +
+                               ix->size * sizeof(checkpoint_t)),
+            -1 - (ix->cps != NULL));
+    free(ix->cps);
+    free(ix);
+}
+
+/* Memory is short: drop the indexes of the files of a shard, but the one
+ * being built
+ */
+static void shard_shed(shard_t *s)
+{
+    data_t *d;
+    unsigned i;
+
+    for (d = s->files; d; d = d->fnext)
+      if (d->index && d != s->seek)
+        index_free(d);
+    for (i=0; i<=s->hash_mask; ++i)
+      for (d = s->hash[i]; d; d = d->hnext)
+        if (d->index && d != s->seek)
+          index_free(d);
+}
+
+/* Handle what other threads asked a shard for */
+static void shard_inbox(shard_t *s)
+{
+    shard_msg_t *m, *next;
+    data_t *d;
+
+    pthread_mutex_lock(&s->mtx);
+    m = s->inbox;
+    s->inbox = NULL;
+    pthread_mutex_unlock(&s->mtx);
+
+    for (; m; m = next)
+    {
+        next = m->next;
+        switch (m->what)
+        {
+            case SHARD_REFRESH:
+                if (!(d = data_lookup(s, m->path)))
+                  for (d = s->files; d; d = d->fnext)
+                    if (strcmp(d->full_path, m->path) == 0)
+                      break;
+                if (d)
+                {
+                    d->stale = 1;
+                    work_add(s, d);
+                }
+                break;
+            case SHARD_GROW:
+                if (!dir_lookup(m->path))
+                  tree_add_files(s, tree_crawl(m->path, m->rootlen, 1, s, 0));
+                break;
+            case SHARD_DROP:
+                tree_drop(s, m->path);
+                break;
+            case SHARD_SEEK:
+                if (!(d = data_lookup(s, m->path)))
+                  for (d = s->files; d; d = d->fnext)
+                    if (strcmp(d->full_path, m->path) == 0)
+                      break;
+                s->seek = d;
+                break;
+            case SHARD_SHED:
+                shard_shed(s);
+                break;
+        }
+        free(m);
+    }
+}
+
+#ifndef HAVE_KQUEUE
+/* A plain file was rotated (renamed away and created again): follow the new
+ * file from its start
+ */
+static void data_reopen(data_t *d, const struct stat *st)
+{
+    FILE *fp;
+
+    if (!(fp = fopen(d->full_path, "re")))
+      return;
+    fclose(d->fp);
+    d->fp = fp;
+    d->fd = fileno(fp);
+    d->ino = st->st_ino;
+    d->offset = 0;
+    __atomic_store_n(&d->read_offset, 0, __ATOMIC_RELAXED);
+    d->carry_len = 0;
+    d->line_start = 0;
+    d->last_start = -1;
+}
+
+/* Look at the plain files which are due.  Those watched with inotify are
+ * only stat'ed to follow them once rotated (they are told of when written
+ * to), the others every SHARD_TICK_MS while they change and less and less
+ * often while they do not.  Returns when one is due next, -1 if there are
+ * none.
+ */
+static long long plain_poll(shard_t *s, long long now)
+{
+    data_t *d;
+    struct stat st;
+    struct timespec mtime;
+    long long next = -1;
+    int slow = (__atomic_load_n(&govern.step, __ATOMIC_RELAXED) >= 3) ?
+               GOVERN_POLL : 1;
+
+    for (d = s->files; d; d = d->fnext)
+    {
+        if (now >= d->next_poll)
+        {
+            shard_alive(s);
+
+            /* Gone for a moment (rotated), or its server has trouble */
+            if (stat(d->full_path, &st) == -1)
+              d->poll_ival = SHARD_TICK_MS;
+            else
+            {
+#ifdef HAVE_SYS_INOTIFY_H
+                if (st.st_ino != d->ino)
+                  plain_unwatch(s, d);
+                plain_watch(s, d);
+#endif
+                if (st.st_ino != d->ino)
+                  data_reopen(d, &st);
+                mtime = stat_mtime(&st);
+                if (!same_time(&mtime, &d->last_mod) ||
+                    st.st_size != d->last_size)
+                {
+                    d->last_mod = mtime;
+                    d->last_size = st.st_size;
+                    data_touch(d);
+                    d->poll_ival = SHARD_TICK_MS;
+                }
+                else if ((d->poll_ival *= 2) > PLAIN_POLL_MAX_MS)
+                  d->poll_ival = PLAIN_POLL_MAX_MS;
+            }
+            d->next_poll = now + (d->wd >= 0 ? POLL_MAX_MS
+                                             : d->poll_ival * slow);
+        }
+        if (next < 0 || d->next_poll < next)
+          next = d->next_poll;
+    }
+    return next;
+}
+#endif
+
+/* One round of a shard: requests, events, polling, then reading.  Returns
+ * how long (ms) it may sleep if nothing wakes it up, -1 for ever.
+ */
+static int shard_step(shard_t *s, long long now)
+{
+    int timeout = -1;
+    long long next;
+
+    shard_inbox(s);
+#ifdef HAVE_SYS_INOTIFY_H
+    if (s->ino >= 0)
+      tree_handle_events(s);
+#endif
+#ifdef HAVE_SYS_FANOTIFY_H
+    if (s->fan >= 0)
+      fan_handle_events(s);
+#endif
+
+#ifndef HAVE_KQUEUE
+    if ((next = plain_poll(s, now)) >= 0)
+      timeout = MAX(0, next - now);
+#endif
+
+    if ((next = tree_poll(s, now)) >= 0 &&
+        (timeout < 0 || next - now < timeout))
+      timeout = MAX(0, next - now);
+
+    /* Index the file shown in details bit by bit, reading in between */
+    if (s->seek)
+    {
+        if (s->seek != show_details || index_seek(s->seek, details_seek))
+        {
+            if (s->seek->index && s->seek->index->fp)
+            {
+                fclose(s->seek->index->fp);
+                s->seek->index->fp = NULL;
+            }
+            __atomic_store_n(&index_progress, -1, __ATOMIC_RELAXED);
+            s->seek->stale = 1;
+            work_add(s, s->seek);
+            s->seek = NULL;
+        }
+        else
+          timeout = 0;
+    }
+
+    read_files(s, now);
+    shard_calm(s, now);
+    if (s->n_sampled && (timeout < 0 || s->next_calm - now < timeout))
+      timeout = MAX(0, s->next_calm - now);
+
+    /* Tails left to read in low power */
+    if (s->work && !paused && __atomic_load_n(&low_power, __ATOMIC_RELAXED) &&
+        (timeout < 0 || s->next_tails - now < timeout))
+      timeout = MAX(0, s->next_tails - now);
+    return timeout;
+}
+
+/* Sleep until an event or a request comes, or 'timeout' (ms) is over.
+ * Returns the number of events.
+ */
+static int shard_wait(shard_t *s, int timeout)
+{
+    char buf[64];
+    int n;
+#ifdef HAVE_KQUEUE
+    int i;
+    struct kevent ev[16];
+    struct timespec ts;
+
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    n = kevent(s->evfd, NULL, 0, ev, 16, timeout < 0 ? NULL : &ts);
+    for (i=0; i<n; ++i)
+      if (ev[i].udata)
+        data_touch((data_t *)ev[i].udata);
+#elif defined(HAVE_EPOLL_CREATE)
+    struct epoll_event ev[2];
+
+    n = epoll_wait(s->evfd, ev, 2, timeout);
+#else
+    usleep((timeout < 0 ? SHARD_TICK_MS : timeout) * 1000);
+    n = 0;
+#endif
+    while (read(s->wake[PIPE_READ], buf, sizeof(buf)) > 0)
+      ;
+    return n;
+}
+
+/* Shard thread: watches and reads its own share of the files */
+static void *thread_shard(void *args)
+{
+    shard_t *s = args;
+    long long now;
+    int timeout;
+
+    /* Out of the way of the other programs, for the CPU and the disks */
+#if defined(HAVE_SYS_RESOURCE_H) && defined(SYS_gettid)
+    if (govern.nice &&
+        setpriority(PRIO_PROCESS, syscall(SYS_gettid), SHARD_NICE) == -1)
+      DBG("Can't lower the priority of shard %d: %s", s->id,
+          strerror(errno));
+#endif
+#if defined(SYS_ioprio_set) && defined(SYS_gettid)
+    if (govern.nice)
+      syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */,
+              (int)syscall(SYS_gettid), SHARD_IOPRIO);
+#endif
+
+    for (;;)
+    {
+        now = now_ms();
+        __atomic_store_n(&s->io_since, now, __ATOMIC_RELAXED);
+        timeout = shard_step(s, now);
+        __atomic_store_n(&s->io_since, 0, __ATOMIC_RELAXED);
+        shard_wait(s, timeout);
+    }
+
+    return NULL;
+}
+
+/* Wake every shard up, for them to notice the display is back */
+static void shards_wake(void)
+{
+    int i;
+    char c = 0;
+
+    for (i=0; i<n_shards; ++i)
+      write(shards[i].wake[PIPE_WRITE], &c, sizeof(c));
+}
+
+static void shard_init(shard_t *s, int id, unsigned size)
+{
+#if defined(HAVE_EPOLL_CREATE) && !defined(HAVE_KQUEUE)
+    struct epoll_event event;
+#elif defined(HAVE_KQUEUE)
+    struct kevent kev;
+#endif
+
+    s->id = id;
+    s->ino = -1;
+    s->fan = -1;
+    s->hash_mask = size - 1;
+    if (!(s->hash = calloc(size, sizeof(data_t *))) ||
+        !(s->queue = malloc(SHARD_QUEUE * sizeof(data_t *))))
+      ER("Can't allocate memory for shards");
+    mem_add(MEM_INDEX, (size + SHARD_QUEUE) * sizeof(data_t *), 2);
+    if (!(s->topk = calloc(1, sizeof(topk_t))))
+      ER("Can't allocate memory for shards");
+    mem_add(MEM_LINES, sizeof(topk_t), 1);
+    pthread_mutex_init(&s->topk->mtx, NULL);
+    pthread_mutex_init(&s->mtx, NULL);
+    if (pipe(s->wake) == -1)
+      ER("Can't create pipe: %s", strerror(errno));
+    fcntl(s->wake[PIPE_READ], F_SETFL, O_NONBLOCK);
+    fcntl(s->wake[PIPE_WRITE], F_SETFL, O_NONBLOCK);
+    fd_cloexec(s->wake[PIPE_READ]);
+    fd_cloexec(s->wake[PIPE_WRITE]);
+
+#ifdef HAVE_KQUEUE
+    if ((s->evfd = kqueue()) < 0)
+      ER("Can't initialize kqueue");
+    fd_cloexec(s->evfd);
+    EV_SET(&kev, s->wake[PIPE_READ], EVFILT_READ, EV_ADD | EV_ENABLE,
+           0, 0, NULL);
+    if (kevent(s->evfd, &kev, 1, NULL, 0, NULL) < 0)
+      ER("Can't set kevent");
+#elif defined(HAVE_EPOLL_CREATE)
+    if ((s->evfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+      ER("Can't initialize epoll: %s", strerror(errno));
+    event.events = EPOLLIN;
+    event.data.fd = s->wake[PIPE_READ];
+    if (epoll_ctl(s->evfd, EPOLL_CTL_ADD, s->wake[PIPE_READ], &event) == -1)
+      ER("Can't add file descriptor in epoll instance: %s",
+         strerror(errno));
+#endif
+}
+
+/* Split the files in 'n' shards, 0 for as many as there are cores (up to
+ * AUTO_SHARDS).  Must be done before reading the config.
+ */
+static void shards_init(int n)
+{
+    int i;
+    unsigned size;
+
+    if (n <= 0)
+      n = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), AUTO_SHARDS);
+    if (!(shards = calloc(n + MOUNT_SHARDS, sizeof(shard_t))))
+      ER("Can't allocate memory for shards");
+    n_shards = n_local = n;
+
+    /* Together the shards have about as many buckets as a single table */
+    for (size = PATH_HASH_SIZE / n; size & (size - 1); size &= size - 1)
+      ;
+    size = MAX(size, 1024);
+
+    for (i=0; i<n; ++i)
+      shard_init(&shards[i], i, size);
+}
+
+/* Shard of its own for the network mount 'path' is on (NFS, SMB, FUSE...),
+ * NULL if it is local.  Must be done while reading the config.
+ */
+static shard_t *shard_mount(const char *path)
+{
+#ifdef HAVE_SYS_VFS_H
+    static const unsigned long remote[] =
+    {
+        0x6969,     /* NFS */
+        0x517b,     /* SMB */
+        0xff534d42, /* CIFS */
+        0xfe534d42, /* SMB2 */
+        0x65735546, /* FUSE (sshfs...) */
+        0x00c36400, /* Ceph */
+        0x01021997, /* 9p */
+        0x5346414f, /* AFS */
+    };
+    struct statfs sf;
+    struct stat st;
+    size_t j;
+    int i;
+    shard_t *s;
+
+    if (statfs(path, &sf) == -1 || stat(path, &st) == -1)
+      return NULL;
+    for (j=0; j<sizeof(remote)/sizeof(remote[0]); ++j)
+      if ((unsigned long)(unsigned)sf.f_type == remote[j])
+        break;
+    if (j == sizeof(remote)/sizeof(remote[0]))
+      return NULL;
+
+    for (i=n_local; i<n_shards; ++i)
+      if (shards[i].dev == st.st_dev)
+        return &shards[i];
+    if (n_shards == n_local + MOUNT_SHARDS)
+      return NULL;
+    s = &shards[n_shards];
+    shard_init(s, n_shards, shards[0].hash_mask + 1);
+    s->mount = strdup(path);
+    s->dev = st.st_dev;
+    ++n_shards;
+    DBG("Network mount of '%s' gets a shard of its own", path);
+    return s;
+#else
+    (void)path;
+    return NULL;
+#endif
+}
+
+/* Shard of a plain file or of the root of a tree */
+static shard_t *shard_for(const char *path)
+{
+    shard_t *s = shard_mount(path);
+    return s ? s : shard_pick(path);
+}
+
+/* Get the shards going, every file is read once to begin with */
+static void shards_prepare(screen_t *screen)
+{
+    int i;
+    shard_t *s;
+    data_t *d;
+#if defined(HAVE_EPOLL_CREATE) && !defined(HAVE_KQUEUE)
+    struct epoll_event event;
+#elif defined(HAVE_KQUEUE)
+    struct kevent kev;
+#endif
+
+    for (d=screen->datas; d; d=d->next)
+      data_touch(d);
+
+    for (i=0; i<n_shards; ++i)
+    {
+        s = &shards[i];
+        s->datas = &screen->datas;
+#ifdef HAVE_KQUEUE
+        for (d = s->files; d; d = d->fnext)
+        {
+            EV_SET(&kev, d->fd, EVFILT_READ, EV_ADD | EV_ENABLE | EV_CLEAR,
+                   0, 0, d); /* Detect new data */
+            if (kevent(s->evfd, &kev, 1, NULL, 0, NULL) < 0)
+              ER("Can't set kevent");
+        }
+#elif defined(HAVE_EPOLL_CREATE) && defined(HAVE_SYS_INOTIFY_H)
+        event.events = EPOLLIN;
+        event.data.fd = s->ino;
+        if (s->ino >= 0 &&
+            epoll_ctl(s->evfd, EPOLL_CTL_ADD, s->ino, &event) == -1)
+          ER("Can't add inotify descriptor in epoll instance: %s",
+             strerror(errno));
+#endif
+#if defined(HAVE_EPOLL_CREATE) && defined(HAVE_SYS_FANOTIFY_H)
+        event.events = EPOLLIN;
+        event.data.fd = s->fan;
+        if (s->fan >= 0 &&
+            epoll_ctl(s->evfd, EPOLL_CTL_ADD, s->fan, &event) == -1)
+          ER("Can't add fanotify descriptor in epoll instance: %s",
+             strerror(errno));
+#endif
+    }
+}
+
+static void shards_start(screen_t *screen)
+{
+    int i;
+
+    shards_prepare(screen);
+    for (i=0; i<n_shards; ++i)
+      if (pthread_create(&shards[i].thread, NULL, thread_shard,
+                         &shards[i]) != 0)
+        ER("Can't create shard thread");
+}
+
+/* returns the writable bytes of the s WINDOW */
+static int getMaxBytes(WINDOW *s, int *maxx, int *maxy) {
+    getmaxyx(s, *maxy, *maxx);
+
+    *maxy -= 2; /* Ignore border */
+    *maxx -= 2; /* Ignore border */
+    return *maxx * *maxy;
+
+}
+
+static void refresh_menus(screen_t *screen)
+{
+    pthread_mutex_lock(&mtx_post_menu);
+    pthread_mutex_lock(&mtx_buffers);
+    unpost_menu(screen->menu);
+    post_menu(screen->menu);
+    pthread_mutex_unlock(&mtx_buffers);
+    pthread_mutex_unlock(&mtx_post_menu);
+}
+
+static void update_panels_safe()
+{
+    pthread_mutex_lock(&mtx_update_panels);
+    update_panels();
+    doupdate();
+    pthread_mutex_unlock(&mtx_update_panels);
+}
+
+/* Show a line of text under the title for a while ('ms' < 0: until the next
+ * message)
+ */
+static void set_message(long long ms, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(message, sizeof(message), fmt, ap);
+    va_end(ap);
+    message_until = (ms < 0) ? -1 : now_ms() + ms;
+}
+
+static void write_message_window(WINDOW *master)
+{
+    static char shown[sizeof(message)];
+    static int shown_cols;
+
+    if (message_until >= 0 && now_ms() > message_until)
+      message[0] = '\0';
+    if (strcmp(shown, message) == 0 && shown_cols == COLS)
+      return;
+    strcpy(shown, message);
+    shown_cols = COLS;
+    mvwhline(master, 1, 1, ' ', COLS-2);
+    mvwaddnstr(master, 1, 2, message, COLS-4);
+}
+
+/* Sum up the accounting of the shards */
+static void totals_sum(totals_t *t)
+{
+    int i;
+
+    memset(t, 0, sizeof(*t));
+    for (i=0; i<n_shards; ++i)
+    {
+        t->lines += shards[i].totals.lines;
+        t->bytes += shards[i].totals.bytes;
+        t->added += shards[i].totals.added;
+        t->removed += shards[i].totals.removed;
+    }
+}
+
+static const char *mem_names[MEM_KINDS + 1] =
+{
+    "tail", "history", "lines", "index", "curses", "buffers", "total"
+};
+
+/* Resident memory of the process as the kernel sees it, -1 if unknown */
+static long mem_rss(void)
+{
+    FILE *fp;
+    long pages, rss;
+    int n;
+
+    if (!(fp = fopen("/proc/self/statm", "re")))
+      return -1;
+    n = fscanf(fp, "%ld %ld", &pages, &rss);
+    fclose(fp);
+    return (n == 2) ? rss * sysconf(_SC_PAGESIZE) : -1;
+}
+
+/* Sum up the memory accounted for: by kind in 'buf', in all in 'sum' */
+static void mem_summary(char *buf, char *sum, size_t size)
+{
+    char sz[16];
+    long total = 0, bytes, rss;
+    size_t len;
+    int i;
+
+    buf[0] = '\0';
+    for (i=0; i<MEM_KINDS; ++i)
+    {
+        bytes = __atomic_load_n(&mem.bytes[i], __ATOMIC_RELAXED);
+        total += bytes;
+        format_size(sz, sizeof(sz), bytes);
+        len = strlen(buf);
+        snprintf(buf + len, size - len, "%s %s, ", mem_names[i], sz);
+    }
+    bytes = __atomic_load_n(&mem.blocks, __ATOMIC_RELAXED) *
+            (long)MEM_BLOCK_OVERHEAD;
+    total += bytes;
+    format_size(sz, sizeof(sz), bytes);
+    len = strlen(buf);
+    snprintf(buf + len, size - len, "allocator %s", sz);
+    format_size(sz, sizeof(sz), total);
+    snprintf(sum, size, "%s accounted for", sz);
+    if ((rss = mem_rss()) >= 0)
+    {
+        format_size(sz, sizeof(sz), rss);
+        len = strlen(sum);
+        snprintf(sum + len, size - len, ", %s resident", sz);
+    }
+}
+
+/* The (at most) 'n' files using the most memory of kind 'sort' (MEM_KINDS
+ * for their total), biggest first.  Returns how many there are.
+ */
+static int mem_top(screen_t *screen, const data_t **top,
+                   long (*sizes)[MEM_KINDS + 1], int n, int sort)
+{
+    long bytes[MEM_KINDS + 1];
+    const data_t *d;
+    int i, found = 0;
+
+    pthread_mutex_lock(&mtx_post_menu);
+    pthread_mutex_lock(&mtx_buffers);
+    for (d=screen->datas; d && n > 0; d=d->next)
+    {
+        bytes[MEM_KINDS] = data_mem(d, bytes, NULL);
+        if (found == n && bytes[sort] <= sizes[n-1][sort])
+          continue;
+        for (i = MIN(found, n - 1); i > 0 && sizes[i-1][sort] < bytes[sort];
+             --i)
+        {
+            top[i] = top[i-1];
+            memcpy(sizes[i], sizes[i-1], sizeof(bytes));
+        }
+        top[i] = d;
+        memcpy(sizes[i], bytes, sizeof(bytes));
+        found = MIN(found + 1, n);
+    }
+    pthread_mutex_unlock(&mtx_buffers);
+    pthread_mutex_unlock(&mtx_post_menu);
+    return found;
+}
+
+/* Where the memory goes: by kind, then the files using the most */
+static void mem_draw(screen_t *screen)
+{
+    WINDOW *w = screen->details;
+    const data_t *top[256];
+    long sizes[256][MEM_KINDS + 1];
+    char line[512], sum[512], sz[16];
+    int i, j, n, y;
+
+    werase(w);
+    box(w, 0, 0);
+    mvwprintw(w, 0, 1, "[memory, 'o' sorts on the next column]");
+    mem_summary(line, sum, sizeof(line));
+    mvwaddnstr(w, 1, 2, line, getmaxx(w) - 4);
+    mvwaddnstr(w, 2, 2, sum, getmaxx(w) - 4);
+
+    wmove(w, 3, 2);
+    for (j=0; j<=MEM_KINDS; ++j)
+    {
+        if (j == mem_sort)
+          wattron(w, A_REVERSE);
+        wprintw(w, "%8s", mem_names[(j + MEM_KINDS) % (MEM_KINDS + 1)]);
+        if (j == mem_sort)
+          wattroff(w, A_REVERSE);
+        waddch(w, ' ');
+    }
+    wprintw(w, " file");
+
+    n = mem_top(screen, top, sizes, MIN(256, MAX(0, getmaxy(w) - 5)),
+                (mem_sort + MEM_KINDS) % (MEM_KINDS + 1));
+    for (i=0, y=4; i<n; ++i, ++y)
+    {
+        wmove(w, y, 2);
+        for (j=0; j<=MEM_KINDS; ++j)
+        {
+            format_size(sz, sizeof(sz),
+                        sizes[i][(j + MEM_KINDS) % (MEM_KINDS + 1)]);
+            wprintw(w, "%8s ", sz);
+        }
+        waddnstr(w, top[i]->base_name, MAX(0, getmaxx(w) - getcurx(w) - 3));
+    }
+}
+
+static int templates_cmp(const void *a, const void *b)
+{
+    const template_t *x = a, *y = b;
+
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+/* Messages logged the most over the window, across the shards: the
+ * templates kept by any of them, with the counts of all of them summed.
+ * Returns how many there are in 'top' (allocated), most counted first.
+ */
+static int templates_top(template_t **top, unsigned long *lines)
+{
+    template_t *all;
+    topk_t *t;
+    long long now = now_ms();
+    int i, j, k, n = 0;
+
+    *lines = 0;
+    if (!(all = malloc(n_shards * TOPK_KEEP * sizeof(template_t))))
+      return 0;
+    for (i=0; i<n_shards; ++i)
+    {
+        t = shards[i].topk;
+        pthread_mutex_lock(&t->mtx);
+        topk_turn(t, now);
+        *lines += t->lines[0] + t->lines[1];
+        for (j=0; j<t->n; ++j)
+        {
+            for (k=0; k<n && all[k].hash != t->heap[j].hash; ++k)
+              ;
+            if (k == n)
+              all[n++] = t->heap[j];
+        }
+        pthread_mutex_unlock(&t->mtx);
+    }
+
+    /* Counts of the other shards, which did not keep them */
+    for (k=0; k<n; ++k)
+      all[k].count = 0;
+    for (i=0; i<n_shards; ++i)
+    {
+        t = shards[i].topk;
+        pthread_mutex_lock(&t->mtx);
+        for (k=0; k<n; ++k)
+          all[k].count += topk_estimate(t, all[k].hash);
+        pthread_mutex_unlock(&t->mtx);
+    }
+    qsort(all, n, sizeof(template_t), templates_cmp);
+    *top = all;
+    return n;
+}
+
+/* Messages logged the most right now, across every file */
+static void templates_draw(screen_t *screen)
+{
+    WINDOW *w = screen->details;
+    template_t *top = NULL;
+    unsigned long lines;
+    char window[16];
+    int i, n, y;
+
+    werase(w);
+    box(w, 0, 0);
+    format_duration(window, sizeof(window), TOPK_WINDOW_MS);
+    mvwprintw(w, 0, 1, "[messages logged the most, last %s]", window);
+    n = templates_top(&top, &lines);
+    mvwprintw(w, 1, 2, "%8s %6s  %s", "lines", "share", "message");
+    for (i=0, y=2; i<n && y<getmaxy(w) - 1; ++i, ++y)
+    {
+        mvwprintw(w, y, 2, "%8lu %5.1f%%  ", top[i].count,
+                  lines ? 100.0 * MIN(top[i].count, lines) / lines : 0.0);
+        waddnstr(w, top[i].text, MAX(0, getmaxx(w) - getcurx(w) - 2));
+    }
+    free(top);
+}
+
+/* Time spent in each plugin, and what they tell of the selected file */
+static void plugins_draw(screen_t *screen)
+{
+    WINDOW *w = screen->details;
+    const plugin_t *p;
+    const treetop_note_t *note;
+    const data_t *d;
+    unsigned long batches, lines;
+    long long ns;
+    int i, j, y;
+
+    werase(w);
+    box(w, 0, 0);
+    mvwprintw(w, 0, 1, "[plugins, time spent in them]");
+    mvwprintw(w, 1, 2, "%10s %8s %10s %8s  %s", "lines", "batches", "time",
+              "us/line", "plugin");
+    for (i=0, y=2; i<n_plugins && y<getmaxy(w) - 1; ++i, ++y)
+    {
+        p = &plugins[i];
+        ns = __atomic_load_n(&p->ns, __ATOMIC_RELAXED);
+        batches = __atomic_load_n(&p->batches, __ATOMIC_RELAXED);
+        lines = __atomic_load_n(&p->n_lines, __ATOMIC_RELAXED);
+        mvwprintw(w, y, 2, "%10lu %8lu %8.1fms %8.2f  ", lines, batches,
+                  ns / 1e6, lines ? ns / 1e3 / lines : 0.0);
+        waddnstr(w, p->path, MAX(0, getmaxx(w) - getcurx(w) - 2));
+    }
+
+    /* Counters of the file under the cursor */
+    pthread_mutex_lock(&mtx_post_menu);
+    d = item_userptr(current_item(screen->menu));
+    if (d && d->notes && y < getmaxy(w) - 2)
+    {
+        mvwprintw(w, ++y, 2, "%s:", d->base_name);
+        pthread_mutex_lock(&mtx_buffers);
+        for (i=0; i<n_plugins && y<getmaxy(w) - 2; ++i)
+        {
+            if (!(d->plugins & (1UL << i)))
+              continue;
+            note = &d->notes[n_plugins + i];
+            wmove(w, ++y, 4);
+            waddnstr(w, plugins[i].name, getmaxx(w) / 3);
+            for (j=0; j<TREETOP_COUNTERS; ++j)
+              if (note->names[j] && getcurx(w) < getmaxx(w) - 24)
+                wprintw(w, "  %.12s %ld", note->names[j], note->counters[j]);
+        }
+        pthread_mutex_unlock(&mtx_buffers);
+    }
+    pthread_mutex_unlock(&mtx_post_menu);
+}
+
+/* Counters of the steps the shards take on changed files, summed over the
+ * shards: how much went through each per second and in all, how often it
+ * could not keep up and how busy it was.  The steps are taken one after the
+ * other within a round, nothing is queued between them: what is pending now
+ * is shown apart, each in its own unit.
+ */
+static void steps_draw(screen_t *screen)
+{
+    static const char *names[STEPS] = { "detect", "read", "analyze",
+                                        "render" };
+    static const char *units[STEPS] = { "files", "", "lines", "files" };
+    static step_t last[STEPS];
+    static long long last_ms;
+    static double rate[STEPS], busy[STEPS];
+    WINDOW *w = screen->details;
+    step_t sum[STEPS];
+    long dirty = 0, backlog = 0, sampled = 0, undrawn = 0;
+    long long now = now_ms();
+    char num[2][16], left[16];
+    int i, j, y;
+    shard_t *s;
+
+    memset(sum, 0, sizeof(sum));
+    for (i=0; i<n_shards; ++i)
+    {
+        s = &shards[i];
+        for (j=0; j<STEPS; ++j)
+        {
+            sum[j].items += __atomic_load_n(&s->steps[j].items,
+                                            __ATOMIC_RELAXED);
+            sum[j].stalls += __atomic_load_n(&s->steps[j].stalls,
+                                             __ATOMIC_RELAXED);
+            sum[j].ns += __atomic_load_n(&s->steps[j].ns, __ATOMIC_RELAXED);
+        }
+        dirty += __atomic_load_n(&s->n_dirty, __ATOMIC_RELAXED);
+        backlog += __atomic_load_n(&s->backlog, __ATOMIC_RELAXED);
+        sampled += __atomic_load_n(&s->n_sampled, __ATOMIC_RELAXED);
+        undrawn += __atomic_load_n(&s->head, __ATOMIC_ACQUIRE) -
+                   __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+    }
+
+    /* Rates over a second at least, steady from one frame to the next */
+    if (now - last_ms >= 1000)
+    {
+        for (j=0; j<STEPS; ++j)
+        {
+            rate[j] = last_ms ? 1000.0 * (sum[j].items - last[j].items) /
+                                (now - last_ms) : 0;
+            busy[j] = last_ms ? (sum[j].ns - last[j].ns) / 1e4 /
+                                (now - last_ms) : 0;
+        }
+        memcpy(last, sum, sizeof(last));
+        last_ms = now;
+    }
+
+    werase(w);
+    box(w, 0, 0);
+    mvwprintw(w, 0, 1, "[shard step counters, %d shards]", n_shards);
+    mvwprintw(w, 1, 2, "%-8s %10s %10s %8s %6s", "step", "per second",
+              "total", "stalls", "busy");
+    for (j=0, y=2; j<STEPS && y<getmaxy(w) - 1; ++j, ++y)
+    {
+        if (j == STEP_READ)
+        {
+            format_size(num[0], sizeof(num[0]), rate[j]);
+            format_size(num[1], sizeof(num[1]), sum[j].items);
+        }
+        else
+        {
+            format_value(num[0], sizeof(num[0]), rate[j]);
+            format_value(num[1], sizeof(num[1]), sum[j].items);
+        }
+        mvwprintw(w, y, 2, "%-8s %10s %10s %8lu %5.1f%%  %s", names[j],
+                  num[0], num[1], sum[j].stalls, busy[j], units[j]);
+    }
+    format_size(left, sizeof(left), backlog);
+    if (y < getmaxy(w) - 2)
+      mvwprintw(w, y + 1, 2, "Now: %ld files changed, %s to read, %ld "
+                "sampled, %ld to draw.", dirty, left, sampled, undrawn);
+    if (y + 1 < getmaxy(w) - 2)
+      mvwprintw(w, y + 2, 2, "Stalls: events lost, files not opened, "
+                "files put under sampling, display queue full.");
+}
+
+/* Lines a file (or group) got in bucket 'b', 0 if it left the ring */
+static unsigned heat_count(const heat_row_t *r, long long b)
+{
+    const heat_t *h;
+    unsigned n = 0;
+    int i;
+
+    for (i=0; i<r->n; ++i)
+      if ((h = r->members[i]->heat) && b <= h->bucket &&
+          b > h->bucket - HEAT_BUCKETS)
+        n += __atomic_load_n(&h->counts[b % HEAT_BUCKETS], __ATOMIC_RELAXED);
+    return n;
+}
+
+/* Draw the cell of row 'y' for bucket 'b' from the shade table */
+static void heat_cell(WINDOW *w, int y, int x, const heat_row_t *r,
+                      long long b)
+{
+    unsigned n = heat_count(r, b);
+    int level = 0;
+
+    while (n && level < HEAT_LEVELS - 1)
+    {
+        ++level;
+        n >>= 1;
+    }
+    mvwaddch(w, y, x, heat.shades[level]);
+}
+
+/* Length of the directory part of a path */
+static size_t heat_dir_len(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash ? (size_t)(slash - path) : 0;
+}
+
+static int heat_cmp_rows(const void *a, const void *b)
+{
+    const heat_row_t *ra = a, *rb = b;
+    return (ra->total < rb->total) - (ra->total > rb->total);
+}
+
+static int heat_cmp_dirs(const void *a, const void *b)
+{
+    const data_t *da = *(data_t * const *)a, *db = *(data_t * const *)b;
+    size_t la = heat_dir_len(da->full_path), lb = heat_dir_len(db->full_path);
+    int c = strncmp(da->full_path, db->full_path, MIN(la, lb));
+    return c ? c : (la > lb) - (la < lb);
+}
+
+/* Lay out the files (or directories) of the heatmap, the busiest over the
+ * columns shown first.  Must be called with the post_menu mutex held.
+ */
+static void heat_rows(screen_t *screen, long long now_b, int ncols)
+{
+    data_t *d, **all;
+    heat_row_t *r;
+    size_t len;
+    int i, j, n = 0;
+    long long b;
+
+    for (i=0; i<heat.n; ++i)
+      free(heat.rows[i].members);
+    free(heat.rows);
+    heat.rows = NULL;
+    heat.n = 0;
+
+    for (d=screen->datas; d; d=d->next)
+      ++n;
+    if (n == 0 || !(all = malloc(n * sizeof(data_t *))))
+      return;
+    for (i=0, d=screen->datas; d; d=d->next)
+      all[i++] = d;
+    if (heat.group)
+      qsort(all, n, sizeof(data_t *), heat_cmp_dirs);
+    if (!(heat.rows = calloc(n, sizeof(heat_row_t))))
+    {
+        free(all);
+        return;
+    }
+
+    /* One row per file, or per run of files of the same directory */
+    for (i=0; i<n; i=j)
+    {
+        for (j=i+1; heat.group && j<n &&
+             heat_cmp_dirs(&all[i], &all[j]) == 0; ++j)
+          ;
+        r = &heat.rows[heat.n++];
+        if (!(r->members = malloc((j - i) * sizeof(data_t *))))
+          ER("Can't allocate memory for heatmap rows");
+        memcpy(r->members, &all[i], (j - i) * sizeof(data_t *));
+        r->n = j - i;
+        if (heat.group)
+        {
+            len = heat_dir_len(all[i]->full_path);
+            snprintf(r->name, sizeof(r->name), "%.*s/ (%d)",
+                     len ? (int)len : 1, len ? all[i]->full_path : ".", r->n);
+        }
+        else
+          snprintf(r->name, sizeof(r->name), "%s", all[i]->base_name);
+        for (b = now_b - ncols + 1; b <= now_b; ++b)
+          r->total += heat_count(r, b);
+    }
+    free(all);
+    qsort(heat.rows, heat.n, sizeof(heat_row_t), heat_cmp_rows);
+}
+
+/* Line rates over time, one row per file (or directory), one column per
+ * HEAT_BUCKET_MS bucket, the newest on the right.  Rows are laid out when
+ * the view is shown; then each frame only the newest column is drawn, the
+ * others being shifted left when a new bucket starts.
+ */
+static void heatmap_draw(screen_t *screen)
+{
+    WINDOW *w = screen->details;
+    long long now_b = now_ms() / HEAT_BUCKET_MS, b;
+    int x0 = 2 + HEAT_NAME_WIDTH + 1, ncols, rows, i, y, k;
+    char span[16];
+    const char *name;
+    chtype cells[HEAT_BUCKETS + 1];
+
+    ncols = MIN(HEAT_BUCKETS, getmaxx(w) - 2 - x0);
+    rows = getmaxy(w) - 2;
+    if (ncols <= 0 || rows <= 0)
+      return;
+
+    /* Shades looked up by the number of bits of a count, the two darkest
+     * in bold
+     */
+    if (!heat.shades[0])
+      for (i=0; i<HEAT_LEVELS; ++i)
+        heat.shades[i] = (unsigned char)HEAT_SHADES[i] |
+                         (i >= HEAT_LEVELS - 2 ? A_BOLD : 0);
+
+    pthread_mutex_lock(&mtx_post_menu);
+    if (heat.full)
+    {
+        heat.full = 0;
+        heat_rows(screen, now_b, ncols);
+        werase(w);
+        box(w, 0, 0);
+        format_duration(span, sizeof(span), (long long)ncols * HEAT_BUCKET_MS);
+        mvwprintw(w, 0, 1, "[lines by %s, a column every %ds over %s, "
+                  "'%s' = 1 2 4 8... 256, 'g' %s]",
+                  heat.group ? "directory" : "file", HEAT_BUCKET_MS / 1000,
+                  span, HEAT_SHADES + 1, heat.group ? "by file" :
+                  "by directory");
+        for (y=0; y<rows && y<heat.n; ++y)
+        {
+            /* The end of a long name tells more */
+            name = heat.rows[y].name;
+            if (strlen(name) > HEAT_NAME_WIDTH)
+              name += strlen(name) - HEAT_NAME_WIDTH;
+            mvwprintw(w, y + 1, 2, "%-*s", HEAT_NAME_WIDTH, name);
+            for (i=0; i<ncols; ++i)
+              heat_cell(w, y + 1, x0 + i, &heat.rows[y],
+                        now_b - (ncols - 1 - i));
+        }
+        heat.last = now_b;
+    }
+
+    /* A new bucket started: the older ones move left */
+    if ((k = now_b - heat.last) > 0)
+      for (y=0; y<rows && y<heat.n; ++y)
+      {
+          if (k < ncols)
+          {
+              mvwinchnstr(w, y + 1, x0 + k, cells, ncols - k);
+              mvwaddchnstr(w, y + 1, x0, cells, ncols - k);
+          }
+          for (b = MAX(heat.last + 1, now_b - ncols + 1); b < now_b; ++b)
+            heat_cell(w, y + 1, x0 + ncols - 1 - (now_b - b),
+                      &heat.rows[y], b);
+      }
+    heat.last = now_b;
+
+    for (y=0; y<rows && y<heat.n; ++y)
+      heat_cell(w, y + 1, x0 + ncols - 1, &heat.rows[y], now_b);
+    pthread_mutex_unlock(&mtx_post_menu);
+}
+
+/* Write where the memory goes to a file, for SIGUSR1 */
+static void mem_report(screen_t *screen)
+{
+    const data_t *top[64];
+    long sizes[64][MEM_KINDS + 1];
+    char path[PATH_MAX], line[512], sum[512];
+    const char *dir = getenv("TMPDIR");
+    FILE *fp;
+    int i, j, n;
+
+    snprintf(path, sizeof(path), "%s/treetop.%d.mem", dir ? dir : "/tmp",
+             (int)getpid());
+    if (!(fp = fopen(path, "we")))
+    {
+        set_message(MESSAGE_MS, "Can't write %s: %s", path, strerror(errno));
+        return;
+    }
+
+    mem_summary(line, sum, sizeof(line));
+    fprintf(fp, "%s\n%s\n\n", line, sum);
+    for (i=0; i<MEM_KINDS; ++i)
+      fprintf(fp, "%s_bytes %ld\n", mem_names[i],
+              __atomic_load_n(&mem.bytes[i], __ATOMIC_RELAXED));
+    fprintf(fp, "blocks %ld\nallocator_bytes %ld\nresident_bytes %ld\n\n",
+            mem.blocks, mem.blocks * (long)MEM_BLOCK_OVERHEAD, mem_rss());
+
+    n = mem_top(screen, top, sizes, 64, MEM_KINDS);
+    fprintf(fp, "%s", mem_names[MEM_KINDS]);
+    for (j=0; j<MEM_KINDS; ++j)
+      fprintf(fp, " %s", mem_names[j]);
+    fprintf(fp, " file\n");
+    for (i=0; i<n; ++i)
+    {
+        fprintf(fp, "%ld", sizes[i][MEM_KINDS]);
+        for (j=0; j<MEM_KINDS; ++j)
+          fprintf(fp, " %ld", sizes[i][j]);
+        fprintf(fp, " %s\n", top[i]->full_path);
+    }
+    fclose(fp);
+    set_message(MESSAGE_MS, "Memory report written to %s", path);
+}
+
+/* Freeze the display, or unfreeze it at once and sum up what changed */
+static void toggle_pause(screen_t *screen)
+{
+    int changed = 0;
+    unsigned long most = 0;
+    char since[32];
+    const data_t *d, *busiest = NULL;
+    totals_t totals;
+
+    if (!paused)
+    {
+        pthread_mutex_lock(&mtx_post_menu);
+        for (d=screen->datas; d; d=d->next)
+          ((data_t *)d)->pause_lines = d->lines;
+        pthread_mutex_unlock(&mtx_post_menu);
+        totals_sum(&pause_totals);
+        pause_totals.since = now_ms();
+        set_message(-1, "PAUSED - press 'f' to resume");
+        write_message_window(screen->master);
+        update_panels_safe();
+        paused = 1;
+        return;
+    }
+
+    /* Shards read again what changed meanwhile */
+    paused = 0;
+    shards_wake();
+    totals_sum(&totals);
+    pthread_mutex_lock(&mtx_post_menu);
+    for (d=screen->datas; d; d=d->next)
+    {
+        if (d->lines == d->pause_lines)
+          continue;
+        ++changed;
+        if (d->lines - d->pause_lines > most)
+        {
+            most = d->lines - d->pause_lines;
+            busiest = d;
+        }
+    }
+    pthread_mutex_unlock(&mtx_post_menu);
+    format_duration(since, sizeof(since), now_ms() - pause_totals.since);
+    set_message(MESSAGE_MS, "Paused for %s: %d files changed, +%lu lines "
+                "(%lu KB), %lu new, %lu removed",
+                since, changed, totals.lines - pause_totals.lines,
+                (totals.bytes - pause_totals.bytes) / 1024,
+                totals.added - pause_totals.added,
+                totals.removed - pause_totals.removed);
+    if (busiest)
+      snprintf(message + strlen(message), sizeof(message) - strlen(message),
+               "; busiest: %s (+%lu)", busiest->base_name, most);
+}
+
+static void menu_driver_update(screen_t *screen, int c)
+{
+    data_t *d;
+    group_t *g;
+    long lag;
+    long long now = now_ms();
+    int i, row;
+    char col[LAG_WIDTH + 1], dur[16], cnt[64], num[DISTINCT_WIDTH + 1];
+    char pct[3][16], qcol[QUANTILES_WIDTH + 1];
+
+    /* Shards add and remove files */
+    pthread_mutex_lock(&mtx_post_menu);
+    if (c >= 0)
+    {
+        menu_driver(screen->menu, c);
+    }
+
+    /* Shards move the lines around when they read the files again */
+    pthread_mutex_lock(&mtx_buffers);
+    for (d=screen->datas; d; d=d->next)
+    {
+        if (d->item && d->line)
+        {
+            d->item->description.str = d->line;
+            d->shed = 0;
+        }
+        if (d->item && d->notes)
+          plugin_row(d);
+    }
+    for (i=0; i<n_groups; ++i)
+      if (groups[i].item)
+        group_row(&groups[i]);
+    unpost_menu(screen->menu);
+    post_menu(screen->menu);
+    pthread_mutex_unlock(&mtx_buffers);
+
+    /* Tails dropped for lack of memory are read again once in sight */
+    for (d=screen->datas; d; d=d->next)
+    {
+        if (!d->shed || !d->item)
+          continue;
+        row = data_row(screen, d);
+        if (row >= 0 && row < getmaxy(screen->content))
+        {
+            d->shed = 0;
+            shard_post(d->shard, SHARD_REFRESH, d->full_path, 0);
+        }
+    }
+    lag_worst.lag = 0;
+    n_unresponsive = 0;
+    for (d=screen->datas; d; d=d->next)
+    {
+        /* Whatever it showed last is all there is for now */
+        if (d->shard->stalled)
+        {
+            ++n_unresponsive;
+            if (d->item && getmaxx(screen->content) > 2 * LAG_WIDTH)
+              mark_item(screen, d, getmaxx(screen->content) -
+                        (int)strlen(UNRESPONSIVE), UNRESPONSIVE);
+            continue;
+        }
+
+        if (d->group)
+          group_severity(d, now);
+        if (d->highlight && d->item)
+        {
+            highlight_item(screen, d->item, d->highlight == TREETOP_ALERT ?
+                                      A_REVERSE : A_BOLD);
+        }
+
+        if (d->state == UPDATED && d->item)
+        {
+            if (d != ((data_t *)(item_userptr(current_item(screen->menu)))))
+            {
+                mark_item(screen, d, 3, UPDATED_CHAR);
+            }
+            else {
+                d->state = UNCHANGED;
+            }
+        }
+        if (d->pane && d->item)
+        {
+            mark_item(screen, d, 0, PINNED_CHAR);
+        }
+        if (d->item && fabsf(d->score) >= RATE_SCORE &&
+            d != ((data_t *)(item_userptr(current_item(screen->menu)))))
+        {
+            mark_item(screen, d, 1, d->score > 0 ? RATE_UP_CHAR
+                                                 : RATE_DOWN_CHAR);
+        }
+
+        if (d->item && d->bloom && d->bloom->novel_at &&
+            now - d->bloom->novel_at < NOVEL_MS)
+        {
+            mark_item(screen, d, 2, NOVEL_CHAR);
+        }
+
+        /* Lines written since its details were last shown */
+        if (d->item && d->lines > d->read_lines &&
+            getmaxx(screen->content) > 2 * LAG_WIDTH + UNREAD_WIDTH)
+        {
+            if (d->lines - d->read_lines < 1000000)
+              snprintf(cnt, sizeof(cnt), "+%lu", d->lines - d->read_lines);
+            else
+              snprintf(cnt, sizeof(cnt), "+%luk",
+                       (d->lines - d->read_lines) / 1000);
+            snprintf(num, sizeof(num), " %*.*s", UNREAD_WIDTH - 1,
+                     UNREAD_WIDTH - 1, cnt);
+            mark_item(screen, d, getmaxx(screen->content) - LAG_WIDTH -
+                      UNREAD_WIDTH, num);
+        }
+
+        /* Distinct values of its field, left of the lag */
+        if (d->item && d->hll && getmaxx(screen->content) >
+            2 * LAG_WIDTH + UNREAD_WIDTH + DISTINCT_WIDTH)
+        {
+            if (d->distinct < 1000000)
+              snprintf(cnt, sizeof(cnt), "%ld", d->distinct);
+            else
+              snprintf(cnt, sizeof(cnt), "%ldk", d->distinct / 1000);
+            snprintf(num, sizeof(num), " ~%*.*s", DISTINCT_WIDTH - 2,
+                     DISTINCT_WIDTH - 2, cnt);
+            mark_item(screen, d, getmaxx(screen->content) - LAG_WIDTH -
+                      UNREAD_WIDTH - DISTINCT_WIDTH, num);
+        }
+
+        /* Median, 95th and 99th percentiles of its numeric field */
+        if (d->item && d->dds && d->pct[0] >= 0 &&
+            getmaxx(screen->content) >
+            2 * LAG_WIDTH + UNREAD_WIDTH + DISTINCT_WIDTH + QUANTILES_WIDTH)
+        {
+            format_value(pct[0], sizeof(pct[0]), d->pct[0]);
+            format_value(pct[1], sizeof(pct[1]), d->pct[1]);
+            format_value(pct[2], sizeof(pct[2]), d->pct[2]);
+            snprintf(cnt, sizeof(cnt), "%s/%s/%s", pct[0], pct[1], pct[2]);
+            snprintf(qcol, sizeof(qcol), " %*.*s", QUANTILES_WIDTH - 1,
+                     QUANTILES_WIDTH - 1, cnt);
+            mark_item(screen, d, getmaxx(screen->content) - LAG_WIDTH -
+                      UNREAD_WIDTH - DISTINCT_WIDTH - QUANTILES_WIDTH, qcol);
+        }
+
+        /* Ingestion lag, for files whose lines carry a timestamp */
+        if ((lag = __atomic_load_n(&d->lag, __ATOMIC_RELAXED)) < 0)
+          continue;
+        if (lag > lag_worst.lag)
+        {
+            lag_worst.lag = lag;
+            snprintf(lag_worst.name, sizeof(lag_worst.name), "%s",
+                     d->base_name);
+        }
+        if (d->item && getmaxx(screen->content) > 2 * LAG_WIDTH)
+        {
+            format_duration(dur, sizeof(dur), lag * 1000);
+            snprintf(col, sizeof(col), " %*.*s", LAG_WIDTH - 1,
+                     LAG_WIDTH - 1, dur);
+            mark_item(screen, d, getmaxx(screen->content) - LAG_WIDTH, col);
+        }
+    }
+
+    /* A group stands out as much as the worst of its files */
+    for (i=0; i<n_groups; ++i)
+    {
+        g = &groups[i];
+        if (g->item && (g->severe[TREETOP_ALERT] || g->severe[TREETOP_BOLD]))
+          highlight_item(screen, g->item, g->severe[TREETOP_ALERT] ?
+                                          A_REVERSE : A_BOLD);
+    }
+    pthread_mutex_unlock(&mtx_post_menu);
+
+    if (c > 0)
+    {
+        update_panels_safe();
+    }
+}
+
+/* The terminal was resized: fit the windows to the new size */
+static void screen_resize(screen_t *screen)
+{
+    int maxx, maxy;
+
+    mvwprintw(screen->master, 1, columns-1, " ");
+    columns = COLS;
+    if (wresize(screen->master, LINES, COLS) == ERR)
+        WR("Error resizing master windows");
+    if (wresize(screen->content,
+                INNER_WIN_LINES, INNER_WIN_COLS) == ERR)
+        WR("Error resizing content windows");
+    if (wresize(screen->details,
+                INNER_WIN_LINES, INNER_WIN_COLS) == ERR)
+        WR("Error resizing details windows");
+    details_bytes = getMaxBytes(screen->details, &maxx, &maxy);
+    details_rows = maxy;
+
+    /* Redraw the title and clean up the border */
+    heat.full = 1;
+    werase(screen->master);
+    write_title_window(screen->master);
+    panes_layout();
+    refresh_menus(screen);
+}
+
+/* Sample the line counts of the files every RATE_TICK_MS and weigh each
+ * against the baseline of its file, then move the baseline towards it
+ */
+static void rates_update(screen_t *screen)
+{
+    data_t *d;
+    group_t *g;
+    long long now = now_ms();
+    float x, dev, sd;
+    unsigned long lines;
+    int i;
+
+    if (now < rate_next)
+      return;
+    rate_next = now + RATE_TICK_MS;
+
+    n_anomalies = 0;
+    pthread_mutex_lock(&mtx_post_menu);
+    for (d=screen->datas; d; d=d->next)
+    {
+        x = __atomic_load_n(&d->lines, __ATOMIC_RELAXED) - d->rate_lines;
+        d->rate_lines += x;
+        if (d->rate_n++ == 0)
+        {
+            d->rate_mean = x;
+            continue;
+        }
+
+        dev = x - d->rate_mean;
+        sd = sqrtf(MAX(d->rate_var, d->rate_mean) + 1);
+        d->score = (d->rate_n > RATE_WARMUP) ? dev / sd : 0;
+        if (fabsf(d->score) >= RATE_SCORE)
+          ++n_anomalies;
+        dev = MAX(-RATE_SCORE * sd, MIN(dev, RATE_SCORE * sd));
+        d->rate_mean += RATE_ALPHA * dev;
+        d->rate_var = (1 - RATE_ALPHA) * (d->rate_var +
+                                          RATE_ALPHA * dev * dev);
+    }
+
+    /* Groups count the lines of their files as they come */
+    for (i=0; i<n_groups; ++i)
+    {
+        g = &groups[i];
+        lines = __atomic_load_n(&g->lines, __ATOMIC_RELAXED);
+        g->rate = (lines - g->rate_lines) * 1000.0f / RATE_TICK_MS;
+        g->rate_lines = lines;
+    }
+    if (sort_anomaly)
+      menu_dirty = 1;
+    pthread_mutex_unlock(&mtx_post_menu);
+}
+
+/* Distinct values counted by a sketch over the window, as of 'now': a half
+ * the shard would have dropped by now is left out
+ */
+static long hll_estimate(const hll_t *h, long long now)
+{
+    int i, zeros = 0, cur = h->cur;
+    unsigned char r;
+    long long turn = h->turn;
+    double sum = 0, m = HLL_REGS, e;
+
+    for (i=0; i<HLL_REGS; ++i)
+    {
+        r = 0;
+        if (now < turn + HLL_WINDOW_MS / 2)
+          r = h->regs[cur][i];
+        if (now < turn)
+          r = MAX(r, h->regs[!cur][i]);
+        zeros += (r == 0);
+        sum += 1.0 / (1ULL << r);
+    }
+    e = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+    /* Few values: count the registers still empty instead */
+    if (e <= 2.5 * m && zeros > 0)
+      e = m * log(m / zeros);
+    return (long)(e + 0.5);
+}
+
+/* Median, 95th and 99th percentiles of the values counted by a sketch over
+ * the window, as of 'now', in 'pct' (negative if there are none): the
+ * middle of the bin the rank falls in
+ */
+static void dds_estimate(const dds_t *q, long long now, float pct[3])
+{
+    static const double at[3] = { 0.5, 0.95, 0.99 };
+    unsigned long n[DDS_BINS], total = 0, seen;
+    int i, j, cur = q->cur;
+    long long turn = q->turn;
+
+    for (i=0; i<DDS_BINS; ++i)
+    {
+        n[i] = 0;
+        if (now < turn + DDS_WINDOW_MS / 2)
+          n[i] = q->bins[cur][i];
+        if (now < turn)
+          n[i] += q->bins[!cur][i];
+        total += n[i];
+    }
+    for (j=0, i=0, seen=n[0]; j<3; ++j)
+    {
+        pct[j] = -1;
+        if (total == 0)
+          continue;
+        while (i < DDS_BINS - 1 && seen <= at[j] * (total - 1))
+          seen += n[++i];
+        pct[j] = (i == 0) ? 0 : DDS_MIN * 2 * pow(DDS_GAMMA, i) /
+                                (DDS_GAMMA + 1);
+    }
+}
+
+/* Estimate the fields counted, every FIELD_TICK_MS */
+static void fields_update(screen_t *screen)
+{
+    data_t *d;
+    const hll_t *h;
+    const dds_t *q;
+    long long now = now_ms();
+
+    if (now < fields_next)
+      return;
+    fields_next = now + FIELD_TICK_MS;
+
+    pthread_mutex_lock(&mtx_post_menu);
+    for (d=screen->datas; d; d=d->next)
+    {
+        if ((h = __atomic_load_n(&d->hll, __ATOMIC_ACQUIRE)))
+          d->distinct = hll_estimate(h, now);
+        if ((q = __atomic_load_n(&d->dds, __ATOMIC_ACQUIRE)))
+          dds_estimate(q, now, d->pct);
+    }
+    pthread_mutex_unlock(&mtx_post_menu);
+}
+
+/* Tell of the last line of a new kind written since the last frame */
+static void novel_update(screen_t *screen)
+{
+    data_t *d, *newest = NULL;
+    bloom_t *b;
+    unsigned long novel;
+    long long at, latest = 0, now = now_ms();
+
+    n_novel = 0;
+    pthread_mutex_lock(&mtx_post_menu);
+    for (d=screen->datas; d; d=d->next)
+    {
+        if (!(b = __atomic_load_n(&d->bloom, __ATOMIC_ACQUIRE)))
+          continue;
+        at = __atomic_load_n(&b->novel_at, __ATOMIC_RELAXED);
+        if (at && now - at < NOVEL_MS)
+          ++n_novel;
+        novel = __atomic_load_n(&b->novel, __ATOMIC_ACQUIRE);
+        if (novel == d->novel_seen)
+          continue;
+        d->novel_seen = novel;
+        if (at > latest)
+        {
+            latest = at;
+            newest = d;
+        }
+    }
+    if (newest && !paused)
+    {
+        pthread_mutex_lock(&mtx_buffers);
+        set_message(MESSAGE_MS, "New in %s: %s", newest->base_name,
+                    newest->bloom->text);
+        pthread_mutex_unlock(&mtx_buffers);
+    }
+    pthread_mutex_unlock(&mtx_post_menu);
+}
+
+/* Tell the shards stuck in I/O (a hung network mount) from the others:
+ * the files of the former are shown as unresponsive until they come back
+ */
+static void shards_check(void)
+{
+    int i, stalled;
+    long long since, now = now_ms();
+    char dur[16];
+    shard_t *s;
+
+    for (i=0; i<n_shards; ++i)
+    {
+        s = &shards[i];
+        since = __atomic_load_n(&s->io_since, __ATOMIC_RELAXED);
+        stalled = since && now - since > IO_TIMEOUT_MS;
+        if (stalled == s->stalled)
+          continue;
+        s->stalled = stalled;
+        format_duration(dur, sizeof(dur), now - since);
+        if (stalled && s->mount)
+          set_message(MESSAGE_MS, "No I/O on %s for %s, its files are "
+                      "skipped", s->mount, dur);
+        else if (stalled)
+          set_message(MESSAGE_MS, "No I/O for %s on shard %d, its files are "
+                      "skipped", dur, s->id);
+        else if (s->mount)
+          set_message(MESSAGE_MS, "%s responds again", s->mount);
+        else
+          set_message(MESSAGE_MS, "Shard %d responds again", s->id);
+    }
+}
+
+/* Everything the file holds so far was seen */
+static void data_mark_read(data_t *d)
 {
-    WINDOW *master;  /* Nothing here it just needs a border to look pretty */
-    WINDOW *content; /* Menu goes here                                     */
-    WINDOW *details; /* Display details about selected item                */
-    PANEL  *master_panel;
-    PANEL  *content_panel;
-    PANEL  *details_panel;
-    MENU *menu;
-    ITEM **items;
-    data_t *datas;
-} screen_t;
+    __atomic_store_n(&d->read_offset,
+                     __atomic_load_n(&d->offset, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    d->read_lines = __atomic_load_n(&d->lines, __ATOMIC_RELAXED);
+}
 
-/* Param to a thread */
-typedef struct _thread_param_t
+/* CPU time used by every thread of the process (us) */
+static long long cpu_used(void)
 {
-    int opened_files;
-    screen_t *master_screen;
-} thread_param_t;
+#ifdef HAVE_SYS_RESOURCE_H
+    struct rusage ru;
 
-static void get_last_line(data_t *d);
-const data_t *show_details;
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+      return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL +
+             ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#endif
+    return -1;
+}
 
-static void usage(const char *execname, const char *msg)
+/* Stay under the CPU budget: one step further when over it, one step back
+ * under half of it
+ */
+static void govern_update(void)
 {
-    if (msg)
-      PR("%s", msg);
-    printf("Usage: %s <config> [-d secs] [-h]\n"
-       "    -h:      Display this help screen\n"
-       "    -d secs: Auto-update display every 'secs' seconds\n", execname);
-    exit(0);
+    static const char *steps[GOVERN_STEPS + 1] =
+    {
+        "back to full rate", "fewer frames", "tails read less often",
+        "polled files looked at less often"
+    };
+    long long now = clock_real(), cpu;
+    int step = govern.step;
+
+    if (govern.budget <= 0 || now < govern.next || (cpu = cpu_used()) < 0)
+      return;
+    if (govern.wall)
+      govern.used = 100.0 * (cpu - govern.cpu) / (1000.0 * (now - govern.wall));
+    govern.next = now + GOVERN_TICK_MS;
+    govern.wall = now;
+    govern.cpu = cpu;
+
+    if (govern.used > govern.budget && step < GOVERN_STEPS)
+      ++step;
+    else if (govern.used < govern.budget / 2 && step > 0)
+      --step;
+    else
+      return;
+    __atomic_store_n(&govern.step, step, __ATOMIC_RELAXED);
+    if (step == 0)
+      shards_wake();
+    set_message(MESSAGE_MS, "CPU %.1f%% for a budget of %.1f%%: %s",
+                govern.used, govern.budget, steps[step]);
 }
 
-/* Returns the starting x-coordinate such that when displaying a value of
- * 'length' characters long, it will be centered in the given window.
+/* Memory pressure of the host: the share of time some tasks stalled on
+ * memory over the last 10 seconds (avg10 of the 'some' line), -1 if unknown
  */
-static int find_center_start(const WINDOW *win, size_t length)
+static double pressure_read(void)
 {
-    int max_x = getmaxx(win);
-    int half = length / 2;
-    return max_x / 2 - half;
+    char buf[256], *p;
+
+    if (pressure.fd < 0 || pread(pressure.fd, buf, sizeof(buf) - 1, 0) <= 0)
+      return -1;
+    buf[sizeof(buf) - 1] = '\0';
+    if (strncmp(buf, "some", 4) != 0 || !(p = strstr(buf, "avg10=")))
+      return -1;
+    return atof(p + strlen("avg10="));
 }
 
-
-/* Writes the program title into the window */
-static void write_title_window(WINDOW *master)
+/* Look at the memory pressure from TREETOP_PSI (a stand-in, for testing) or
+ * PSI_PATH, and ask to be told when it rises if the kernel lets us.
+ * Returns the descriptor to wait for (POLLPRI), -1 if there is none.
+ */
+static int pressure_init(void)
 {
-    int x;
-    box(master, 0, 0);
-    x = find_center_start(master, strlen(TITLE));
-    mvwprintw(master, 0, x, TITLE);
+    const char *path = getenv("TREETOP_PSI");
+
+    pressure.fd = -1;
+    if (path)
+      pressure.fd = open(path, O_RDONLY | O_CLOEXEC);
+    else if ((pressure.fd = open(PSI_PATH, O_RDWR | O_NONBLOCK | O_CLOEXEC)) >= 0 &&
+             write(pressure.fd, PSI_TRIGGER, strlen(PSI_TRIGGER) + 1) > 0)
+      return pressure.fd;
+    else if (pressure.fd < 0)
+      pressure.fd = open(PSI_PATH, O_RDONLY | O_CLOEXEC);
+    return -1;
 }
 
-static void read_files(int bytes, int opened_files, data_t *data) {
-    char c;
-    int j;
-    char *last, *tmp;
+/* Free the tails of the files out of sight, they are read again when they
+ * come into sight.  Must be called with the post_menu mutex held.
+ */
+static void pressure_shed_tails(screen_t *screen)
+{
     data_t *d;
+    int row, rows = getmaxy(screen->content);
 
-
-    for (d = data; d; d = d->next)
+    pthread_mutex_lock(&mtx_buffers);
+    for (d=screen->datas; d; d=d->next)
     {
-        if (d->state == UPDATED) {
-            if (d->buff == NULL) {
-                if ((d->buff = malloc(sizeof(char) * bytes)) == NULL) {
-                    ER("Can't allocate memory for file buffer");
-                }
-            }
-            else if (bytes * sizeof(char) != sizeof(d->buff)) {
-                if ((tmp = realloc(d->buff, sizeof(char) * bytes)) == NULL) {
-                    ER("Can't reallocate memory for file buffer");
-                }
-                d->buff = tmp;
-            }
-            memset(d->buff, '\0', sizeof(char) * bytes);
-            /* Set the file-read pointer */
-            if (fseek(d->fp, -bytes, SEEK_END) == -1)
-                fseek(d->fp, 0, SEEK_SET);
+        if (!d->buff || d == show_details || d->pane)
+          continue;
+        row = data_row(screen, d);
+        if (row >= 0 && row < rows)
+          continue;
+        mem_add(MEM_TAIL, -(d->buff_size + 1), -1);
+        free(d->buff);
+        d->buff = d->line = NULL;
+        d->buff_size = 0;
+        if (d->item)
+          d->item->description.str = item_updating();
+        d->shed = 1;
+    }
+    pthread_mutex_unlock(&mtx_buffers);
+}
 
-            j=0;
-            last = d->buff;
-            while ((c = fgetc(d->fp)) != EOF)
-            {
-                d->buff[j] = c;
-                if (j > 0 && d->buff[j-1] == '\n') {
-                    last = d->buff + j;
-                }
-                j++;
-            }
-            d->buff[j] = '\0';
-            d->line = last;
+/* Shed caches while the host is short of memory, one more step every
+ * PSI_TICK_MS (or as soon as the kernel tells): histories of the pinned
+ * files out of sight, then indexes, then tails out of sight.  They grow
+ * back as they are needed once the pressure is gone.
+ */
+static void pressure_update(screen_t *screen, int told)
+{
+    static const char *steps[PSI_STEPS + 1] =
+    {
+        "caches grow back as needed", "shedding pinned histories",
+        "shedding indexes too", "shedding tails out of sight too"
+    };
+    long long now = clock_real();
+    int i, step = pressure.step;
+    pane_t *p;
+
+    if (pressure.fd < 0 || (!told && now < pressure.next))
+      return;
+    pressure.next = now + PSI_TICK_MS;
+    if ((pressure.some = pressure_read()) < 0)
+      return;
+
+    if (pressure.some >= PSI_HIGH && step < PSI_STEPS)
+      ++step;
+    else if (pressure.some < PSI_LOW && step > 0)
+      --step;
+    if (step != pressure.step)
+      set_message(MESSAGE_MS, "Memory pressure %.1f%%: %s", pressure.some,
+                  steps[step]);
+
+    /* Pinned files get their history back */
+    if (step == 0 && pressure.step)
+      for (i=0; i<n_panes; ++i)
+        if (!panes[i].buff)
+          shard_post(panes[i].data->shard, SHARD_REFRESH,
+                     panes[i].data->full_path, 0);
+    __atomic_store_n(&pressure.step, step, __ATOMIC_RELAXED);
+    if (step == 0 || pressure.some < PSI_HIGH)
+      return;
+
+    if (!show_panes)
+    {
+        pthread_mutex_lock(&mtx_buffers);
+        for (i=0; i<n_panes; ++i)
+        {
+            p = &panes[i];
+            if (!p->buff)
+              continue;
+            free(p->buff);
+            mem_add(MEM_HISTORY, -PANE_RETAIN, -1);
+            p->buff = NULL;
+            p->len = 0;
+            p->scroll = 0;
+            p->offset = 0;
         }
+        pthread_mutex_unlock(&mtx_buffers);
+    }
+    if (step >= 2)
+      for (i=0; i<n_shards; ++i)
+        shard_post(&shards[i], SHARD_SHED, "", 0);
+    if (step >= 3)
+    {
+        pthread_mutex_lock(&mtx_post_menu);
+        pressure_shed_tails(screen);
+        pthread_mutex_unlock(&mtx_post_menu);
     }
 }
 
-/* returns the writable bytes of the s WINDOW */
-static int getMaxBytes(WINDOW *s, int *maxx, int *maxy) {
-    getmaxyx(s, *maxy, *maxx);
+/* Take in what the shards published and draw a frame */
+static void ui_frame(screen_t *screen)
+{
+    static int indexing;
+    char c;
+    int i, maxx, maxy;
 
-    *maxy -= 2; /* Ignore border */
-    *maxx -= 2; /* Ignore border */
-    return *maxx * *maxy;
+    pthread_mutex_lock(&mtx_post_menu);
+    shards_take(screen);
+    pthread_mutex_unlock(&mtx_post_menu);
+    if (menu_dirty && !paused)
+        screen_sync_menu(screen);
+    if (__atomic_exchange_n(&mem_report_wanted, 0, __ATOMIC_ACQ_REL))
+        mem_report(screen);
+    shards_check();
+    govern_update();
+    pressure_update(screen, 0);
+    rates_update(screen);
+    fields_update(screen);
+    novel_update(screen);
+    if ((i = __atomic_load_n(&index_progress, __ATOMIC_RELAXED)) >= 0 &&
+        show_details) {
+        set_message(-1, "Indexing %s: %d%%", show_details->base_name, i);
+        indexing = 1;
+    }
+    else if (indexing) {
+        message[0] = '\0';
+        indexing = 0;
+    }
+
+    if (paused) {
+        /* Frozen: nothing is drawn, only accounting goes on */
+        return;
+    }
+    else if (show_panes) {
+        /* Only the panes of files which changed are redrawn */
+        panes_update();
+        hide_panel(screen->details_panel);
+    }
+    else if (show_memory) {
+        mem_draw(screen);
+        show_panel(screen->details_panel);
+    }
+    else if (show_templates) {
+        templates_draw(screen);
+        show_panel(screen->details_panel);
+    }
+    else if (show_plugins) {
+        plugins_draw(screen);
+        show_panel(screen->details_panel);
+    }
+    else if (show_steps) {
+        steps_draw(screen);
+        show_panel(screen->details_panel);
+    }
+    else if (show_heatmap) {
+        heatmap_draw(screen);
+        show_panel(screen->details_panel);
+    }
+    else if (show_details == NULL) {
+        menu_driver_update(screen, -1);
+        hide_panel(screen->details_panel);
+    }
+    else {
+        getMaxBytes(screen->details, &maxx, &maxy);
+        werase(screen->details); /* Pages of a long line differ in length */
+        wmove(screen->details, 1, 1);
+        i = 0;
+        pthread_mutex_lock(&mtx_buffers);
+        while (show_details->buff && (c = show_details->buff[i++]) != '\0') {
+            /* From a point in time: its line stays at the top */
+            if (details_at >= 0 && getcury(screen->details) == maxy &&
+                (c == '\n' || getcurx(screen->details) == maxx))
+                break;
+            if (getcurx(screen->details) == maxx)
+            {
+                waddch(screen->details, ' ');
+                waddch(screen->details, ' ');
+                waddch(screen->details, ' ');
+            }
+            else if (getcurx(screen->details) == 0)
+                waddch(screen->details, ' ');
+
+            waddch(screen->details, c);
+        }
+        pthread_mutex_unlock(&mtx_buffers);
+
+        /* Display file name and draw border */
+        box(screen->details, 0, 0);
+        mvwprintw(screen->details, 0, 1, "[%s]", show_details->base_name);
+        show_panel(screen->details_panel);
+    }
 
+    write_status_window(screen->master);
+    write_message_window(screen->master);
+    update_panels_safe();
 }
 
-static void refresh_menus(screen_t *screen)
+/* Show the details of the file from the time typed in at the prompt: a time
+ * of today, or a date and time, local either way
+ */
+static void ui_seek(const char *text)
 {
+    struct tm tm;
+    time_t t;
+    int n = 0, y, mo, dd, hh = 0, mm = 0, ss = 0;
+    const data_t *d;
+
+    message[0] = '\0';
+    if (!text[0] || !(d = show_details))
+      return;
+
+    t = time(NULL);
+    localtime_r(&t, &tm);
+    if (sscanf(text, "%d-%d-%d %d:%d%n:%d%n", &y, &mo, &dd, &hh, &mm, &n,
+               &ss, &n) >= 5)
+    {
+        tm.tm_year = y - 1900;
+        tm.tm_mon = mo - 1;
+        tm.tm_mday = dd;
+    }
+    else if (sscanf(text, "%d:%d%n:%d%n", &hh, &mm, &n, &ss, &n) < 2)
+      n = 0;
+    tm.tm_hour = hh;
+    tm.tm_min = mm;
+    tm.tm_sec = ss;
+    tm.tm_isdst = -1;
+    if (n == 0 || text[n] != '\0' || (t = mktime(&tm)) == (time_t)-1)
+    {
+        set_message(MESSAGE_MS, "Not a time: %s", text);
+        return;
+    }
+
     pthread_mutex_lock(&mtx_post_menu);
-    unpost_menu(screen->menu);
-    post_menu(screen->menu);
+    details_unread = 0;
+    details_seek = t;
+    __atomic_store_n(&index_progress, 0, __ATOMIC_RELAXED);
+    shard_post(d->shard, SHARD_SEEK, d->full_path, 0);
     pthread_mutex_unlock(&mtx_post_menu);
 }
 
-static void update_panels_safe()
+/* Slow down while nobody is looking, back to full rate (the shards reading
+ * what they left aside) when someone is
+ */
+static void set_low_power(int on)
 {
-    pthread_mutex_lock(&mtx_update_panels);
-    update_panels();
-    doupdate();
-    pthread_mutex_unlock(&mtx_update_panels);
+    if (on == low_power)
+      return;
+    __atomic_store_n(&low_power, on, __ATOMIC_RELAXED);
+    if (!on)
+      shards_wake();
 }
 
-static void menu_driver_update(screen_t *screen, int c)
+/* Back to the list from any of the views */
+static void views_hide(void)
+{
+    show_memory = show_templates = show_plugins = show_steps = 0;
+    show_heatmap = 0;
+}
+
+/* Run a command sent by the getch loop */
+static void ui_command(screen_t *screen, char cmd)
 {
     data_t *d;
-    if (c >= 0)
-    {
-        menu_driver(screen->menu, c);
-    }
+    group_t *g;
+    int i;
 
-    for (d=screen->datas; d; d=d->next)
-    {
-        if (d->state == UPDATED)
-        {
-            d->item->description.str = d->line;
-        }
-    }
-    refresh_menus(screen);
-    for (d=screen->datas; d; d=d->next)
+    switch(cmd)
     {
-        if (d->state == UPDATED)
-        {
-            if (d != ((data_t *)(item_userptr(current_item(screen->menu)))))
+        case SHOW_DETAILS:
+            pthread_mutex_lock(&mtx_post_menu);
+
+            /* A group row opens or folds the group instead */
+            if ((g = item_group(current_item(screen->menu))))
             {
-                mvwprintw(screen->content, item_index(d->item), 3, UPDATED_CHAR);
+                g->open = !g->open;
+                menu_dirty = 1;
+                pthread_mutex_unlock(&mtx_post_menu);
+                break;
             }
-            else {
-                d->state = UNCHANGED;
+            details_at = -1;
+            details_page = 0;
+            details_unread = 0;
+            views_hide();
+            show_details = d = item_userptr(current_item(screen->menu));
+            if (d) {
+                /* Read a whole window this time */
+                shard_post(d->shard, SHARD_REFRESH, d->full_path, 0);
+                d->state = UPDATED;
+                data_mark_read(d);
             }
-        }
-    }
-
-    if (c > 0)
-    {
-        update_panels_safe();
+            pthread_mutex_unlock(&mtx_post_menu);
+            break;
+        case SHOW_UNREAD:
+            pthread_mutex_lock(&mtx_post_menu);
+            d = show_details ? (data_t *)show_details :
+                               item_userptr(current_item(screen->menu));
+            if (d && (d->read_offset < 0 || d->lines == d->read_lines))
+              set_message(MESSAGE_MS, "Nothing unread in %s", d->base_name);
+            else if (d)
+            {
+                /* Read from the marker on, not from the end */
+                __atomic_store_n(&details_line, 0, __ATOMIC_RELAXED);
+                __atomic_store_n(&details_at, d->read_offset,
+                                 __ATOMIC_RELAXED);
+                details_page = 0;
+                details_unread = 1;
+                views_hide();
+                show_details = d;
+                shard_post(d->shard, SHARD_REFRESH, d->full_path, 0);
+                d->state = UPDATED;
+                set_message(MESSAGE_MS, "%lu lines unread in %s",
+                            d->lines - d->read_lines, d->base_name);
+            }
+            pthread_mutex_unlock(&mtx_post_menu);
+            break;
+        case HIDE_DETAILS:
+        case DETAILS_FOLLOW:
+            pthread_mutex_lock(&mtx_post_menu);
+            if ((d = (data_t *)show_details) && details_unread)
+            {
+                /* Gone through what was unread, or straight to the end */
+                data_mark_read(d);
+                details_unread = 0;
+            }
+            if (d && (details_at >= 0 || cmd == DETAILS_FOLLOW))
+            {
+                /* The row shows the last line again */
+                __atomic_store_n(&details_at, -1, __ATOMIC_RELAXED);
+                details_page = 0;
+                shard_post(d->shard, SHARD_REFRESH, d->full_path, 0);
+            }
+            if (cmd == HIDE_DETAILS)
+            {
+                show_details = NULL;
+                views_hide();
+            }
+            pthread_mutex_unlock(&mtx_post_menu);
+            break;
+        case PROMPT_TIME:
+            set_message(-1, "Go to time (HH:MM[:SS] or YYYY-MM-DD "
+                        "HH:MM[:SS]): %s", seek_text);
+            break;
+        case SEEK_TIME:
+            ui_seek(seek_text);
+            break;
+        case LOW_POWER:
+        case FULL_POWER:
+            set_low_power(cmd == LOW_POWER);
+            break;
+        case SHOW_MEMORY:
+            show_details = NULL;
+            i = !show_memory;
+            views_hide();
+            show_memory = i;
+            break;
+        case SHOW_TEMPLATES:
+            show_details = NULL;
+            i = !show_templates;
+            views_hide();
+            show_templates = i;
+            break;
+        case SHOW_PLUGINS:
+            show_details = NULL;
+            i = !show_plugins;
+            views_hide();
+            show_plugins = i;
+            break;
+        case SHOW_STEPS:
+            show_details = NULL;
+            i = !show_steps;
+            views_hide();
+            show_steps = i;
+            break;
+        case SHOW_HEATMAP:
+            show_details = NULL;
+            i = !show_heatmap;
+            views_hide();
+            show_heatmap = i;
+            heat.full = 1;
+            break;
+        case HEAT_GROUP:
+            heat.group = !heat.group;
+            heat.full = 1;
+            break;
+        case MEMORY_SORT:
+            mem_sort = (mem_sort + 1) % (MEM_KINDS + 1);
+            break;
+        case SORT_ANOMALY:
+            pthread_mutex_lock(&mtx_post_menu);
+            sort_anomaly = !sort_anomaly;
+            menu_dirty = 1;
+            pthread_mutex_unlock(&mtx_post_menu);
+            set_message(MESSAGE_MS, sort_anomaly ?
+                        "Unusual line rates first" :
+                        "Files in their usual order");
+            break;
+        case PIN_PANE:
+        case UNPIN_PANE:
+        case SHOW_PANES:
+        case HIDE_PANES:
+        case PANE_FOCUS:
+        case PANE_UP:
+        case PANE_DOWN:
+        case PANE_PAGE_UP:
+        case PANE_PAGE_DOWN:
+        case PANE_FOLLOW:
+            panes_command(screen, cmd);
+            break;
+        case TOGGLE_PAUSE:
+            toggle_pause(screen);
+            break;
+        case RESIZE_SCREEN:
+            screen_resize(screen);
+            break;
+        case DETAILS_UP:
+        case DETAILS_DOWN:
+            pthread_mutex_lock(&mtx_post_menu);
+            if (show_details)
+            {
+                if (cmd == DETAILS_DOWN)
+                  __atomic_add_fetch(&details_page, 1, __ATOMIC_RELAXED);
+                else if (details_page > 0 ||
+                         (details_at >= 0 && !details_unread))
+                  __atomic_sub_fetch(&details_page, 1, __ATOMIC_RELAXED);
+                shard_post(show_details->shard, SHARD_REFRESH,
+                           show_details->full_path, 0);
+            }
+            pthread_mutex_unlock(&mtx_post_menu);
+            break;
+        default:
+            /* Dunno what to do here ? */
+            break;
     }
 }
 
+/* Display thread: takes in what the shards publish, runs the commands of
+ * the getch loop and draws, at most once every FRAME_MS.
+ */
 static void *thread_read_files(void *args)
 {
-    char c, cmd;
-    int i, nfds, opened_files, maxx, maxy;
+    char cmd, buf[64];
+    int i, nfds, maxx, maxy, woken, frame, wait_ms, frame_ms;
+    long long last_frame, now;
     ssize_t r;
 #ifdef HAVE_KQUEUE
     int kq;
-    struct kevent *ev;
+    struct kevent ev[4];
+    struct timespec idle_ts = { IDLE_MS / 1000, (IDLE_MS % 1000) * 1000000L };
 #elif defined(HAVE_EPOLL_CREATE)
-    int epollfd;
-    struct epoll_event *ev, event;
+    int epollfd, psi;
+    struct epoll_event ev[3], event;
 #endif /* !HAVE_KQUEUE */
-#ifndef HAVE_KQUEUE
-    struct stat stats;
-#endif
     screen_t *screen;
-    data_t *data, *d;//, *show_details = NULL;
 
-    opened_files = ((thread_param_t *)args)->opened_files;
     screen = ((thread_param_t *)args)->master_screen;
-    data = screen->datas;
 
     free(args);
 
 #ifdef HAVE_KQUEUE
     kq = kqueue();
     if (kq < 0)
-        {
+    {
         ER("Can't initialize kqueue");
     }
+    fd_cloexec(kq);
+    EV_SET(&ev[0], SIGWINCH, EVFILT_SIGNAL, EV_ADD | EV_ENABLE, 0, 0, 0);
+    EV_SET(&ev[1], fildes[PIPE_READ], EVFILT_READ, EV_ADD | EV_ENABLE | EV_CLEAR, 0, 0, 0);
+    EV_SET(&ev[2], ui_wake[PIPE_READ], EVFILT_READ, EV_ADD | EV_ENABLE | EV_CLEAR, 0, 0, 0);
+    if (kevent(kq, ev, 3, NULL, 0, NULL) < 0) {
+        ER("Can't set kevent");
+    }
 #elif defined(HAVE_EPOLL_CREATE)
-    epollfd = epoll_create1(0);
-    if (epoll_create1 < 0)
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd < 0)
     {
        ER("Can't initialize epoll: %s", strerror(errno));
     }
-		event.events = EPOLLIN;
-#endif /* !HAVE_KQUEUE */
-
-#ifdef HAVE_KQUEUE
-    ev = (struct kevent *) malloc(sizeof(struct kevent) * opened_files + 2);
-    if (ev == NULL)
-    {
-        ER("Can't allocate memory for kevents");
+    event.events = EPOLLIN;
+    event.data.fd = fildes[PIPE_READ];
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fildes[PIPE_READ], &event) == -1) {
+        ER("Can't add file descriptor in epoll instance: %s", strerror(errno));
     }
-#elif defined(HAVE_EPOLL_CREATE)
-    //ev = (struct epoll_event *) malloc(sizeof(struct epoll_event) * opened_files + 1); /* allocate two extra events to get the notifications from the event loop */
-			ev = (struct epoll_event *) malloc(sizeof(struct epoll_event) * 1); /* allocate two extra events to get the notifications from the event loop */
-    if (ev == NULL)
-    {
-        ER("Can't allocate memory for epoll_events");
+    event.data.fd = ui_wake[PIPE_READ];
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, ui_wake[PIPE_READ], &event) == -1) {
+        ER("Can't add file descriptor in epoll instance: %s", strerror(errno));
     }
+
+    /* Told at once when memory gets short, looked at every second anyway */
+    event.events = EPOLLPRI;
+    event.data.fd = psi = pressure_init();
+    if (psi >= 0 && epoll_ctl(epollfd, EPOLL_CTL_ADD, psi, &event) == -1)
+        DBG("Can't wait for memory pressure: %s", strerror(errno));
+#else
+    pressure_init();
 #endif /* !HAVE_KQUEUE */
 
-#if defined(HAVE_KQUEUE) || defined(HAVE_EPOLL_CREATE)
-#ifdef HAVE_KQUEUE
-    i = 0;
-    for (d=screen->datas; d; d=d->next)
-    {
-        EV_SET(&ev[i], d->fd, EVFILT_VNODE, EV_ADD | EV_ENABLE | EV_CLEAR, NOTE_DELETE | NOTE_RENAME, 0, 0); /* Detect removal and renamming of the file */
-        EV_SET(&ev[i], d->fd, EVFILT_READ, EV_ADD | EV_ENABLE | EV_CLEAR, 0, 0, 0); /* Detect new data */
-        i++;
-    }
-    EV_SET(&ev[i++], SIGWINCH, EVFILT_SIGNAL, EV_ADD | EV_ENABLE, 0, 0, 0);
-    EV_SET(&ev[i++], fildes[PIPE_READ], EVFILT_READ, EV_ADD | EV_ENABLE | EV_CLEAR, 0, 0, 0);
-    if (kevent(kq, ev, opened_files + 2, NULL, 0, NULL) < 0) {
-        ER("Can't set kevent");
-    }
-#elif defined(HAVE_EPOLL_CREATE)
-		event.data.fd = fildes[PIPE_READ];
-		if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fildes[PIPE_READ], &event) == -1) {
-			ER("Can't add file descriptor in epoll instance: %s", strerror(errno));
-		}
-#endif
-#endif /* defined(HAVE_KQUEUE) || defined(HAVE_EPOLL_CREATE) */
+    details_bytes = getMaxBytes(screen->details, &maxx, &maxy);
+    details_rows = maxy;
+    shards_start(screen);
 
+    last_frame = 0;
+    frame = 1;
+    __atomic_store_n(&last_input, now_ms(), __ATOMIC_RELAXED);
     for (;;) {
-        read_files (getMaxBytes(screen->details, &maxx, &maxy), opened_files, data);
-
-        if (show_details == NULL) {
-            menu_driver_update(screen, -1);
-            hide_panel(screen->details_panel);
-        }
-        else {
-            wmove(screen->details, 1, 1);
-            i = 0;
-            while ((c = show_details->buff[i++]) != '\0') {
-                if (getcurx(screen->details) == maxx)
-                {
-                    waddch(screen->details, ' ');
-                    waddch(screen->details, ' ');
-                    waddch(screen->details, ' ');
-                }
-                else if (getcurx(screen->details) == 0)
-                    waddch(screen->details, ' ');
-
-                waddch(screen->details, c);
-            }
-
-            /* Display file name and draw border */
-            box(screen->details, 0, 0);
-            mvwprintw(screen->details, 0, 1, "[%s]", show_details->base_name);
-            show_panel(screen->details_panel);
+        now = now_ms();
+        if (!low_power && idle_ms > 0 &&
+            now - __atomic_load_n(&last_input, __ATOMIC_RELAXED) > idle_ms)
+            set_low_power(1);
+
+        /* In low power, only commands are drawn at once */
+        if (frame || now - last_frame >= LOW_POWER_MS) {
+            ui_frame(screen);
+            last_frame = now_ms();
         }
-
-        update_panels_safe();
-
-#if defined(HAVE_KQUEUE) || defined(HAVE_EPOLL_CREATE)
+        frame = !low_power;
+        wait_ms = low_power ?
+            MAX(1, LOW_POWER_MS - (now_ms() - last_frame)) : IDLE_MS;
+
+        /* Wait for a command or for the shards to publish something, the
+         * status and message lines are refreshed every IDLE_MS anyway
+         */
+        woken = 0;
 #ifdef HAVE_KQUEUE
-        nfds = kevent(kq, NULL, 0, ev, 1, NULL);
+        idle_ts.tv_sec = wait_ms / 1000;
+        idle_ts.tv_nsec = (wait_ms % 1000) * 1000000L;
+        nfds = kevent(kq, NULL, 0, ev, 4, &idle_ts);
 #elif defined(HAVE_EPOLL_CREATE)
-				nfds = epoll_wait(epollfd, ev, 1, 0);
+        nfds = epoll_wait(epollfd, ev, 3, wait_ms);
+#else
+        usleep(FRAME_MS * 1000);
+        nfds = 0;
 #endif
         if (nfds < 0)
-				{
+        {
 #ifdef HAVE_KQUEUE
             DBG("Error retrieving kevent, we might have been interrupted");
 #elif defined(HAVE_EPOLL_CREATE)
             DBG("Error retrieving epoll events, we might have been interrupted");
 #endif
         }
-				for (i = 0; i < nfds; i++)
-				{
+        for (i = 0; i < nfds; i++)
+        {
 #ifdef HAVE_KQUEUE
             if (ev[i].filter == EVFILT_SIGNAL &&
                 ev[i].ident == SIGWINCH) {
 
                 /* This ensure that LINES and COLS are correctly updated */
                 doupdate();
-
-                mvwprintw(screen->master, 1, columns-1, " ");
-                columns = COLS;
-                if (wresize(screen->master, LINES, COLS) == ERR)
-                    WR("Error resizing master windows");
-                if (wresize(screen->content,
-                            INNER_WIN_LINES, INNER_WIN_COLS) == ERR)
-                    WR("Error resizing content windows");
-                if (wresize(screen->details,
-                            INNER_WIN_LINES, INNER_WIN_COLS) == ERR)
-                    WR("Error resizing details windows");
-
-                /* Redraw the title and clean up the border */
-                write_title_window(screen->master);
-                refresh_menus(screen);
+                screen_resize(screen);
                 update_panels_safe();
+                continue;
             }
-            else if (ev[i].filter == EVFILT_SIGNAL &&
-                     ev[i].ident == SIGUSR1) {
-               /* handle displaying details here */
-                show_details = item_userptr(current_item(screen->menu));
-            }
-            else if (ev[i].filter == EVFILT_SIGNAL &&
-                     ev[i].ident == SIGUSR2) {
-               /* handle displaying details here */
-                show_details = NULL;
-            }
-            else if (ev[i].filter == EVFILT_READ) {
-                if (fildes[PIPE_READ] == ev[i].ident)
+            if (ev[i].filter != EVFILT_READ)
+                continue;
+            if (ui_wake[PIPE_READ] == (int)ev[i].ident)
 #elif defined(HAVE_EPOLL_CREATE)
-								if (fildes[PIPE_READ] == ev[i].data.fd)
-#endif
-                {
-                    if ((r = read(fildes[PIPE_READ], &cmd, sizeof(cmd))) == -1)
-                    {
-                        WR("reading command from pipe returned an error: %s", strerror(errno));
-                    }
-                    else if (r == 0)
-                    {
-                        WR("end-of-file detected from the command pipe, this is abnormal !");
-                    }
-                    else
-                    {
-                        switch(cmd)
-                        {
-                            case SHOW_DETAILS:
-                                show_details = item_userptr(current_item(screen->menu));
-                                break;
-                            case HIDE_DETAILS:
-                                show_details = NULL;
-                                break;
-                            default:
-                                /* Dunno what to do here ? */
-                                break;
-                        }
-                    }
-                }
-#ifdef HAVE_KQUEUE
-						}
-                else
-								{
-									for (d=screen->datas; d; d=d->next) {
-										if(d->fd == ev[i].ident) {
-												d->state = UPDATED;
-												break;
-											}
-									}
-								}
-#endif
-				}
+            if (psi >= 0 && psi == ev[i].data.fd)
+            {
+                pressure_update(screen, 1);
+                continue;
+            }
+            if (ui_wake[PIPE_READ] == ev[i].data.fd)
 #endif
-#ifndef HAVE_KQUEUE
-                /* If the files have been updated, grab the last line from the file */
-                for (d=data; d; d=d->next)
-                {
-                    if (stat(d->full_path, &stats) == -1)
-                        ER("Could not obtain file stats for: '%s'", d->base_name);
-
-                    /* If the file has been modified since last check, update */
-                    if (stats.st_mtime != d->last_mod)
-                    {
-                        d->last_mod = stats.st_mtime;
-                        d->state = UPDATED;
-                    }
-                }
-                usleep(25000);
-#endif /* !HAVE_KQUEUE */
-    }
+            {
+                /* Taken in at the top of the loop */
+                while (read(ui_wake[PIPE_READ], buf, sizeof(buf)) > 0)
+                    ;
+                __atomic_store_n(&ui_woken, 0, __ATOMIC_RELEASE);
+                woken = 1;
+                continue;
+            }
+            if ((r = read(fildes[PIPE_READ], &cmd, sizeof(cmd))) == -1)
+            {
+                WR("reading command from pipe returned an error: %s", strerror(errno));
+                continue;
+            }
+            else if (r == 0)
+            {
+                WR("end-of-file detected from the command pipe, this is abnormal !");
+                continue;
+            }
 
-#ifdef HAVE_KQUEUE
-		free(ev);
-#elif defined(HAVE_EPOLL_CREATE)
-		free(ev);
-#endif
+            /* Commands are drawn at once */
+            woken = 0;
+            frame = 1;
+            ui_command(screen, cmd);
+        }
+
+        /* Busy files do not get more frames than that */
+        frame_ms = govern.step ? GOVERN_FRAME_MS : FRAME_MS;
+        if (woken && !low_power && (now = now_ms()) - last_frame < frame_ms)
+            usleep((frame_ms - (now - last_frame)) * 1000);
+    }
 
     return (void *) NULL;
 }
 
+/* Create the menu item of a file */
+static void data_new_item(data_t *d)
+{
+    d->item = new_item(d->base_name, item_updating());
+    mem_add(MEM_CURSES, sizeof(ITEM), 1);
+    d->item->description.length = COLS;
+    set_item_userptr(d->item, (void *)d);
+}
+
 /* Update display */
 static void screen_create_menu(screen_t *screen)
 {
     int i = 0;
     data_t *d;
-    char line[COLS];
-    const char *def = "Updating...";
 
     /* Count number of data items */
     for (d=screen->datas; d; d=d->next)
       ++i;
 
-    /* Allocate a long line for the description (make it all spaces) */
-    memset(line, ' ', sizeof(line) - 1);
-    line[sizeof(line)] = '\0';
-    memcpy(line, def, strlen(def));
-
-    /* Allocate and create menu items (one per data item */
-    screen->items = (ITEM **)calloc(i+1, sizeof(ITEM *));
-    for (i=0, d=screen->datas; d; d=d->next, ++i)
-    {
-        screen->items[i] = new_item(d->base_name, line);
-        screen->items[i]->description.length = sizeof(line);
-        set_item_userptr(screen->items[i], (void *)d);
-        d->item = screen->items[i];
-    }
+    /* Allocate and create menu items (one per data item, and group) */
+    screen->items = (ITEM **)calloc(i + n_groups + 1, sizeof(ITEM *));
+    i = menu_layout(screen, screen->items);
+    mem_add(MEM_CURSES, (i+1) * sizeof(ITEM *), 1);
 
     screen->menu = new_menu(screen->items);
     set_menu_mark(screen->menu, "-->  ");
     set_menu_win(screen->menu, screen->content);
+    set_menu_sub(screen->menu, screen->content);
     post_menu(screen->menu);
 }
 
 
 
+static void term_real(void)
+{
+    initscr();
+
+    /* Ask for focus reports, terminals not knowing them ignore this */
+    define_key("\033[I", KEY_FOCUS_IN);
+    define_key("\033[O", KEY_FOCUS_OUT);
+    printf("\033[?1004h");
+    fflush(stdout);
+    focus_reports = 1;
+}
+
+/* Terminal of the size given by the simulation, drawn to /dev/null: what
+ * is shown is read back from the windows
+ */
+static void term_virtual(void)
+{
+    FILE *null;
+
+    if (!(null = fopen("/dev/null", "r+")) || !newterm("vt100", null, null))
+      ER("Can't create a virtual terminal");
+    resizeterm(sim.rows, sim.cols);
+}
+
+/* Terminal the screen is drawn on */
+static void (*term_open)(void) = term_real;
+
 /* Initialize curses */
 static screen_t *screen_create(data_t *datas, int timeout_ms)
 {
     screen_t *screen;
 
-    initscr();
+    term_open();
     cbreak();
     noecho();
     curs_set(0); /* Turn cursor off */
@@ -585,6 +7415,11 @@ static void screen_destroy(screen_t *screen)
     nocbreak();
     echo();
     endwin();
+    if (focus_reports)
+    {
+        printf("\033[?1004l");
+        fflush(stdout);
+    }
     free(screen);
 }
 
@@ -618,20 +7453,79 @@ static pthread_t *threads_init(int opened_files, screen_t *screen) {
 
     pthread_create(thread, NULL, thread_read_files, (void *)params);
 
-    return (thread);
+#ifdef HAVE_SPAWN_H
+    /* Commands are spawned away from the display */
+    if (n_hooks > 0)
+    {
+        pthread_t hook_thread;
+        pthread_condattr_t attr;
+
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&cond_hooks, &attr);
+        pthread_condattr_destroy(&attr);
+        if (pthread_create(&hook_thread, NULL, thread_hooks, NULL) != 0)
+          ER("Can't create hook thread");
+        pthread_detach(hook_thread);
+    }
+#endif
+
+    return (thread);
+}
+
+/* Parse a '[NAME]' line: the files listed next belong to the group NAME,
+ * one named again being added to.  Returns NULL if it is invalid.
+ */
+static group_t *group_parse(const char *c)
+{
+    const char *end = strchr(c, ']');
+    size_t len;
+    int i;
+    group_t *g;
+
+    if (end == NULL || end == c + 1)
+      return NULL;
+    len = end + 1 - c;
+    for (i=0; i<n_groups; ++i)
+      if (strlen(groups[i].name) == len &&
+          strncmp(groups[i].name, c, len) == 0)
+        return &groups[i];
+    if (n_groups == MAX_GROUPS)
+      return NULL;
+
+    g = &groups[n_groups++];
+    g->name = strndup(c, len);
+    snprintf(g->row, sizeof(g->row), "Updating...");
+    return g;
+}
+
+/* Files found in the tree at 'root' (its first 'len' bytes) belong to 'g' */
+static void group_add_tree(const char *root, size_t len, group_t *g)
+{
+    void *tmp;
+
+    if (!(tmp = realloc(group_trees, (n_group_trees + 1) *
+                                     sizeof(*group_trees))))
+      ER("Can't allocate memory for group trees");
+    group_trees = tmp;
+    group_trees[n_group_trees].root = strdup(root);
+    group_trees[n_group_trees].len = len;
+    group_trees[n_group_trees++].group = g;
 }
 
 /* Create our file information */
 static data_t *data_init(const char *fname, int *nb_of_opened_files)
 {
     FILE *fp, *entry_fp;
-    data_t *head, *tmp;
+    data_t *head, *tmp, *found;
+    group_t *group = NULL;
     char *c, *line;
-    size_t sz;
+    size_t sz, len;
     ssize_t ret;
+    struct stat st;
 #define CONTINUE {free(line); line=NULL; continue;}
 
-    if (!(fp = fopen(fname, "r")))
+    if (!(fp = fopen(fname, "re")))
       ER("Could not open config file '%s'", fname);
 
     /* For each line in config */
@@ -652,35 +7546,125 @@ static data_t *data_init(const char *fname, int *nb_of_opened_files)
           *(strchr(c, COMMENT_CHAR)) = '\0';
         if (strchr(c, '\n'))
           *(strchr(c, '\n')) = '\0';
+
+        /* [NAME]: the files listed next belong to the group NAME */
+        if (*c == '[')
+        {
+            if (!(group = group_parse(c)))
+              WR("Invalid group: '%s'", c);
+            CONTINUE;
+        }
+
+        /* distinct FIELD|/REGEX/ [in NAME] */
+        if (strncmp(c, "distinct ", strlen("distinct ")) == 0)
+        {
+            if (field_parse(c, distincts, &n_distincts) != 0)
+              WR("Invalid distinct rule: '%s'", c);
+            CONTINUE;
+        }
+
+        /* quantiles FIELD|/REGEX/ [in NAME] */
+        if (strncmp(c, "quantiles ", strlen("quantiles ")) == 0)
+        {
+            if (field_parse(c, quantiles, &n_quantiles) != 0)
+              WR("Invalid quantiles rule: '%s'", c);
+            CONTINUE;
+        }
+
+        /* plugin PATH [in NAME] [args ARGS] */
+        if (strncmp(c, "plugin ", strlen("plugin ")) == 0)
+        {
+#ifdef HAVE_DLFCN_H
+            if (plugin_parse(c) != 0)
+              WR("Invalid plugin rule: '%s'", c);
+#else
+            WR("Plugins are not supported on this system: '%s'", c);
+#endif
+            CONTINUE;
+        }
+
+        /* on /REGEX/ [in NAME] [debounce SECS] [max N] run COMMAND */
+        if (strncmp(c, "on ", strlen("on ")) == 0)
+        {
+#ifdef HAVE_SPAWN_H
+            if (hook_parse(c) != 0)
+              WR("Invalid hook rule: '%s'", c);
+#else
+            WR("Hooks are not supported on this system: '%s'", c);
+#endif
+            CONTINUE;
+        }
+
         if (strchr(c, ' '))
           *(strchr(c, ' ')) = '\0';
 
         if (strlen(c) == 0)
           CONTINUE;
 
-        if (!(entry_fp = fopen(c, "r")))
+        /* Directory tree: crawl it in parallel and watch what we can */
+        len = strlen(c);
+        if (len >= strlen(TREE_SUFFIX) &&
+            strcmp(c + len - strlen(TREE_SUFFIX), TREE_SUFFIX) == 0)
+        {
+            len -= strlen(TREE_SUFFIX);
+            c[len > 0 ? len : 1] = '\0';
+            watches_init(watches.budget);
+            fan_mark(c);
+            if (group)
+              group_add_tree(c, len, group);
+            DBG("Crawling tree: '%s'...", c);
+            found = tree_crawl(c, len, sysconf(_SC_NPROCESSORS_ONLN),
+                               shard_for(c), 1);
+            for (; found; found = tmp)
+            {
+                tmp = found->next;
+                if (data_lookup(found->shard, found->full_path))
+                  data_free(found);
+                else
+                {
+                    found->offset = -1; /* Only count what comes next */
+                    data_link(&head, found);
+                }
+            }
+            DBG("Monitoring %d tree files using %ld/%ld inotify watches, "
+                "%d directories polled", watches.n_files, watches.used,
+                watches.budget, watches.n_polled);
+            CONTINUE;
+        }
+
+        if (!(entry_fp = fopen(c, "re")))
         {
             WR("Could not open file: '%s'", c);
             CONTINUE;
         }
 
-        /* Add to list */ 
+        /* Add to list, watched with inotify if possible */
+        watches_init(watches.budget);
         DBG("Monitoring file: '%s'...", c);
-        tmp = head;
-        head = calloc(1, sizeof(data_t));
-        head->fp = entry_fp;
-        head->fd = fileno(entry_fp);
-        head->full_path = strdup(c);
-        head->base_name = strdup(basename((char *)head->full_path));
-        head->state = UPDATED; /* Force first update to process this */
-        head->buff = NULL;
-        head->next = tmp;
+        tmp = calloc(1, sizeof(data_t));
+        tmp->fp = entry_fp;
+        tmp->fd = fileno(entry_fp);
+        if (fstat(tmp->fd, &st) == 0)
+          tmp->ino = st.st_ino;
+        tmp->full_path = strdup(c);
+        tmp->base_name = strdup(basename((char *)tmp->full_path));
+        tmp->state = UPDATED; /* Force first update to process this */
+        tmp->shard = shard_for(tmp->full_path);
+        tmp->group = group;
+        tmp->wd = -1;
+        tmp->poll_ival = SHARD_TICK_MS;
+        tmp->offset = -1;
+        tmp->lag = -1;
+        tmp->buff = NULL;
+        mem_add(MEM_INDEX, sizeof(data_t) + strlen(tmp->full_path) + 1 +
+                           strlen(tmp->base_name) + 1, 3);
+        data_link(&head, tmp);
         free(line);
         line = NULL;
         (*nb_of_opened_files)++;
 
-        if (fcntl(head->fd, F_SETFL, fcntl(head->fd, F_GETFL) & ~O_NONBLOCK ) == -1)
-            ER("Can't set blocking to file %s", head->base_name);
+        if (fcntl(tmp->fd, F_SETFL, fcntl(tmp->fd, F_GETFL) & ~O_NONBLOCK ) == -1)
+            ER("Can't set blocking to file %s", tmp->base_name);
 
     }
 
@@ -688,6 +7672,19 @@ static data_t *data_init(const char *fname, int *nb_of_opened_files)
 }
 
 static void threads_destroy(pthread_t *thread) {
+    int i;
+
+    /* Shards first, the display thread may hold what they wait for.  One
+     * stuck in I/O may never let go: leave it behind.
+     */
+    for (i=0; i<n_shards; ++i)
+    {
+        pthread_cancel(shards[i].thread);
+        if (shards[i].stalled)
+          pthread_detach(shards[i].thread);
+        else
+          pthread_join(shards[i].thread, (void **) NULL);
+    }
     pthread_cancel(*thread);
     pthread_join(*thread, (void **) NULL);
     free(thread);
@@ -701,7 +7698,8 @@ static void data_destroy(data_t *datas)
     while (d)
     {
         curr = d;
-        fclose(d->fp);
+        if (d->fp)
+          fclose(d->fp);
         free(d->buff);
         d = curr->next;
         free(curr);
@@ -749,10 +7747,10 @@ static void data_update(data_t *datas)
           ER("Could not obtain file stats for: '%s'", d->base_name);
 
         /* If the file has been modified since last check, update */
-        if (stats.st_mtime != d->last_mod)
+        if (stats.st_mtime != d->last_mod.tv_sec)
         {
             get_last_line(d);
-            d->last_mod = stats.st_mtime;
+            d->last_mod.tv_sec = stats.st_mtime;
             d->state = UPDATED;
         }
     }
@@ -838,6 +7836,37 @@ static void screen_update(screen_t *screen, const data_t *show_details)
     update_panels_safe();
 }
 
+/* Read a time into 'seek_text', echoed on the message line.  Escape
+ * leaves it empty.
+ */
+static void prompt_time(void)
+{
+    char cmd = PROMPT_TIME;
+    size_t len = 0;
+    int c;
+
+    seek_text[0] = '\0';
+    write(fildes[PIPE_WRITE], &cmd, sizeof(cmd));
+    while ((c = getch()) != '\n' && c != KEY_ENTER)
+    {
+        if (c == 27)
+        {
+            seek_text[0] = '\0';
+            return;
+        }
+        else if ((c == KEY_BACKSPACE || c == 127 || c == '\b') && len > 0)
+          seek_text[--len] = '\0';
+        else if (c >= ' ' && c < 127 && len < sizeof(seek_text) - 1)
+        {
+            seek_text[len++] = c;
+            seek_text[len] = '\0';
+        }
+        else
+          continue;
+        write(fildes[PIPE_WRITE], &cmd, sizeof(cmd));
+    }
+}
+
 /* Capture user input (keys) and timeout to periodically referesh */
 static void process(screen_t *screen)
 {
@@ -849,6 +7878,62 @@ static void process(screen_t *screen)
     while ((c = getch()) != 'Q' && c != 'q')
     {
         cmd = 0;
+
+        /* Slow down while unfocused, back to full rate on any key */
+        if (c == KEY_FOCUS_OUT || c == KEY_FOCUS_IN)
+        {
+            if (c == KEY_FOCUS_IN)
+              __atomic_store_n(&last_input, now_ms(), __ATOMIC_RELAXED);
+            cmd = (c == KEY_FOCUS_OUT) ? LOW_POWER : FULL_POWER;
+            write(fildes[PIPE_WRITE], &cmd, sizeof(cmd));
+            continue;
+        }
+        __atomic_store_n(&last_input, now_ms(), __ATOMIC_RELAXED);
+        if (__atomic_load_n(&low_power, __ATOMIC_RELAXED))
+        {
+            cmd = FULL_POWER;
+            write(fildes[PIPE_WRITE], &cmd, sizeof(cmd));
+            cmd = 0;
+        }
+
+        /* Windows follow the terminal, even while frozen */
+        if (c == KEY_RESIZE)
+        {
+            cmd = RESIZE_SCREEN;
+            write(fildes[PIPE_WRITE], &cmd, sizeof(cmd));
+            continue;
+        }
+
+        /* Frozen: leave the screen alone until resumed */
+        if (c == 'f' || paused)
+        {
+            if (c == 'f')
+            {
+                cmd = TOGGLE_PAUSE;
+                write(fildes[PIPE_WRITE], &cmd, sizeof(cmd));
+            }
+            continue;
+        }
+
+        /* Split view: the keys drive the focused pane */
+        if (show_panes)
+        {
+            switch (c)
+            {
+                case KEY_UP:    case 'k': cmd = PANE_UP;        break;
+                case KEY_DOWN:  case 'j': cmd = PANE_DOWN;      break;
+                case KEY_PPAGE: case 'b': cmd = PANE_PAGE_UP;   break;
+                case KEY_NPAGE: case ' ': cmd = PANE_PAGE_DOWN; break;
+                case KEY_END:   case 'G': cmd = PANE_FOLLOW;    break;
+                case '\t':                cmd = PANE_FOCUS;     break;
+                case 'p':                 cmd = UNPIN_PANE;     break;
+                case 's': case 27:        cmd = HIDE_PANES;     break;
+            }
+            if (cmd != 0)
+              write(fildes[PIPE_WRITE], &cmd, sizeof(cmd));
+            continue;
+        }
+
         switch (c)
         {
             case KEY_UP:
@@ -872,6 +7957,81 @@ static void process(screen_t *screen)
 
               break;
 
+            /* Pin the selected file into (or out of) the split view */
+            case 'p':
+              cmd = PIN_PANE;
+              break;
+
+            case 's':
+              cmd = SHOW_PANES;
+              break;
+
+            /* Where the memory goes */
+            case 'm':
+              cmd = SHOW_MEMORY;
+              break;
+
+            case 'o':
+              cmd = show_memory ? MEMORY_SORT : HIDE_DETAILS;
+              break;
+
+            /* Messages logged the most, across the files */
+            case 'T':
+              cmd = SHOW_TEMPLATES;
+              break;
+
+            /* Time spent in the plugins */
+            case 'P':
+              cmd = SHOW_PLUGINS;
+              break;
+
+            /* Where the lines wait on their way to the screen */
+            case 'I':
+              cmd = SHOW_STEPS;
+              break;
+
+            /* Line rates of the files over time */
+            case 'H':
+              cmd = SHOW_HEATMAP;
+              break;
+
+            case 'g':
+              cmd = show_heatmap ? HEAT_GROUP : HIDE_DETAILS;
+              break;
+
+            /* Files whose line rate changed the most first */
+            case 'a':
+              cmd = SORT_ANOMALY;
+              break;
+
+            /* Page through a line too long for the details window */
+            case KEY_NPAGE:
+            case ' ':
+              cmd = show_details ? DETAILS_DOWN : HIDE_DETAILS;
+              break;
+
+            case KEY_PPAGE:
+            case 'b':
+              cmd = show_details ? DETAILS_UP : HIDE_DETAILS;
+              break;
+
+            /* Details from where the file was last seen */
+            case 'u':
+              cmd = SHOW_UNREAD;
+              break;
+
+            /* Details from a point in time, or from the end again */
+            case 't':
+              if (show_details)
+                prompt_time();
+              cmd = show_details ? SEEK_TIME : HIDE_DETAILS;
+              break;
+
+            case KEY_END:
+            case 'G':
+              cmd = show_details ? DETAILS_FOLLOW : HIDE_DETAILS;
+              break;
+
             /*  If no key was registered, or on some wacky
              * input we don't care about don't modify the screen state.
              */
@@ -895,27 +8055,548 @@ static void process(screen_t *screen)
 }
 
 
+/* File of a scenario: declared, or found in a declared tree */
+static sim_file_t *sim_file(const char *name)
+{
+    int i;
+    size_t len;
+    sim_file_t *f;
+
+    for (i=0; i<sim.n_files; ++i)
+      if (strcmp(sim.files[i].name, name) == 0)
+        return &sim.files[i];
+
+    for (i=0; i<sim.n_files; ++i)
+    {
+        len = strlen(sim.files[i].name);
+        if (sim.files[i].dir && strncmp(sim.files[i].name, name, len) == 0 &&
+            name[len] == '/')
+          break;
+    }
+    if (i == sim.n_files)
+      return NULL;
+
+    if (!(sim.files = realloc(sim.files, (sim.n_files+1) * sizeof(*f))))
+      ER("Can't allocate memory for scenario files");
+    f = &sim.files[sim.n_files++];
+    memset(f, 0, sizeof(*f));
+    snprintf(f->name, sizeof(f->name), "%s", name);
+    f->tree = 1;
+    return f;
+}
+
+static void sim_declare(const char *name, int dir)
+{
+    sim_file_t *f;
+
+    if (!(sim.files = realloc(sim.files, (sim.n_files+1) * sizeof(*f))))
+      ER("Can't allocate memory for scenario files");
+    f = &sim.files[sim.n_files++];
+    memset(f, 0, sizeof(*f));
+    snprintf(f->name, sizeof(f->name), "%s", name);
+    f->dir = dir;
+}
+
+/* Read a scenario:
+ *     size ROWS COLS
+ *     file NAME
+ *     tree NAME
+ *     expect detect MS render MS
+ *     at MS append NAME [LINES]
+ *     at MS rotate NAME [LINES]
+ *     at MS truncate NAME [LINES]
+ *     at MS resize ROWS COLS
+ */
+static void sim_load(const char *script)
+{
+    FILE *fp;
+    char *c, *line = NULL, word[16], name[1024];
+    size_t sz = 0;
+    int n = 0;
+    sim_event_t ev;
+
+    if (!(fp = fopen(script, "r")))
+      ER("Could not open scenario '%s'", script);
+
+    while (getline(&line, &sz, fp) != -1)
+    {
+        ++n;
+        if (strchr(line, COMMENT_CHAR))
+          *(strchr(line, COMMENT_CHAR)) = '\0';
+        for (c = line; *c && isspace(*c); ++c)
+          ;
+        if (*c == '\0')
+          continue;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.lines = 1;
+        ev.detected = ev.rendered = -1;
+        if (sscanf(c, "size %d %d", &sim.rows, &sim.cols) == 2)
+          continue;
+        else if (sscanf(c, "file %1023s", name) == 1)
+          sim_declare(name, 0);
+        else if (sscanf(c, "tree %1023s", name) == 1)
+          sim_declare(name, 1);
+        else if (sscanf(c, "expect detect %ld render %ld",
+                        &sim.detect_ms, &sim.render_ms) == 2)
+          continue;
+        else if (sscanf(c, "at %lld %15s", &ev.at, word) == 2)
+        {
+            if (strcmp(word, "resize") == 0)
+            {
+                ev.what = SIM_RESIZE;
+                if (sscanf(c, "at %*d %*s %d %d", &ev.rows, &ev.cols) != 2)
+                  ER("%s:%d: resize needs ROWS COLS", script, n);
+            }
+            else
+            {
+                if (strcmp(word, "append") == 0)
+                  ev.what = SIM_APPEND;
+                else if (strcmp(word, "rotate") == 0)
+                  ev.what = SIM_ROTATE;
+                else if (strcmp(word, "truncate") == 0)
+                  ev.what = SIM_TRUNCATE;
+                else
+                  ER("%s:%d: unknown event '%s'", script, n, word);
+                if (sscanf(c, "at %*d %*s %1023s %d", ev.name, &ev.lines) < 1 ||
+                    ev.lines <= 0)
+                  ER("%s:%d: %s needs NAME [LINES]", script, n, word);
+                if (!sim_file(ev.name))
+                  ER("%s:%d: '%s' is neither a file nor in a tree",
+                     script, n, ev.name);
+            }
+            if (sim.n_events > 0 && ev.at < sim.events[sim.n_events-1].at)
+              ER("%s:%d: events must be in time order", script, n);
+            snprintf(ev.marker, sizeof(ev.marker), "<sim:%03d>", sim.n_events);
+
+            sim.events = realloc(sim.events,
+                                 (sim.n_events+1) * sizeof(sim_event_t));
+            if (!sim.events)
+              ER("Can't allocate memory for scenario events");
+            sim.events[sim.n_events++] = ev;
+        }
+        else
+          ER("%s:%d: invalid scenario line '%s'", script, n, c);
+    }
+    free(line);
+    fclose(fp);
+}
+
+/* Create the files of the scenario in a scratch directory, and a
+ * configuration watching them
+ */
+static void sim_setup(char *config, size_t size)
+{
+    FILE *fp, *f;
+    char path[PATH_MAX];
+    int i;
+
+    snprintf(sim.dir, sizeof(sim.dir), "/tmp/treetop-sim.XXXXXX");
+    if (!mkdtemp(sim.dir))
+      ER("Can't create scratch directory: %s", strerror(errno));
+    snprintf(config, size, "%s/treetop.conf", sim.dir);
+    if (!(fp = fopen(config, "w")))
+      ER("Can't write '%s': %s", config, strerror(errno));
+
+    for (i=0; i<sim.n_files; ++i)
+    {
+        snprintf(path, sizeof(path), "%s/%s", sim.dir, sim.files[i].name);
+        if (sim.files[i].dir)
+        {
+            if (mkdir(path, 0755) == -1)
+              ER("Can't create '%s': %s", path, strerror(errno));
+            fprintf(fp, "%s%s\n", path, TREE_SUFFIX);
+        }
+        else if (!sim.files[i].tree)
+        {
+            if (!(f = fopen(path, "a")))
+              ER("Can't create '%s': %s", path, strerror(errno));
+            fclose(f);
+            fprintf(fp, "%s\n", path);
+        }
+    }
+    fclose(fp);
+}
+
+/* Remove the scratch directory */
+static void sim_remove(const char *path)
+{
+    DIR *dir;
+    struct dirent *e;
+    char child[PATH_MAX];
+    struct stat st;
+
+    if ((dir = opendir(path)))
+    {
+        while ((e = readdir(dir)))
+        {
+            if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+              continue;
+            snprintf(child, sizeof(child), "%s/%s", path, e->d_name);
+            if (lstat(child, &st) == 0 && S_ISDIR(st.st_mode))
+              sim_remove(child);
+            else
+              unlink(child);
+        }
+        closedir(dir);
+    }
+    rmdir(path);
+}
+
+/* File watched under this path, by any shard */
+static data_t *sim_lookup(const char *path)
+{
+    int i;
+    data_t *d;
+
+    for (i=0; i<n_shards; ++i)
+    {
+        for (d = shards[i].files; d; d = d->fnext)
+          if (strcmp(d->full_path, path) == 0)
+            return d;
+        if ((d = data_lookup(&shards[i], path)))
+          return d;
+    }
+    return NULL;
+}
+
+static void sim_write(const sim_event_t *ev, const char *path,
+                      const char *mode)
+{
+    FILE *fp;
+    int i;
+
+    if (!(fp = fopen(path, mode)))
+      ER("Can't write '%s': %s", path, strerror(errno));
+    for (i=0; i<ev->lines; ++i)
+      fprintf(fp, "%s line %d\n", ev->marker, i+1);
+    fclose(fp);
+}
+
+/* Make an event happen, now */
+static void sim_apply(screen_t *screen, sim_event_t *ev)
+{
+    char path[PATH_MAX], old[PATH_MAX + 2];
+    sim_file_t *f;
+
+    if (ev->what == SIM_RESIZE)
+    {
+        /* What KEY_RESIZE sends to the display */
+        resizeterm(ev->rows, ev->cols);
+        ui_command(screen, RESIZE_SCREEN);
+        ev->detected = sim.now;
+        return;
+    }
+
+    f = sim_file(ev->name);
+    snprintf(path, sizeof(path), "%s/%s", sim.dir, ev->name);
+    switch (ev->what)
+    {
+        case SIM_APPEND:
+            sim_write(ev, path, "a");
+            f->lines += ev->lines;
+            break;
+        case SIM_ROTATE:
+            /* A tree file comes back as a new file, a plain one is
+             * reopened and keeps counting
+             */
+            ev->gone = f->tree ? sim_lookup(path) : NULL;
+            snprintf(old, sizeof(old), "%s.1", path);
+            if (rename(path, old) == -1)
+              ER("Can't rotate '%s': %s", path, strerror(errno));
+            sim_write(ev, path, "w");
+            f->lines = f->tree ? (unsigned long)ev->lines
+                               : f->lines + ev->lines;
+            break;
+        case SIM_TRUNCATE:
+            if (truncate(path, 0) == -1)
+              ER("Can't truncate '%s': %s", path, strerror(errno));
+            sim_write(ev, path, "a");
+            f->lines += ev->lines;
+            break;
+    }
+    ev->expect = f->lines;
+}
+
+/* Is what the event wrote on screen? */
+static int sim_shown(screen_t *screen, const sim_event_t *ev)
+{
+    char row[1024];
+    int y;
+
+    if (ev->what == SIM_RESIZE)
+      return getmaxy(screen->master) == ev->rows &&
+             getmaxx(screen->master) == ev->cols;
+
+    for (y=0; y<getmaxy(screen->content); ++y)
+      if (mvwinnstr(screen->content, y, 0, row, sizeof(row) - 1) != ERR &&
+          strstr(row, ev->marker))
+        return 1;
+    return 0;
+}
+
+/* Note which of the events happened so far the shards saw (once the step
+ * of the shard which saw it is over, 'done'), and which ones the last frame
+ * shows
+ */
+static void sim_check(screen_t *screen, int applied, int drawn,
+                      const long long *done)
+{
+    char path[PATH_MAX];
+    data_t *d;
+    sim_event_t *ev;
+    int i, j;
+
+    for (i=0; i<applied; ++i)
+    {
+        ev = &sim.events[i];
+        if (ev->detected < 0)
+        {
+            snprintf(path, sizeof(path), "%s/%s", sim.dir, ev->name);
+            if ((d = sim_lookup(path)) && (const void *)d != ev->gone &&
+                d->lines >= ev->expect)
+              ev->detected = MAX(sim.now, done[d->shard->id]);
+        }
+        if (!drawn || ev->detected < 0 || ev->rendered >= 0 ||
+            !sim_shown(screen, ev))
+          continue;
+
+        /* Lines written before on the same file made it to this frame */
+        ev->rendered = sim.now;
+        for (j=0; j<i; ++j)
+          if (sim.events[j].what == ev->what && sim.events[j].rendered < 0 &&
+              sim.events[j].detected >= 0 &&
+              strcmp(sim.events[j].name, ev->name) == 0)
+            sim.events[j].rendered = sim.now;
+    }
+}
+
+/* One round of a shard in a simulation, which takes the (real) time it
+ * takes, rounded up to the next millisecond: the shard is busy until then,
+ * and what it saw is only seen then.  Sets when it is due next.
+ */
+static void sim_step(int i, long long *due, long long *done)
+{
+    long long t0 = clock_ns();
+    int t = shard_step(&shards[i], sim.now);
+
+    done[i] = sim.now + (clock_ns() - t0 + 999999) / 1000000;
+    due[i] = (t < 0) ? -1 : done[i] + t;
+}
+
+/* Run a scenario against the real watching, reading and drawing code, on a
+ * virtual clock and terminal.  What the files do is queued by the kernel
+ * at once, so the shards run whenever their threads would have woken up
+ * (an event, their own pacing) and are not busy with a previous round, and
+ * the display when a shard publishes something, one after the other.
+ * Returns 0 if every event was seen within the bounds of the scenario.
+ */
+static int sim_run(const char *script)
+{
+    char config[PATH_MAX], buf[64], what[1100];
+    long long due[MAX_SHARDS], done[MAX_SHARDS], ui_due, last_frame, end;
+    long long next, woken;
+    int i, pass, busy, applied = 0, opened = 0, failed = 0, maxx, maxy;
+    data_t *datas;
+    screen_t *screen;
+    sim_event_t *ev;
+    static const char *names[] = { "", "append", "rotate", "truncate",
+                                   "resize" };
+
+    sim_load(script);
+    sim_setup(config, sizeof(config));
+    now_ms = clock_virtual;
+    term_open = term_virtual;
+    if (pthread_mutex_init(&mtx_post_menu, NULL) < 0 ||
+        pthread_mutex_init(&mtx_update_panels, NULL) < 0)
+      ER("Can't initiate display mutexes");
+
+    datas = data_init(config, &opened);
+    screen = screen_create(datas, 0);
+    columns = COLS;
+    details_bytes = getMaxBytes(screen->details, &maxx, &maxy);
+    details_rows = maxy;
+    shards_prepare(screen);
+
+    /* Every file is read once before anything happens */
+    for (i=0; i<n_shards; ++i)
+      sim_step(i, due, done);
+    ui_due = 0;
+    last_frame = -FRAME_MS;
+    end = (sim.n_events ? sim.events[sim.n_events-1].at : 0) + 2 * IDLE_MS;
+
+    for (;;)
+    {
+        for (; applied < sim.n_events &&
+               sim.events[applied].at <= sim.now; ++applied)
+        {
+            sim_apply(screen, &sim.events[applied]);
+            if (sim.events[applied].what == SIM_RESIZE)
+              ui_due = sim.now; /* Commands are drawn at once */
+        }
+
+        /* Shards done with their last round which are due, or which have
+         * events waiting
+         */
+        woken = sim.now;
+        for (pass=0, busy=1; busy && pass<8; ++pass)
+        {
+            busy = 0;
+            for (i=0; i<n_shards; ++i)
+            {
+                if (sim.now < done[i] ||
+                    ((due[i] < 0 || sim.now < due[i]) &&
+                     shard_wait(&shards[i], 0) <= 0))
+                  continue;
+                sim_step(i, due, done);
+                woken = MAX(woken, done[i]);
+                busy = 1;
+            }
+        }
+        sim_check(screen, applied, 0, done);
+
+        /* Display, paced as in thread_read_files(), woken once the shards
+         * published
+         */
+        if (__atomic_load_n(&ui_woken, __ATOMIC_ACQUIRE))
+        {
+            while (read(ui_wake[PIPE_READ], buf, sizeof(buf)) > 0)
+              ;
+            __atomic_store_n(&ui_woken, 0, __ATOMIC_RELEASE);
+            ui_due = MIN(ui_due, MAX(woken, last_frame + FRAME_MS));
+        }
+        if (sim.now >= ui_due)
+        {
+            ui_frame(screen);
+            last_frame = sim.now;
+            ui_due = sim.now + IDLE_MS;
+            sim_check(screen, applied, 1, done);
+        }
+
+        if (sim.now >= end)
+          break;
+        next = MIN(end, ui_due);
+        if (applied < sim.n_events)
+          next = MIN(next, sim.events[applied].at);
+        for (i=0; i<n_shards; ++i)
+        {
+            if (due[i] >= 0)
+              next = MIN(next, due[i]);
+            if (done[i] > sim.now)
+              next = MIN(next, done[i]);
+        }
+        sim.now = MAX(next, sim.now + 1);
+    }
+    screen_destroy(screen);
+
+    printf("%8s  %-40s %8s %8s\n", "at (ms)", "event", "detect", "render");
+    for (i=0; i<sim.n_events; ++i)
+    {
+        ev = &sim.events[i];
+        if (ev->what == SIM_RESIZE)
+          snprintf(what, sizeof(what), "resize %dx%d", ev->cols, ev->rows);
+        else
+          snprintf(what, sizeof(what), "%s %s (%d)", names[ev->what],
+                   ev->name, ev->lines);
+        printf("%8lld  %-40s ", ev->at, what);
+        if (ev->detected < 0 || ev->rendered < 0)
+        {
+            printf("%8s %8s  MISSED\n", ev->detected < 0 ? "-" : "",
+                   ev->rendered < 0 ? "-" : "");
+            failed = 1;
+            continue;
+        }
+        printf("%5lld ms %5lld ms", ev->detected - ev->at,
+               ev->rendered - ev->at);
+        if ((sim.detect_ms >= 0 && ev->detected - ev->at > sim.detect_ms) ||
+            (sim.render_ms >= 0 && ev->rendered - ev->at > sim.render_ms))
+        {
+            printf("  TOO SLOW");
+            failed = 1;
+        }
+        printf("\n");
+    }
+
+    sim_remove(sim.dir);
+    return failed;
+}
+
+static void mem_signal(int sig)
+{
+    (void)sig;
+    __atomic_store_n(&mem_report_wanted, 1, __ATOMIC_RELEASE);
+    ui_notify();
+}
+
 int main(int argc, char **argv)
 {
-    int i, timeout_secs, opened_files = 0;
+    int i, timeout_secs, opened_files = 0, n = 0;
     screen_t *screen;
     data_t *datas;
     pthread_t *thread;
-    const char *fname;
+    const char *fname, *script;
     struct sigaction action;
 
     /* Args */
-    fname = 0;
+    fname = script = 0;
     timeout_secs = DEFAULT_TIMEOUT_SECS;
     for (i=1; i<argc; ++i)
     {
-        if (strncmp(argv[i], "-d", strlen("-d")) == 0)
+        if (strcmp(argv[i], "--cpu-budget") == 0)
+        {
+            if (i+1 < argc && atof(argv[i+1]) > 0)
+              govern.budget = atof(argv[++i]);
+            else
+              usage(argv[0], "Incorrect CPU budget specified");
+        }
+        else if (strcmp(argv[i], "--nice") == 0)
+          govern.nice = 1;
+        else if (strncmp(argv[i], "-d", strlen("-d")) == 0)
         {
             if (i+1 < argc)
               timeout_secs = atoi(argv[++i]);
             else
               usage(argv[0], "Incorrect timeout value specified");
         }
+        else if (strncmp(argv[i], "-w", strlen("-w")) == 0)
+        {
+            if (i+1 < argc && atol(argv[i+1]) >= 0)
+              watches.budget = atol(argv[++i]);
+            else
+              usage(argv[0], "Incorrect watch budget specified");
+        }
+        else if (strncmp(argv[i], "-F", strlen("-F")) == 0)
+          fan.on = 1;
+        else if (strncmp(argv[i], "-i", strlen("-i")) == 0)
+        {
+            if (i+1 < argc && atol(argv[i+1]) >= 0)
+              idle_ms = atol(argv[++i]) * 1000L;
+            else
+              usage(argv[0], "Incorrect idle time specified");
+        }
+        else if (strncmp(argv[i], "-p", strlen("-p")) == 0)
+        {
+            if (i+1 < argc && atoi(argv[i+1]) > 0 &&
+                atoi(argv[i+1]) <= MAX_PANES)
+              max_panes = atoi(argv[++i]);
+            else
+              usage(argv[0], "Incorrect number of panes specified");
+        }
+        else if (strncmp(argv[i], "-t", strlen("-t")) == 0)
+        {
+            if (i+1 < argc && atoi(argv[i+1]) >= 0 &&
+                atoi(argv[i+1]) <= MAX_SHARDS)
+              n = atoi(argv[++i]);
+            else
+              usage(argv[0], "Incorrect number of shards specified");
+        }
+        else if (strncmp(argv[i], "-S", strlen("-S")) == 0)
+        {
+            if (i+1 < argc)
+              script = argv[++i];
+            else
+              usage(argv[0], "Please provide a scenario");
+        }
         else if (strncmp(argv[i], "-h", strlen("-h")) == 0)
           usage(argv[0], NULL);
         else if (argv[i][0] != '-')
@@ -925,25 +8606,44 @@ int main(int argc, char **argv)
     }
 
     /* Sanity check args */
-    if (!fname)
+    if (!fname && !script)
       usage(argv[0], "Please provide a configuration file");
     if (timeout_secs < 0)
       usage(argv[0], "Incorrect timeout value specified");
 
-    DBG("Using config:  %s", fname);
+    if (fname)
+      DBG("Using config:  %s", fname);
     DBG("Using timeout: %d seconds", timeout_secs);
 
     /* Initializing pipe */
     if (pipe(fildes) == -1) {
         ER("Can't create pipe: %s", strerror(errno));
     }
+    if (pipe(ui_wake) == -1) {
+        ER("Can't create pipe: %s", strerror(errno));
+    }
+    fcntl(ui_wake[PIPE_READ], F_SETFL, O_NONBLOCK);
+    fcntl(ui_wake[PIPE_WRITE], F_SETFL, O_NONBLOCK);
+    for (i=0; i<2; ++i)
+    {
+        fd_cloexec(fildes[i]);
+        fd_cloexec(ui_wake[i]);
+    }
 
-    /* Disabling SIGUSR1 */
+    /* SIGUSR1 writes a memory report, SIGUSR2 is ignored */
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
     action.sa_handler = SIG_IGN;
-    sigaction(SIGUSR1, &action, NULL);
     sigaction(SIGUSR2, &action, NULL);
+    action.sa_handler = mem_signal;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, NULL);
 
-    /* Load data */
+    /* Load data, spread over the shards */
+    shards_init(n);
+    DBG("Using %d shards", n_shards);
+    if (script)
+      return sim_run(script);
     datas = data_init(fname, &opened_files);
 
     /* Initialize display */
@@ -960,6 +8660,7 @@ int main(int argc, char **argv)
 
     /* Cleanup */
     threads_destroy(thread);
+    plugins_destroy();
     data_destroy(screen->datas);
     screen_destroy(screen);
 
@@ -0,0 +1,70 @@
+/* Interface of the treetop line processor plugins.
+ *
+ * A plugin is a shared object named in the config by a line of the form
+ * 'plugin PATH [in NAME] [args ARGS]'.  It gets the lines appended to the
+ * files matching the NAME glob (all files by default) in batches, on the
+ * threads reading the files: a given file is always handed over by the same
+ * thread, but several files may be at once, so what the plugin shares
+ * between files must be locked.  A batch is never empty.
+ *
+ * It exports:
+ *
+ *   int treetop_plugin_init(int version, const char *args, void **state);
+ *     Called once, when the config is read, with TREETOP_PLUGIN_VERSION and
+ *     ARGS (NULL if none).  What is stored in 'state' is handed back to the
+ *     other calls.  Returns 0 on success, the plugin is not used otherwise.
+ *
+ *   void treetop_plugin_lines(void *state, const treetop_batch_t *batch,
+ *                             treetop_note_t *note);
+ *     Called with lines appended to a file.  'note' belongs to the file (it
+ *     starts zeroed) and is shown as the plugin leaves it.
+ *
+ *   void treetop_plugin_fini(void *state);
+ *     Optional, called when treetop quits.
+ */
+#ifndef TREETOP_PLUGIN_H
+#define TREETOP_PLUGIN_H
+
+#include <sys/types.h>
+
+#define TREETOP_PLUGIN_VERSION 1
+
+/* Sizes of what a plugin tells of a file */
+#define TREETOP_ROW_LEN  160
+#define TREETOP_COUNTERS 4
+
+/* How a row is shown */
+#define TREETOP_PLAIN  0
+#define TREETOP_BOLD   1  /* Worth a look */
+#define TREETOP_ALERT  2  /* Shown in reverse video */
+
+/* Lines appended to a file, NUL terminated and without their newline.  A
+ * line is cut after 4096 bytes: its length is what was kept of it.
+ */
+typedef struct _treetop_batch_t
+{
+    const char *path;            /* File they were appended to */
+    size_t n;
+    const char *const *lines;
+    const size_t *lens;
+    const off_t *offsets;        /* Where each line starts in the file */
+} treetop_batch_t;
+
+/* What a plugin tells of a file */
+typedef struct _treetop_note_t
+{
+    char row[TREETOP_ROW_LEN];   /* Shown instead of the last line, unless
+                                  * empty */
+    int highlight;               /* TREETOP_PLAIN, _BOLD or _ALERT */
+    const char *names[TREETOP_COUNTERS]; /* Counters shown, unless NULL */
+    long counters[TREETOP_COUNTERS];
+} treetop_note_t;
+
+typedef int treetop_plugin_init_t(int version, const char *args,
+                                  void **state);
+typedef void treetop_plugin_lines_t(void *state,
+                                    const treetop_batch_t *batch,
+                                    treetop_note_t *note);
+typedef void treetop_plugin_fini_t(void *state);
+
+#endif /* TREETOP_PLUGIN_H */